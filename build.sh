@@ -102,10 +102,17 @@ if [ "$build_target" = "wasm" ] || [ "$build_target" = "clang" ]; then
     "
 
     clang $flags_wasm -o build/wasm/test.wasm \
-      $flags_common $flags_debug_opt $sources_test
+      $flags_common $flags_debug_opt $sources_test || exit 1
 
     cp build/wasm/test.wasm web/test.wasm
 
+    # Runs headless if Node is around, otherwise load web/index.html instead
+    which node &> /dev/null
+    if [ "$?" == "0" ]; then
+      node web/js/headless.js build/wasm/test.wasm $args
+      exit $?
+    fi
+
   # Native
   elif [ "$build_target" = "clang" ]; then
 
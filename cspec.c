@@ -22,6 +22,54 @@
 * SOFTWARE.
 */
 
+#if defined(open) || defined(fopen) || defined(mmap) || defined(pthread_create) \
+||  defined(read) || defined(write) || defined(pthread_mutex_lock)
+# if defined(__unix__) || defined(__APPLE__)
+#  define _CSPEC_USE_RESOURCE_TESTING_
+# endif
+# undef open
+# undef close
+# undef socket
+# undef fopen
+# undef fclose
+# undef mmap
+# undef munmap
+# undef pthread_create
+# undef pthread_join
+# undef pthread_detach
+# undef read
+# undef write
+# undef readv
+# undef writev
+# undef fsync
+# undef epoll_wait
+# undef pthread_mutex_lock
+# undef pthread_mutex_trylock
+# undef pthread_rwlock_rdlock
+# undef pthread_rwlock_wrlock
+# undef pthread_rwlock_tryrdlock
+# undef pthread_rwlock_trywrlock
+# undef pthread_cond_wait
+# undef pthread_cond_timedwait
+
+/* to import the real open / close / etc. */
+# ifdef _CSPEC_USE_RESOURCE_TESTING_
+#  include <errno.h>
+#  include <fcntl.h>
+#  include <pthread.h>
+#  include <stdarg.h>
+#  include <stdio.h>
+#  include <sys/mman.h>
+#  include <sys/socket.h>
+#  include <sys/uio.h>
+#  include <time.h>
+#  include <unistd.h>
+#  ifdef __linux__
+#   include <sys/epoll.h>
+#  endif
+# endif
+#endif
+
 #ifdef malloc
 # define _CSPEC_USE_MEMORY_TESTING_
 # undef malloc
@@ -31,6 +79,20 @@
 
 /* to import real malloc / free / etc. */
 # include <stdlib.h>
+
+/* page protection for the guard memory level */
+# if defined(__unix__) || defined(__APPLE__)
+#  include <sys/mman.h>
+#  include <unistd.h>
+#  if defined(MAP_ANONYMOUS) || defined(MAP_ANON)
+#   define _CSPEC_USE_GUARD_PAGES_
+#  endif
+# elif defined(_WIN32)
+__declspec(dllimport) void* __stdcall VirtualAlloc(void*, size_t, unsigned long, unsigned long);
+__declspec(dllimport) int __stdcall VirtualProtect(void*, size_t, unsigned long, unsigned long*);
+__declspec(dllimport) int __stdcall VirtualFree(void*, size_t, unsigned long);
+#  define _CSPEC_USE_GUARD_PAGES_
+# endif
 #endif
 
 #include "cspec.h"
@@ -55,9 +117,19 @@ typedef enum {
   CONCOL_bWhite = 0x1ffffff,
 } ConsoleColor;
 extern void js_log(const char* str, unsigned int len, ConsoleColor color);
+extern void js_log_lines(const char* str, unsigned int len,
+  const ConsoleColor* colors, unsigned int count
+);
 
 #else
-extern int puts(const char* s);
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+# ifdef __GNUC__
+#  define _CSPEC_USE_THREADS_
+# endif
 
 typedef enum {
   CONCOL_Black   = 30, /* \033[0;30m */
@@ -79,6 +151,12 @@ typedef enum {
 } ConsoleColor;
 #endif
 
+#ifdef _CSPEC_USE_THREADS_
+# define cspec_thread_local __thread
+#else
+# define cspec_thread_local
+#endif
+
 typedef enum PrintLevel {
   NOT_PRINTED = 0,
   LOGGED,
@@ -117,8 +195,16 @@ static Verbosity param_verbose = V_NONE;    /* -v or -va or -vn */
 static int param_tabsize = 2;               /* -t [n] */
 static csBool param_padding = FALSE;        /* -p */
 static csBool param_no_expect_fail = FALSE; /* -f */
-static csBool param_memory_test = TRUE;     /* -m (to disable) */
+static MemoryLevel param_memory_level = memory_level_fence; /* -m (off) */
+static csBool param_memory_heap = FALSE;    /* --heap-memory */
+static csSize param_sample_bytes = 0;       /* --sample-allocs */
+static csBool param_memory_global = FALSE;  /* --global-memory */
+static csSize param_stack_size = 0;         /* --stack-size */
+static csBool param_line_buffered = FALSE;  /* --line-buffered */
 static csBool param_show_types = FALSE;     /* -s */
+static csBool param_progress = TRUE;        /* --no-progress */
+static int param_shard_index = 0;           /* --shard i/n, counted from 0 */
+static int param_shard_count = 0;
 
 /*----------------------------------------------------------------------------*\
   Useful functions when we don't have a standrad library to rely on
@@ -188,20 +274,91 @@ int cspec_atoi(const char* s) {
 * To make this work as a "single-header" include as well as to make sure it
 * works on WASM varianets with no libc, all our string handling for output
 * should be done in a static space to avoid the need for malloc/free.
+*
+* Finished lines stay in the buffer and are written out together once enough
+* of them pile up, before each test, at the end of each test group, or when a
+* test fails, rather than with one call per line (--line-buffered keeps the old
+* behavior). The line being built can use all of the buffer past those waiting
+* to be written, and outside of WASM, a line that doesn't fit moves the buffer
+* to a bigger one from the real heap (never the memory testing allocator).
+*
+* WASM builds batch lines the same way, ending each with a null instead of a
+* newline (a line can have newlines of its own) and keeping its color, and
+* hand the whole batch to js_log_lines in one call.
+*
+* Threads started by a test format their messages in buffers of their own (see
+* Threads), so the output state is thread local where that's supported.
 */
-#define output_size 500
-#define output_float_precision 10
-static char output_buffer[output_size + 1];
-static csUint output_index = 0;
-static csUint output_indent = 0;
-static const char* output_fmt = NULL;
+#ifndef cspec_output_size
+# define cspec_output_size 65536
+#endif
+#define output_size cspec_output_size
+#define output_flush_size 8192
+#define output_size_max (output_size * 256)
+static char output_main[output_size + 2]; /* room for a newline and null */
+static cspec_thread_local char* output_buffer = output_main;
+static cspec_thread_local csUint output_capacity = output_size;
+static cspec_thread_local csUint output_index = 0;
+static cspec_thread_local csUint output_line = 0; /* start of the line */
+static cspec_thread_local csUint output_indent = 0;
+static cspec_thread_local const char* output_fmt = NULL;
+#ifdef __WASM__
+# define output_lines_max 512
+static ConsoleColor output_colors[output_lines_max];
+static csUint output_line_count = 0;
+#endif
+static csBool output_muted = FALSE; /* console reporter removed */
 
 static void output_continue_format(void);
+static void trace_begin(const char* name, const char* category);
+static void trace_end(void);
+static void progress_clear(void);
+
+#ifndef __WASM__
+static char* output_heap = NULL;
+
+static csBool output_grow(csUint needed) {
+  /* only the main buffer grows, threads write into spools of their own */
+  if (output_buffer != output_main && output_buffer != output_heap) {
+    return FALSE;
+  }
+  csUint capacity = output_capacity;
+  while (capacity < needed && capacity < output_size_max) capacity *= 2;
+  if (capacity < needed) return FALSE;
+
+  char* heap = malloc(capacity + 2);
+  if (!heap) return FALSE;
+  cspec_memcpy(heap, output_buffer, output_index);
+  free(output_heap);
+  output_buffer = output_heap = heap;
+  output_capacity = capacity;
+  return TRUE;
+}
+
+/* Goes back to the static buffer at the end of a run */
+static void output_release(void) {
+  if (!output_heap) return;
+  output_buffer = output_main;
+  output_capacity = output_size;
+  output_index = output_line = 0;
+  output_buffer[0] = '\0';
+  free(output_heap);
+  output_heap = NULL;
+}
+#else
+static csBool output_grow(csUint needed) { (void)needed; return FALSE; }
+static void output_release(void) { }
+#endif
+
+/* Checks there's room for n more characters, growing the buffer if needed */
+static csBool output_room(csUint n) {
+  return output_index + n <= output_capacity || output_grow(output_index + n);
+}
 
 static void output_str(const char* s) {
   if (!s) return;
   char prev = '\0';
-  while (*s && output_index < output_size) {
+  while (*s && output_room(1)) {
 
     /* handle case for {} format specifiers */
     if (!output_fmt && *s == '{') {
@@ -218,7 +375,7 @@ static void output_str(const char* s) {
 
     if (*s == '\n') {
       output_buffer[output_index++] = *(s++);
-      for (csUint i = 0; i < output_indent && output_index < output_size; ++i) {
+      for (csUint i = 0; i < output_indent && output_room(1); ++i) {
         output_buffer[output_index++] = ' ';
       }
       prev = ' ';
@@ -239,7 +396,7 @@ static void output_str(const char* s) {
       /* insert Unix - style color indicators for% c if we're not in WASM */
       else if (*(s + 1) == 'c') {
         char color_indicator[] = "\033[_;3_m";
-        if (output_index < output_size - sizeof(color_indicator)) {
+        if (output_room(sizeof(color_indicator))) {
           for (csUint i = 0; i < sizeof(color_indicator) - 1; ++i) {
             output_buffer[output_index++] = color_indicator[i];
           }
@@ -257,16 +414,24 @@ static void output_str(const char* s) {
 }
 
 static void output_str_quotes(const char* s, char q) {
-  if (output_index >= output_size - 2) return;
+  if (!output_room(3)) return;
   output_buffer[output_index++] = q;
   while (s && *s) {
-    if (output_index >= output_size - 1) break;
+    if (!output_room(2)) break;
     output_buffer[output_index++] = *s++;
   }
   output_buffer[output_index++] = q;
   output_continue_format();
 }
 
+/* Copies text as-is, without any format or color handling */
+static void output_raw(const char* s) {
+  while (s && *s && output_room(1)) {
+    output_buffer[output_index++] = *s++;
+  }
+  output_continue_format();
+}
+
 static void output_continue_format(void) {
   if (output_fmt) {
     const char* tmp = output_fmt;
@@ -277,7 +442,7 @@ static void output_continue_format(void) {
 }
 
 static csBool output_char_no_fmt(char c) {
-  if (output_index >= output_size) return FALSE;
+  if (!output_room(1)) return FALSE;
   if (c <= 0x1F || c == 0x7F) c = '.';
   output_buffer[output_index++] = c;
   return TRUE;
@@ -289,7 +454,7 @@ static void output_char(char c) {
 }
 
 static void output_hex(char c) {
-  if (output_index >= output_size - 1) return;
+  if (!output_room(2)) return;
   unsigned char h = ((unsigned char)c) % 16;
   h += h >= 10 ? 'A'-10 : '0';
   output_buffer[output_index + 1] = h;
@@ -301,7 +466,10 @@ static void output_hex(char c) {
 }
 
 static void output_pad(csUint until_pos, char c) {
-  if (until_pos > output_size) until_pos = output_size;
+  until_pos += output_line;
+  if (until_pos > output_index && !output_room(until_pos - output_index)) {
+    until_pos = output_capacity;
+  }
   while (output_index < until_pos) {
     output_buffer[output_index++] = c;
   }
@@ -309,13 +477,13 @@ static void output_pad(csUint until_pos, char c) {
 }
 
 static void _output_uint_ignore_format(unsigned long long int i) {
-  if (output_index >= output_size) return;
+  if (!output_room(1)) return;
   if (i == 0) {
     output_buffer[output_index++] = '0';
     return;
   }
   csUint start = output_index;
-  while (i && output_index < output_size) {
+  while (i && output_room(1)) {
     output_buffer[output_index++] = '0' + (i % 10);
     i /= 10;
   }
@@ -330,18 +498,19 @@ static void _output_uint_ignore_format(unsigned long long int i) {
 }
 
 static void output_ptr(const void* ptr) {
-  if (output_index >= output_size - 10) return;
+  const csUint width = 2 + sizeof(void*) * 2;
+  if (!output_room(width + 1)) return;
   long long unsigned int p = (long long unsigned int)ptr;
   char* begin = output_buffer + output_index;
   begin[0] = '0';
   begin[1] = 'x';
-  for (int i = 10; i-- > 2;) {
+  for (csUint i = width; i-- > 2;) {
     char d = p % 16;
     d += d >= 10 ? 'A'-10 : '0';
     begin[i] = d;
     p /= 16;
   }
-  output_index += 10;
+  output_index += width;
   output_continue_format();
 }
 
@@ -358,28 +527,302 @@ static void output_sint(long long int i) {
   output_uint((unsigned long long int)i);
 }
 
-static void output_float_p(double f, int precision) {
-  if (f < 0.0) {
-    output_buffer[output_index++] = '-';
-    f *= -1.0;
+/*
+* Floats are printed with the fewest digits that still read back as the same
+* value, using Grisu2 from Loitsch's "Printing Floating-Point Numbers Quickly
+* and Accurately with Integers". The value and the halfway points to its
+* neighbours are scaled by a cached power of ten so that the digits between
+* them can be found with 64-bit integer math alone, without needing libc.
+*/
+typedef struct FloatDiy {
+  unsigned long long f;
+  int e;
+} FloatDiy;
+
+static const struct {
+  unsigned long long f;
+  int e;
+  int k;
+} float_pow10_cache[] = {
+  { 0xAB70FE17C79AC6CAULL, -1060, -300 },
+  { 0xFF77B1FCBEBCDC4FULL, -1034, -292 },
+  { 0xBE5691EF416BD60CULL, -1007, -284 },
+  { 0x8DD01FAD907FFC3CULL,  -980, -276 },
+  { 0xD3515C2831559A83ULL,  -954, -268 },
+  { 0x9D71AC8FADA6C9B5ULL,  -927, -260 },
+  { 0xEA9C227723EE8BCBULL,  -901, -252 },
+  { 0xAECC49914078536DULL,  -874, -244 },
+  { 0x823C12795DB6CE57ULL,  -847, -236 },
+  { 0xC21094364DFB5637ULL,  -821, -228 },
+  { 0x9096EA6F3848984FULL,  -794, -220 },
+  { 0xD77485CB25823AC7ULL,  -768, -212 },
+  { 0xA086CFCD97BF97F4ULL,  -741, -204 },
+  { 0xEF340A98172AACE5ULL,  -715, -196 },
+  { 0xB23867FB2A35B28EULL,  -688, -188 },
+  { 0x84C8D4DFD2C63F3BULL,  -661, -180 },
+  { 0xC5DD44271AD3CDBAULL,  -635, -172 },
+  { 0x936B9FCEBB25C996ULL,  -608, -164 },
+  { 0xDBAC6C247D62A584ULL,  -582, -156 },
+  { 0xA3AB66580D5FDAF6ULL,  -555, -148 },
+  { 0xF3E2F893DEC3F126ULL,  -529, -140 },
+  { 0xB5B5ADA8AAFF80B8ULL,  -502, -132 },
+  { 0x87625F056C7C4A8BULL,  -475, -124 },
+  { 0xC9BCFF6034C13053ULL,  -449, -116 },
+  { 0x964E858C91BA2655ULL,  -422, -108 },
+  { 0xDFF9772470297EBDULL,  -396, -100 },
+  { 0xA6DFBD9FB8E5B88FULL,  -369,  -92 },
+  { 0xF8A95FCF88747D94ULL,  -343,  -84 },
+  { 0xB94470938FA89BCFULL,  -316,  -76 },
+  { 0x8A08F0F8BF0F156BULL,  -289,  -68 },
+  { 0xCDB02555653131B6ULL,  -263,  -60 },
+  { 0x993FE2C6D07B7FACULL,  -236,  -52 },
+  { 0xE45C10C42A2B3B06ULL,  -210,  -44 },
+  { 0xAA242499697392D3ULL,  -183,  -36 },
+  { 0xFD87B5F28300CA0EULL,  -157,  -28 },
+  { 0xBCE5086492111AEBULL,  -130,  -20 },
+  { 0x8CBCCC096F5088CCULL,  -103,  -12 },
+  { 0xD1B71758E219652CULL,   -77,   -4 },
+  { 0x9C40000000000000ULL,   -50,    4 },
+  { 0xE8D4A51000000000ULL,   -24,   12 },
+  { 0xAD78EBC5AC620000ULL,     3,   20 },
+  { 0x813F3978F8940984ULL,    30,   28 },
+  { 0xC097CE7BC90715B3ULL,    56,   36 },
+  { 0x8F7E32CE7BEA5C70ULL,    83,   44 },
+  { 0xD5D238A4ABE98068ULL,   109,   52 },
+  { 0x9F4F2726179A2245ULL,   136,   60 },
+  { 0xED63A231D4C4FB27ULL,   162,   68 },
+  { 0xB0DE65388CC8ADA8ULL,   189,   76 },
+  { 0x83C7088E1AAB65DBULL,   216,   84 },
+  { 0xC45D1DF942711D9AULL,   242,   92 },
+  { 0x924D692CA61BE758ULL,   269,  100 },
+  { 0xDA01EE641A708DEAULL,   295,  108 },
+  { 0xA26DA3999AEF774AULL,   322,  116 },
+  { 0xF209787BB47D6B85ULL,   348,  124 },
+  { 0xB454E4A179DD1877ULL,   375,  132 },
+  { 0x865B86925B9BC5C2ULL,   402,  140 },
+  { 0xC83553C5C8965D3DULL,   428,  148 },
+  { 0x952AB45CFA97A0B3ULL,   455,  156 },
+  { 0xDE469FBD99A05FE3ULL,   481,  164 },
+  { 0xA59BC234DB398C25ULL,   508,  172 },
+  { 0xF6C69A72A3989F5CULL,   534,  180 },
+  { 0xB7DCBF5354E9BECEULL,   561,  188 },
+  { 0x88FCF317F22241E2ULL,   588,  196 },
+  { 0xCC20CE9BD35C78A5ULL,   614,  204 },
+  { 0x98165AF37B2153DFULL,   641,  212 },
+  { 0xE2A0B5DC971F303AULL,   667,  220 },
+  { 0xA8D9D1535CE3B396ULL,   694,  228 },
+  { 0xFB9B7CD9A4A7443CULL,   720,  236 },
+  { 0xBB764C4CA7A44410ULL,   747,  244 },
+  { 0x8BAB8EEFB6409C1AULL,   774,  252 },
+  { 0xD01FEF10A657842CULL,   800,  260 },
+  { 0x9B10A4E5E9913129ULL,   827,  268 },
+  { 0xE7109BFBA19C0C9DULL,   853,  276 },
+  { 0xAC2820D9623BF429ULL,   880,  284 },
+  { 0x80444B5E7AA7CF85ULL,   907,  292 },
+  { 0xBF21E44003ACDD2DULL,   933,  300 },
+  { 0x8E679C2F5E44FF8FULL,   960,  308 },
+  { 0xD433179D9C8CB841ULL,   986,  316 },
+  { 0x9E19DB92B4E31BA9ULL,  1013,  324 },
+};
+
+#define float_pow10_min -300
+#define float_pow10_step 8
+#define float_alpha -60
+
+static FloatDiy float_mul(FloatDiy x, FloatDiy y) {
+  const unsigned long long lo = 0xFFFFFFFFULL;
+  unsigned long long a = x.f >> 32, b = x.f & lo;
+  unsigned long long c = y.f >> 32, d = y.f & lo;
+  unsigned long long ad = a * d, bc = b * c;
+  unsigned long long mid = ((b * d) >> 32) + (ad & lo) + (bc & lo);
+  mid += 1ULL << 31; /* round the dropped half */
+  FloatDiy r = { a * c + (ad >> 32) + (bc >> 32), x.e + y.e + 64 };
+  r.f += mid >> 32;
+  return r;
+}
+
+static FloatDiy float_normalize(FloatDiy x) {
+  while (!(x.f >> 63)) {
+    x.f <<= 1;
+    --x.e;
+  }
+  return x;
+}
+
+/* Moves the last digit down while that brings it closer to the value */
+static void float_round(
+  char* digits, int len, unsigned long long dist, unsigned long long delta,
+  unsigned long long rest, unsigned long long ten_k
+) {
+  while (rest < dist && delta - rest >= ten_k
+  && (rest + ten_k < dist || dist - rest > rest + ten_k - dist)
+  ) {
+    --digits[len - 1];
+    rest += ten_k;
+  }
+}
+
+/* Writes the digits of w, returning the count and setting the exponent */
+static int float_digits(
+  char* digits, int* exp10, FloatDiy m_minus, FloatDiy w, FloatDiy m_plus
+) {
+  int k = float_alpha - m_plus.e - 1;
+  k = (k * 78913) / (1 << 18) + (k > 0);
+  int index = (-float_pow10_min + k + float_pow10_step - 1) / float_pow10_step;
+  FloatDiy c = { float_pow10_cache[index].f, float_pow10_cache[index].e };
+  *exp10 = -float_pow10_cache[index].k;
+
+  w = float_mul(w, c);
+  m_minus = float_mul(m_minus, c);
+  m_plus = float_mul(m_plus, c);
+  ++m_minus.f;
+  --m_plus.f;
+
+  unsigned long long delta = m_plus.f - m_minus.f;
+  unsigned long long dist = m_plus.f - w.f;
+  int shift = -m_plus.e;
+  unsigned long long one = 1ULL << shift;
+  unsigned int p1 = (unsigned int)(m_plus.f >> shift);
+  unsigned long long p2 = m_plus.f & (one - 1);
+  int len = 0;
+
+  unsigned int pow10 = 1;
+  int n = 1;
+  while (n < 10 && p1 / pow10 >= 10) {
+    pow10 *= 10;
+    ++n;
+  }
+
+  while (n > 0) {
+    digits[len++] = (char)('0' + p1 / pow10);
+    p1 %= pow10;
+    --n;
+    unsigned long long rest = ((unsigned long long)p1 << shift) + p2;
+    if (rest <= delta) {
+      *exp10 += n;
+      float_round(digits, len, dist, delta, rest,
+        (unsigned long long)pow10 << shift
+      );
+      return len;
+    }
+    pow10 /= 10;
+  }
+
+  do {
+    p2 *= 10;
+    digits[len++] = (char)('0' + (p2 >> shift));
+    p2 &= one - 1;
+    delta *= 10;
+    dist *= 10;
+    --*exp10;
+  } while (p2 > delta);
+
+  float_round(digits, len, dist, delta, p2, one);
+  return len;
+}
+
+/* Plain notation for reasonable magnitudes, otherwise d.ddde+X */
+static void output_float_digits(const char* digits, int len, int exp10) {
+  int point = len + exp10;
+  char* out = output_buffer + output_index;
+
+  if (0 < point && point <= 21) {
+    for (int i = 0; i < point; ++i) {
+      *out++ = i < len ? digits[i] : '0';
+    }
+    if (point < len) {
+      *out++ = '.';
+      for (int i = point; i < len; ++i) *out++ = digits[i];
+    }
+  }
+  else if (-6 < point && point <= 0) {
+    *out++ = '0';
+    *out++ = '.';
+    for (int i = point; i < 0; ++i) *out++ = '0';
+    for (int i = 0; i < len; ++i) *out++ = digits[i];
   }
-  unsigned long long int integer_part = (unsigned long long int)f;
-  _output_uint_ignore_format(integer_part);
-  f -= integer_part;
-  if (f != 0.0) {
-    output_buffer[output_index++] = '.';
-    for (int i = precision; i && f >= 0.00000000001; --i) {
-      f *= 10.0;
-      integer_part = (unsigned long long int)f;
-      output_buffer[output_index++] = '0' + (char)integer_part;
-      f -= integer_part;
+  else {
+    *out++ = digits[0];
+    if (len > 1) {
+      *out++ = '.';
+      for (int i = 1; i < len; ++i) *out++ = digits[i];
     }
+    *out++ = 'e';
+    *out++ = point > 0 ? '+' : '-';
+    output_index = (csUint)(out - output_buffer);
+    _output_uint_ignore_format(point > 0 ? point - 1 : 1 - point);
+    return;
+  }
+
+  output_index = (csUint)(out - output_buffer);
+}
+
+/*
+* Splits out from the bit pattern so float and double can share this, since a
+* float needs its own (wider) boundaries to come out as its shortest digits.
+*/
+static void output_float_parts(
+  csBool negative, int exponent, unsigned long long fraction,
+  int precision, int bias, int exponent_max
+) {
+  /* longest is a sign, 17 digits, a point, and an exponent of 5 */
+  if (!output_room(33)) return;
+
+  if (exponent == exponent_max) {
+    output_str(fraction ? "nan" : negative ? "-inf" : "inf");
+    return;
+  }
+
+  if (negative) {
+    output_buffer[output_index++] = '-';
+  }
+
+  if (!exponent && !fraction) {
+    output_buffer[output_index++] = '0';
+    output_continue_format();
+    return;
+  }
+
+  FloatDiy v = { fraction, 1 - bias };
+  if (exponent) {
+    v.f += 1ULL << (precision - 1);
+    v.e = exponent - bias;
+  }
+
+  /* the gap below is half as wide when stepping down to a smaller exponent */
+  FloatDiy m_plus = { 2 * v.f + 1, v.e - 1 };
+  FloatDiy m_minus = { 2 * v.f - 1, v.e - 1 };
+  if (!fraction && exponent > 1) {
+    m_minus.f = 4 * v.f - 1;
+    m_minus.e = v.e - 2;
   }
+
+  m_plus = float_normalize(m_plus);
+  m_minus.f <<= m_minus.e - m_plus.e;
+  m_minus.e = m_plus.e;
+  v = float_normalize(v);
+
+  char digits[20];
+  int exp10 = 0;
+  int len = float_digits(digits, &exp10, m_minus, v, m_plus);
+  output_float_digits(digits, len, exp10);
   output_continue_format();
 }
 
-static void output_float(double f) {
-  output_float_p(f, output_float_precision);
+static void output_float(float f) {
+  unsigned int bits;
+  cspec_memcpy(&bits, &f, sizeof(bits));
+  output_float_parts(bits >> 31, (bits >> 23) & 0xFF, bits & 0x7FFFFF,
+    24, 150, 0xFF
+  );
+}
+
+static void output_double(double d) {
+  unsigned long long bits;
+  cspec_memcpy(&bits, &d, sizeof(bits));
+  output_float_parts(bits >> 63, (bits >> 52) & 0x7FF,
+    bits & 0xFFFFFFFFFFFFFULL, 53, 1075, 0x7FF
+  );
 }
 
 static void output_bool(csBool b) {
@@ -387,29 +830,71 @@ static void output_bool(csBool b) {
 }
 
 static void output_reset(void) {
-  output_index = 0;
-  output_buffer[0] = '\0';
+  output_index = output_line;
+  output_buffer[output_index] = '\0';
   output_fmt = NULL;
 }
 
+/* Writes out all the finished lines, keeping the one being built */
+static void output_flush(void) {
+  if (!output_line) return;
+
+#ifdef __WASM__
+  js_log_lines(output_buffer, output_line, output_colors, output_line_count);
+  output_line_count = 0;
+#else
+  /* puts adds the last newline back */
+  trace_begin("output_flush", "output");
+  progress_clear();
+  output_buffer[output_line - 1] = '\0';
+  puts(output_buffer);
+  trace_end();
+#endif
+
+  csUint line_length = output_index - output_line;
+  cspec_memcpy(output_buffer, output_buffer + output_line, line_length);
+  output_index = line_length;
+  output_line = 0;
+  output_buffer[output_index] = '\0';
+}
+
 static void output(const char* s) {
+  output_flush();
 #ifdef __WASM__
-  js_log(output_buffer, cspec_strlen(s), -1);
+  js_log(s, cspec_strlen(s), -1);
 #else
+  progress_clear();
   puts(s);
 #endif
 }
 
-static void output_print(void) {
-  if (output_fmt) output_str(output_fmt);
-
+static void output_emit(ConsoleColor color) {
+  if (output_muted) {
+    output_reset();
+    return;
+  }
 #ifdef __WASM__
-  js_log(output_buffer, output_index, -1);
+  output_colors[output_line_count++] = color;
+  output_buffer[output_index++] = '\0';
 #else
-  puts(output_buffer);
+  (void)color;
+  output_buffer[output_index++] = '\n';
 #endif
-
+  output_line = output_index;
   output_reset();
+
+  if (param_line_buffered || output_line >= output_flush_size
+#ifdef __WASM__
+  ||  output_line_count >= output_lines_max
+#endif
+  ) {
+    output_flush();
+  }
+}
+
+static void output_print(void) {
+  if (output_fmt) output_str(output_fmt);
+  output_emit((ConsoleColor)-1);
 }
 
 static void output_print_color(ConsoleColor color) {
@@ -418,7 +903,7 @@ static void output_print_color(ConsoleColor color) {
 
 #ifndef __WASM__
   /* find the color specifier if it was added into the string */
-  for (csUint i = 0; i < output_index; ++i) {
+  for (csUint i = output_line; i < output_index; ++i) {
     if (output_buffer[i] == '\033') {
       /* set boldness flag */
       output_buffer[i + 2] = color >= 40 ? '1' : '0';
@@ -435,19 +920,18 @@ static void output_print_color(ConsoleColor color) {
 #endif
 
   // finally print the string
-#ifdef __WASM__
-  js_log(output_buffer, output_index, color);
-#else
-  puts(output_buffer);
-#endif
-
-  output_reset();
+  output_emit(color);
 }
 
 /*----------------------------------------------------------------------------*\
   Memory Testing
 \*----------------------------------------------------------------------------*/
 
+static int print_headers(
+  int desc_color, PrintLevel desc_level, const char* to_append);
+static const char* report_capture(csUint mark);
+static void report_error(const char* prefix, const char* message);
+
 #ifdef _CSPEC_USE_MEMORY_TESTING_
 
 typedef enum MallocFailLevel {
@@ -465,6 +949,9 @@ typedef enum MallocFailLevel {
 typedef struct MemoryRecord {
   size_t size;
   csByte* block;
+  csByte* guard;  /* protected page after the block (guard level only) */
+  size_t mapped;  /* size of the pages mapped for the block, including guard */
+  const void* site; /* the caller, for blocks a test leaves to the ledger */
   csBool is_free;
 } MemoryRecord;
 
@@ -484,16 +971,274 @@ static csBool memory_expect_error = FALSE;
 static csBool memory_error = FALSE;
 static MallocFailLevel memory_malloc_fail = M_NORMAL;
 static int memory_malloc_forced_failures = 0;
+static MemoryLevel memory_active_level = memory_level_off;
 #define memory_records_grow_factor 1.5f
 
-static void memory_print_row(const csByte* row, int level, csBool target) {
+/*
+* Heap memory mode. The track and fence levels take blocks from the real heap
+* instead of the arena, each with a fence on either side, so a test can use as
+* much memory as it likes. Freed blocks are kept in quarantine to catch writes
+* after free, and released oldest first once they pass memory_heap_quarantine.
+*/
+static csBool memory_heap_active = FALSE;
+static size_t memory_heap_quarantined = 0;
+static size_t memory_heap_release_next = 0;
+
+/*
+* Heap and guard blocks aren't in address order, so they're found through an
+* open addressing hash index from the user pointer to its record number.
+*/
+typedef struct MemoryIndexSlot {
+  const csByte* ptr;
+  size_t record;
+} MemoryIndexSlot;
+
+typedef struct MemoryIndex {
+  MemoryIndexSlot* slots;
+  size_t capacity;
+  size_t used; /* including removed slots */
+} MemoryIndex;
+
+static MemoryIndex memory_index = { NULL, 0, 0 };
+static const csByte memory_index_removed = 0;
+
+/*
+* Address of the code that called into the allocator, used to group realloc
+* statistics by call site. Print with addr2line or a debugger to resolve it.
+*/
+#if defined(__GNUC__) && !defined(__WASM__)
+# define memory_caller() __builtin_return_address(0)
+#elif defined(_MSC_VER)
+# include <intrin.h>
+# define memory_caller() _ReturnAddress()
+#else
+# define memory_caller() NULL
+#endif
+
+/*
+* Realloc growth tracking. Each call site keeps the sequence of sizes it asked
+* for, and how many bytes were copied to a new block versus grown in place. If
+* a site keeps growing the same buffer by a constant amount, the growth is
+* additive rather than geometric, and every resize is a potential full copy.
+*/
+#define memory_realloc_sites_max 16
+#define memory_realloc_history 8
+#define memory_realloc_additive_limit 4
+
+typedef struct ReallocSite {
+  const void* site;
+  const void* last_result;
+  size_t copied;
+  size_t grown;
+  size_t last_delta;
+  size_t additive_delta;
+  size_t sizes[memory_realloc_history];
+  csUint count;
+  csUint additive_run;
+  csUint additive_max;
+} ReallocSite;
+
+static ReallocSite memory_realloc_sites[memory_realloc_sites_max];
+static int memory_realloc_site_count = 0;
+static size_t memory_realloc_copied = 0;
+static size_t memory_realloc_grown = 0;
+
+/*
+* Sampling allocation profiler. Rather than recording every allocation, about
+* one per memory_sample_interval bytes is sampled as a Poisson process, as in
+* tcmalloc: every allocated byte has the same chance of being picked, so large
+* blocks are almost always sampled and small ones rarely. Each sample is scaled
+* back up by its odds of being picked to estimate a heap profile per call site.
+* Works at every memory level, including off, so it can stay on while timing.
+*/
+#define memory_sample_sites_max 32
+#define memory_sample_live_max 512
+#define memory_sample_depth 8
+
+typedef struct SampleSite {
+  const void* site;
+  void* stack[memory_sample_depth];
+  int stack_size;
+  csUint samples;
+  double allocs;
+  double bytes;
+  double live;
+} SampleSite;
+
+typedef struct SampleLive {
+  const void* ptr;
+  int site;
+  double bytes;
+} SampleLive;
+
+static size_t memory_sample_interval = 0;
+static size_t memory_sample_countdown = 0;
+#define memory_sample_seed 0x2545F4914F6CDD1DULL
+static unsigned long long memory_sample_state = memory_sample_seed;
+static SampleSite memory_sample_sites[memory_sample_sites_max];
+static int memory_sample_site_count = 0;
+static csUint memory_sample_dropped = 0;
+static SampleLive memory_sample_live[memory_sample_live_max];
+static const csByte memory_sample_removed = 0;
+
+#if defined(__GLIBC__) && !defined(__WASM__)
+# include <execinfo.h>
+# define memory_sample_backtrace(stack, depth) backtrace(stack, depth)
+#else
+# define memory_sample_backtrace(stack, depth) ((void)(stack), (void)(depth), 0)
+#endif
+
+/*
+* Whole-run ledger. Allocations made outside of test bodies are always kept,
+* from before the run starts, so a test can free or resize them. With
+* `--global-memory`, allocations that go straight to the real malloc in tests
+* (with the memory level at off or count) are recorded too, and heap blocks a
+* test leaves behind, like a cache built on first use, join the ledger instead
+* of failing the test. Each is attributed to the test that was running, or to
+* the next one to start. Anything allocated since the run started that's still
+* live at exit is reported by call site, flagging sites that kept growing
+* across many tests.
+*/
+#define memory_ledger_growth_tests 4
+#define memory_ledger_report_max 16
+
+typedef struct LedgerEntry {
+  const void* ptr;
+  csByte* block;      /* what goes to the real allocator, before any fence */
+  size_t size;
+  const void* site;
+  const TestSuite* suite;
+  const TestGroup* group;
+  const char* desc;
+  int line;
+  csUint test;        /* serial number of the test it's attributed to */
+  csUint grown_test;  /* the last test that grew it with realloc */
+  csUint grown;       /* how many other tests have grown it */
+  csBool baseline;    /* allocated before the run started */
+} LedgerEntry;
+
+static LedgerEntry* memory_ledger = NULL;
+static size_t memory_ledger_size = 0;
+static size_t memory_ledger_capacity = 0;
+static MemoryIndex memory_ledger_index = { NULL, 0, 0 };
+static size_t memory_ledger_pending = 0;  /* entries waiting for a test */
+static size_t memory_ledger_bytes = 0;
+static size_t memory_ledger_bytes_at_begin = 0;
+static csUint memory_ledger_test = 0;
+static csUint memory_ledger_grew = 0;
+static const void* memory_ledger_site = NULL; /* caller of the allocation */
+
+/*
+* Guard pages. At the guard level every allocation gets pages of its own with
+* an inaccessible page directly after it, so an overrun faults on the first
+* byte past the (aligned) end of the block. Freed blocks have all their pages
+* protected to catch use after free, and are only unmapped when the test ends
+* so the addresses aren't handed out again while it runs.
+*/
+#define memory_guard_align 16
+
+#ifdef _CSPEC_USE_GUARD_PAGES_
+
+static size_t memory_page_size(void) {
+  static size_t page_size = 0;
+  if (!page_size) {
+#ifdef _WIN32
+    page_size = 4096;
+#else
+    long sys_page_size = sysconf(_SC_PAGESIZE);
+    page_size = sys_page_size > 0 ? (size_t)sys_page_size : 4096;
+#endif
+  }
+  return page_size;
+}
+
+static csByte* memory_pages_map(size_t size) {
+#ifdef _WIN32
+  /* MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE */
+  return VirtualAlloc(NULL, size, 0x3000, 0x04);
+#else
+# ifndef MAP_ANONYMOUS
+#  define MAP_ANONYMOUS MAP_ANON
+# endif
+  void* pages = mmap(
+    NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+  );
+  return pages == MAP_FAILED ? NULL : pages;
+#endif
+}
+
+static void memory_pages_protect(csByte* pages, size_t size) {
+#ifdef _WIN32
+  unsigned long old_protect;
+  VirtualProtect(pages, size, 0x01, &old_protect); /* PAGE_NOACCESS */
+#else
+  mprotect(pages, size, PROT_NONE);
+#endif
+}
+
+static void memory_pages_unmap(csByte* pages, size_t size) {
+#ifdef _WIN32
+  (void)size;
+  VirtualFree(pages, 0, 0x8000); /* MEM_RELEASE */
+#else
+  munmap(pages, size);
+#endif
+}
+
+static csByte* memory_guard_alloc(MemoryRecord* record, size_t size) {
+  size_t page = memory_page_size();
+  size_t body = (size + memory_guard_align - 1) & ~(size_t)(memory_guard_align - 1);
+  size_t data_pages = (memory_size_fence + body + page - 1) / page;
+  size_t mapped = (data_pages + 1) * page;
+
+  csByte* pages = memory_pages_map(mapped);
+  if (!pages) return NULL;
+
+  record->guard = pages + data_pages * page;
+  record->mapped = mapped;
+  record->block = record->guard - body - memory_size_fence;
+  memory_pages_protect(record->guard, page);
+
+  return record->block + memory_size_fence;
+}
+
+static void memory_guard_free(MemoryRecord* record) {
+  size_t page = memory_page_size();
+  memory_pages_protect(record->guard + page - record->mapped, record->mapped);
+}
+
+static void memory_guard_release(MemoryRecord* record) {
+  size_t page = memory_page_size();
+  memory_pages_unmap(record->guard + page - record->mapped, record->mapped);
+  record->guard = NULL;
+}
+
+#else
+
+static size_t memory_page_size(void) { return 1; }
+static csByte* memory_guard_alloc(MemoryRecord* r, size_t s) { (void)r; (void)s; return NULL; }
+static void memory_guard_free(MemoryRecord* record) { (void)record; }
+static void memory_guard_release(MemoryRecord* record) { record->guard = NULL; }
+
+#endif
+
+/* Where page protection isn't available, guard falls back to fences */
+static MemoryLevel memory_level_supported(MemoryLevel level) {
+#ifndef _CSPEC_USE_GUARD_PAGES_
+  if (level == memory_level_guard) return memory_level_fence;
+#endif
+  return level;
+}
+
+static void memory_print_row(
+  const csByte* row, int level, csBool target,
+  const csByte* lo, const csByte* hi
+) {
   output_pad(param_tabsize * level, ' ');
   output_ptr(row);
   if (target) output_str("-> "); else output_str(":  ");
   for (int i = 0; i < 16; ++i) {
-    if (row + i < _memory + memory_size_full
-    &&  row + i >= _memory
-    ) {
+    if (row + i < hi && row + i >= lo) {
       output_hex(row[i]);
       output_str(" ");
     } else {
@@ -502,9 +1247,7 @@ static void memory_print_row(const csByte* row, int level, csBool target) {
   }
   if (target) output_str("= "); else output_str("- ");
   for (int i = 0; i < 16; ++i) {
-    if (row + i < _memory + memory_size_full
-    && row + i >= _memory
-    ) {
+    if (row + i < hi && row + i >= lo) {
       output_char(row[i]);
     } else {
       output_char(' ');
@@ -513,22 +1256,76 @@ static void memory_print_row(const csByte* row, int level, csBool target) {
   output_print();
 }
 
+#define memory_print_rows_max 16
+
 static void memory_print_record(const MemoryRecord* record, int level) {
+  const csByte* lo = _memory;
+  const csByte* hi = _memory + memory_size_full;
+
+  /* guard blocks live in their own pages, and the guard page isn't readable */
+  if (record->guard) {
+    hi = record->guard;
+    lo = hi + memory_page_size() - record->mapped;
+    if (record->is_free) lo = hi; /* the whole mapping is protected */
+
+  /* heap blocks are only readable up to the end of their fences */
+  } else if (memory_heap_active
+  &&         record >= memory_records
+  &&         record < memory_records + memory_records_size
+  ) {
+    lo = record->block;
+    hi = record->block + record->size + memory_size_fence * 2;
+  }
+
+  /* large blocks only show the rows around each end */
+  size_t end = record->size + memory_size_fence + 16;
+  size_t skip_from = end, skip_to = end;
+  if (end > memory_print_rows_max * 16) {
+    skip_from = memory_print_rows_max / 2 * 16;
+    skip_to = end - memory_print_rows_max / 2 * 16;
+    skip_to += (16 - (skip_to - skip_from) % 16) % 16;
+  }
+
   size_t i = 0;
-  while (i < record->size + memory_size_fence + 16) {
-    memory_print_row(record->block + i - 16 + memory_size_fence, level, i == 16);
+  while (i < end) {
+    if (i == skip_from) {
+      output_pad(param_tabsize * level, ' ');
+      output_str("... ");
+      output_uint((skip_to - skip_from) / 16);
+      output_str(" rows");
+      output_print();
+      i = skip_to;
+      continue;
+    }
+    memory_print_row(
+      record->block + i - 16 + memory_size_fence, level, i == 16, lo, hi
+    );
     i += 16;
   }
   if (param_padding) output_print();
 }
 
+/* Guard blocks end at the protected page, so their trailing fence is only the
+* few bytes of padding needed to keep the block aligned. */
+static size_t memory_trailing_fence(const MemoryRecord* record) {
+  if (record->guard) {
+    return record->guard - (record->block + memory_size_fence + record->size);
+  }
+  return memory_size_fence;
+}
+
 static csBool memory_check_fence(MemoryRecord* record) {
+  if (memory_active_level < memory_level_fence) return TRUE;
+  if (record->guard && record->is_free) return TRUE; /* no longer readable */
+
+  const csByte* trailer = record->block + memory_size_fence + record->size;
+  size_t trailer_size = memory_trailing_fence(record);
+
   for (size_t i = 0; i < memory_size_fence; ++i) {
-    if ('b' != *(record->block + i)
-    ||  'e' != *(record->block + i + memory_size_fence + record->size)
-    ) {
-      return FALSE;
-    }
+    if ('b' != record->block[i]) return FALSE;
+  }
+  for (size_t i = 0; i < trailer_size; ++i) {
+    if ('e' != trailer[i]) return FALSE;
   }
   return TRUE;
 }
@@ -543,168 +1340,136 @@ static int memory_record_compare(const void* key_, const void* dat) {
   return 0;
 }
 
-static int print_headers(
-  int desc_color, PrintLevel desc_level, const char* to_append);
+static csBool memory_index_active(void) {
+  return memory_heap_active || memory_active_level == memory_level_guard;
+}
 
-void _cspec_memory_log_block(int line, const void* ptr) {
-  if ((test_current_line && test_current_line >= line)
-  || param_verbose < V_NOTES
-  ) {
-    return;
-  }
+static size_t memory_index_hash(const void* ptr) {
+  size_t hash = (size_t)ptr >> 4;
+  hash ^= hash >> 16;
+  hash *= 0x45D9F3B;
+  hash ^= hash >> 16;
+  return hash;
+}
 
-  const csByte* bytes = ptr;
+static MemoryIndexSlot* memory_index_slot(
+  const MemoryIndex* index, const void* ptr, csBool inserting
+) {
+  size_t mask = index->capacity - 1;
+  size_t i = memory_index_hash(ptr) & mask;
 
-  /* check if the pointer is in our allocated blocks list */
-  MemoryRecord* record = bsearch(
-    bytes, memory_records,
-    memory_records_size, sizeof(MemoryRecord),
-    memory_record_compare
-  );
+  for (;; i = (i + 1) & mask) {
+    MemoryIndexSlot* slot = &index->slots[i];
+    if (slot->ptr == ptr || slot->ptr == NULL) return slot;
+    if (inserting && slot->ptr == &memory_index_removed) return slot;
+  }
+}
 
-  int level = print_headers(CONCOL_bWhite, LOGGED, NULL);
+static csBool memory_index_grow(MemoryIndex* index) {
+  MemoryIndex old = *index;
+  size_t new_capacity = old.capacity ? old.capacity * 2 : 64;
 
-  if (param_padding) output_print();
+  MemoryIndexSlot* slots = calloc(new_capacity, sizeof(MemoryIndexSlot));
+  if (!slots) return FALSE;
 
-  if (record) {
-    memory_print_record(record, level);
-  } else {
-    memory_print_row(bytes - 16, level, FALSE);
-    memory_print_row(bytes, level, TRUE);
-    memory_print_row(bytes + 16, level, FALSE);
+  *index = (MemoryIndex) { slots, new_capacity, 0 };
+
+  /* removed slots are dropped in the rehash */
+  for (size_t i = 0; i < old.capacity; ++i) {
+    const csByte* ptr = old.slots[i].ptr;
+    if (ptr && ptr != &memory_index_removed) {
+      *memory_index_slot(index, ptr, TRUE) = old.slots[i];
+      ++index->used;
+    }
   }
+
+  free(old.slots);
+  return TRUE;
 }
 
-static void memory_test_reset(csBool enable) {
-  if (!enable) {
-    free(memory_records);
-    memory_records = NULL;
+static MemoryIndexSlot* memory_index_find(
+  const MemoryIndex* index, const void* ptr
+) {
+  if (!index->capacity) return NULL;
 
-  } else {
-    memory_expect_error = FALSE;
-    memory_malloc_forced_failures = 0;
-    memory_malloc_fail = M_NORMAL;
-    memory_error = FALSE;
-    memory_count_mallocs = 0;
-    memory_count_frees = 0;
-    memory_records_size = 0;
-    memory_ptr = 0;
-
-    /* Do a simple reset if we already have the records allocated */
-    if (!memory_records) {
-      memory_records_size = 0;
-      memory_records_capacity = 16;
-      memory_records = malloc(memory_records_capacity * sizeof(MemoryRecord));
-    }
-
-    cspec_memset(_memory, 0xFF, memory_size_barrier);
-    cspec_memset(memory, 'X', memory_size_max);
-    cspec_memset(
-      _memory + memory_size_barrier + memory_size_max,
-      0xFF, memory_size_barrier
-    );
+  MemoryIndexSlot* slot = memory_index_slot(index, ptr, FALSE);
+  return slot->ptr ? slot : NULL;
+}
+
+static void memory_index_insert(
+  MemoryIndex* index, const void* ptr, size_t record
+) {
+  if ((index->used + 1) * 2 > index->capacity) {
+    if (!memory_index_grow(index)) {
+      memory_expect_error = FALSE;
+      output("memory error: malloc: ran out of actual memory?");
+      return;
+    }
   }
+
+  MemoryIndexSlot* slot = memory_index_slot(index, ptr, TRUE);
+  if (slot->ptr == NULL) ++index->used;
+  slot->ptr = ptr;
+  slot->record = record;
 }
 
-static void memory_final_checks(void) {
-  /* Validate all memory records */
-  for (size_t i = 0; i < memory_records_size; ++i) {
-    MemoryRecord* record = &memory_records[i];
-
-    /* Ensure all fences are in - tact */
-    if (!memory_check_fence(record)) {
-      _cspec_error_mem("after: detected buffer over/underrun", record);
-    }
-
-    /* Ensure memory hasn't been modified after free */
-    if (record->is_free) {
-      csByte* block = record->block + memory_size_fence;
-      for (size_t j = 0; j < record->size; ++j) {
-        if (block[j] != 'F') {
-          _cspec_error_mem("after: memory modified after free", record);
-        }
-      }
-
-    /* Another check for freeing records */
-    } else {
-      _cspec_error_mem("after: allocated memory not freed", record);
-    }
-  }
-
-  /* Check barrier fences */
-  for (size_t i = 0; i < memory_size_barrier; ++i) {
-    if (0xFF != _memory[i]
-    ||  0xFF != _memory[i + memory_size_barrier + memory_size_max]
-    ) {
-      _cspec_error_mem("after: primary fence broken (large overrun)", NULL);
-    }
-  }
-
-  /* Ensure malloc / free parity */
-  if (memory_count_mallocs != memory_count_frees) {
-    int level = _cspec_error_mem("after: mismatched malloc/free calls", NULL);
-    if (test_in_progress) {
-      if (!memory_expect_error) {
-        output_pad(param_tabsize * level + 21, ' ');
-        output_str("mallocs: {}, frees: {}%n");
-        output_sint(memory_count_mallocs);
-        output_sint(memory_count_frees);
-        output_print();
-      }
-    }
-  }
+static void memory_index_remove(MemoryIndex* index, const void* ptr) {
+  MemoryIndexSlot* slot = memory_index_find(index, ptr);
+  if (slot) slot->ptr = &memory_index_removed;
+}
 
-  /* Ensure malloc was called if it was asked to fail */
-  if (memory_malloc_fail >= M_WAS_EXPECTED && !memory_malloc_forced_failures) {
-    char err[] = "memory error: after: malloc fail requested, but never called";
-    /* 
-    * causes regular error rather than memory error, since this is a failure
-    * within the test design rather than memory actually breaking (ie, using
-    * `expect(memory_error)` will not succeed if you forget to call malloc)
-    */
-    _cspec_error_fn(err);
+static void memory_index_clear(MemoryIndex* index) {
+  if (index->used) {
+    cspec_memset(index->slots, 0, index->capacity * sizeof(MemoryIndexSlot));
+    index->used = 0;
   }
 }
 
-void* cspec_malloc(size_t size) {
-  if (!memory_records || !test_in_function) {
-    /* ++memory_count_mallocs; */
-    void* ret = malloc(size);
-
-    /* Still set the memory with memtesting off */
-    if (test_in_function) {
-      cspec_memset(ret, 'X', size);
-    }
+static void memory_index_free(MemoryIndex* index) {
+  free(index->slots);
+  *index = (MemoryIndex) { NULL, 0, 0 };
+}
 
-    return ret;
-  }
+/*
+* The count level keeps no records, but remembers the blocks it counted so a
+* block freed twice, or resized to nothing, keeps the counts honest.
+*/
+static MemoryIndex memory_count_index = { NULL, 0, 0 };
+#define memory_count_live 0
+#define memory_count_freed 1
 
-  if (size == 0) {
-    return NULL;
-  }
+static void memory_count_alloc(const void* ptr) {
+  ++memory_count_mallocs;
+  memory_index_insert(&memory_count_index, ptr, memory_count_live);
+}
 
-  if (memory_malloc_fail >= M_FAIL_ONCE) {
-    if (memory_malloc_fail == M_FAIL_ONCE) {
-      memory_malloc_fail = M_WAS_EXPECTED;
-    }
-    ++memory_malloc_forced_failures;
-    return NULL;
+/* Counts the free, or reports it and returns FALSE if it was already freed */
+static csBool memory_count_free(const void* ptr, const char* message) {
+  MemoryIndexSlot* slot = memory_index_find(&memory_count_index, ptr);
+  if (slot && slot->record == memory_count_freed) {
+    _cspec_error_mem(message, NULL);
+    return FALSE;
   }
+  if (slot) slot->record = memory_count_freed;
+  ++memory_count_frees;
+  return TRUE;
+}
 
-  size_t next = memory_ptr + memory_size_fence*2 + size;
-
-  if (next >= memory_size_max - memory_size_fence*2) {
-    memory_expect_error = FALSE;
-    _cspec_error_mem(
-      "malloc: ran out of test memory space! Increase limit from "
-      STR(memory_size_max)" bytes.", NULL
-    );
-
-    return NULL;
+/* Arena records are in address order, heap and guard blocks can be anywhere */
+static MemoryRecord* memory_record_find(const void* ptr) {
+  if (memory_index_active()) {
+    MemoryIndexSlot* slot = memory_index_find(&memory_index, ptr);
+    return slot ? &memory_records[slot->record] : NULL;
   }
 
-  ++memory_count_mallocs;
+  return bsearch(
+    ptr, memory_records,
+    memory_records_size, sizeof(MemoryRecord),
+    memory_record_compare
+  );
+}
 
+static MemoryRecord* memory_record_push(void) {
   if (memory_records_size >= memory_records_capacity) {
     size_t new_cap = (size_t)(
       (float)memory_records_capacity * memory_records_grow_factor
@@ -722,355 +1487,3866 @@ void* cspec_malloc(size_t size) {
   }
 
   MemoryRecord* record = &memory_records[memory_records_size++];
+  *record = (MemoryRecord) { .block = NULL };
+  return record;
+}
 
-  if (memory_ptr != 0) {
-    size_t fence = memory_ptr - memory_size_fence;
-    for (; fence < memory_ptr; ++fence) {
-      if (memory[fence] != 'e') {
-        _cspec_error_mem("malloc: preceeding fence broken", record - 1);
-        return NULL;
-      }
-    }
-  }
+static void memory_heap_release(MemoryRecord* record) {
+  memory_index_remove(&memory_index, record->block + memory_size_fence);
+  if (record->is_free) memory_heap_quarantined -= record->size;
+  free(record->block);
+  record->block = NULL;
+}
 
-  record->size = size;
-  record->block = memory + memory_ptr;
-  record->is_free = FALSE;
-  cspec_memset(record->block, 'b', memory_size_fence);
-  cspec_memset(record->block + memory_size_fence, 'N', size);
-  cspec_memset(record->block + memory_size_fence + size, 'e', memory_size_fence);
+/* Release the oldest freed blocks once quarantine is over its limit */
+static void memory_heap_quarantine_add(MemoryRecord* record) {
+  memory_heap_quarantined += record->size;
 
-  memory_ptr = next;
+  while (memory_heap_quarantined > memory_heap_quarantine
+  &&     memory_heap_release_next < memory_records_size
+  ) {
+    MemoryRecord* oldest = &memory_records[memory_heap_release_next++];
+    if (oldest->block && oldest->is_free) {
+      memory_heap_release(oldest);
+    }
+  }
+}
 
-  return record->block + memory_size_fence;
+/* Checks if an allocation should fail because of `expect(null_malloc)` */
+static csBool memory_forced_failure(void) {
+  if (memory_malloc_fail >= M_FAIL_ONCE) {
+    if (memory_malloc_fail == M_FAIL_ONCE) {
+      memory_malloc_fail = M_WAS_EXPECTED;
+    }
+    ++memory_malloc_forced_failures;
+    return TRUE;
+  }
+  return FALSE;
 }
 
-void cspec_free(void* mem_) {
-  csByte* mem = mem_;
+static void memory_realloc_track(
+  const void* site, const void* mem, const void* result,
+  size_t old_size, size_t new_size, csBool copied
+) {
+  size_t moved = old_size < new_size ? old_size : new_size;
+  size_t delta = new_size > old_size ? new_size - old_size : 0;
 
-  if (!memory_records || !test_in_function) {
-    /* ++memory_count_frees; */
-    free(mem);
-    return;
+  if (copied) {
+    memory_realloc_copied += moved;
+  } else {
+    memory_realloc_grown += delta;
   }
 
-  /* free(NULL) is a NOP */
-  if (mem == NULL)
-    return;
+  ReallocSite* rs = NULL;
+  for (int i = 0; i < memory_realloc_site_count; ++i) {
+    if (memory_realloc_sites[i].site == site) {
+      rs = &memory_realloc_sites[i];
+      break;
+    }
+  }
 
-  /* check for memory outside of our bounds */
-  if (mem < memory || mem >= memory + memory_size_max) {
-    MemoryRecord tmp = {
-      .block = mem_, .size = 16 - memory_size_fence * 2, .is_free = TRUE
-    };
-    _cspec_error_mem("free: invalid pointer, out of bounds", &tmp);
-    return;
+  if (!rs) {
+    if (memory_realloc_site_count >= memory_realloc_sites_max) return;
+    rs = &memory_realloc_sites[memory_realloc_site_count++];
+    *rs = (ReallocSite) { .site = site };
   }
 
-  /* check if the pointer is in our allocated pointers list */
-  MemoryRecord* record = bsearch(
-    mem, memory_records,
-    memory_records_size, sizeof(MemoryRecord),
-    memory_record_compare
-  );
+  if (copied) rs->copied += moved; else rs->grown += delta;
+  rs->sizes[rs->count++ % memory_realloc_history] = new_size;
 
-  if (record == NULL) {
-    MemoryRecord tmp = {
-      .block = mem_, .size = 16 - memory_size_fence*2, .is_free = TRUE
-    };
-    _cspec_error_mem("free: invalid pointer, not malloc result", &tmp);
-    return;
+  /* a run only continues while the same buffer grows by the same amount */
+  if (delta && rs->last_result == mem && delta == rs->last_delta) {
+    ++rs->additive_run;
+  } else {
+    rs->additive_run = delta ? 1 : 0;
   }
 
-  /* check for double - free */
-  if (record->is_free) {
-    _cspec_error_mem("free: pointer already freed", NULL);
+  if (rs->additive_run > rs->additive_max) {
+    rs->additive_max = rs->additive_run;
+    rs->additive_delta = delta;
   }
 
-  /* check fences */
-  if (!memory_check_fence(record)) {
-    _cspec_error_mem("free: broken fence", record);
+  rs->last_delta = delta;
+  rs->last_result = result;
+}
+
+static void memory_warn_realloc(const ReallocSite* rs) {
+  if (!test_in_progress) return;
+
+  int level = print_headers(CONCOL_Yellow, LOGGED, NULL);
+  output_pad(param_tabsize * level, ' ');
+  output_str("memory warning:%c realloc: additive growth (+{} bytes per call) at {}");
+  output_uint(rs->additive_delta);
+  output_ptr(rs->site);
+  output_print_color(test_warned ? CONCOL_Yellow : CONCOL_bYellow);
+  if (!test_warned) ++test_warnings_count;
+  test_warned = TRUE;
+
+  output_pad(param_tabsize * level + 16, ' ');
+  output_str("sizes: ");
+  csUint first = rs->count > memory_realloc_history
+    ? rs->count - memory_realloc_history : 0;
+  if (first) output_str("..., ");
+  for (csUint i = first; i < rs->count; ++i) {
+    if (i != first) output_str(", ");
+    output_uint(rs->sizes[i % memory_realloc_history]);
   }
+  output_str(" (copied {} bytes, grew {} in place)");
+  output_uint(rs->copied);
+  output_uint(rs->grown);
+  output_print();
+}
 
-  /* free the memory */
-  cspec_memset(record->block + memory_size_fence, 'F', record->size);
-  record->is_free = TRUE;
-  ++memory_count_frees;
+/* Natural log and exp without libm, accurate enough for sampling */
+static double sample_log(double x) {
+  int exponent = 0;
+  while (x >= 2.0) { x *= 0.5; ++exponent; }
+  while (x < 1.0) { x *= 2.0; --exponent; }
+
+  /* ln(x) = 2 * atanh((x - 1) / (x + 1)), which converges fast on [1, 2) */
+  double y = (x - 1.0) / (x + 1.0);
+  double y2 = y * y;
+  double term = y;
+  double sum = 0;
+  for (int i = 1; i < 32; i += 2) {
+    sum += term / i;
+    term *= y2;
+  }
+  return 2.0 * sum + exponent * 0.69314718055994530942;
 }
 
-void* cspec_calloc(size_t ct, size_t sel) {
-  if (!memory_records || !test_in_function) {
-    return calloc(ct, sel);
+static double sample_exp(double x) {
+  if (x < -700.0) return 0;
+  if (x > 700.0) x = 700.0;
+
+  int exponent = (int)(x / 0.69314718055994530942);
+  double r = x - exponent * 0.69314718055994530942;
+  double term = 1.0;
+  double sum = 1.0;
+  for (int i = 1; i < 24; ++i) {
+    term *= r / i;
+    sum += term;
   }
+  for (; exponent > 0; --exponent) sum *= 2.0;
+  for (; exponent < 0; ++exponent) sum *= 0.5;
+  return sum;
+}
 
-  csByte* ret = cspec_malloc(ct * sel);
-  if (!ret) return NULL;
+/* Bytes until the next sample, exponentially distributed around the mean */
+static size_t memory_sample_next(void) {
+  memory_sample_state ^= memory_sample_state >> 12;
+  memory_sample_state ^= memory_sample_state << 25;
+  memory_sample_state ^= memory_sample_state >> 27;
+  unsigned long long bits = memory_sample_state * 0x2545F4914F6CDD1DULL;
 
-  cspec_memset(ret, 0, ct * sel);
-  return ret;
+  double u = ((double)(bits >> 11) + 0.5) / 9007199254740992.0;
+  return (size_t)(-sample_log(u) * (double)memory_sample_interval) + 1;
 }
 
-void* cspec_realloc(void* mem, size_t nsize) {
-  if (!memory_records || !test_in_function) {
-    /* if (mem == NULL) ++memory_count_mallocs; */
-    return realloc(mem, nsize);
+/* Reseeded with every test so sampled results don't depend on test order */
+static void memory_sample_set(size_t interval) {
+  memory_sample_state = memory_sample_seed;
+  memory_sample_interval = interval;
+  memory_sample_site_count = 0;
+  memory_sample_dropped = 0;
+  cspec_memset(memory_sample_live, 0, sizeof(memory_sample_live));
+  memory_sample_countdown = interval ? memory_sample_next() : 0;
+}
+
+static SampleLive* memory_sample_slot(const void* ptr, csBool inserting) {
+  size_t mask = memory_sample_live_max - 1;
+  size_t i = memory_index_hash(ptr) & mask;
+
+  for (size_t probes = 0; probes < memory_sample_live_max; ++probes) {
+    SampleLive* slot = &memory_sample_live[i];
+    if (slot->ptr == ptr) return slot;
+    if (slot->ptr == NULL) return inserting ? slot : NULL;
+    if (inserting && slot->ptr == &memory_sample_removed) return slot;
+    i = (i + 1) & mask;
   }
+  return NULL;
+}
 
-  if (mem == NULL) {
-    return cspec_malloc(nsize);
+static void memory_sample_alloc(const void* site, const void* ptr, size_t size) {
+  if (!ptr || !test_in_function || !size) return;
+
+  if (size < memory_sample_countdown) {
+    memory_sample_countdown -= size;
+    return;
   }
+  memory_sample_countdown = memory_sample_next();
 
-  /* you can realloc the last block, but that's it */
-  if (memory_records_size) {
-    MemoryRecord* record = &memory_records[memory_records_size - 1];
+  SampleSite* ss = NULL;
+  for (int i = 0; i < memory_sample_site_count; ++i) {
+    if (memory_sample_sites[i].site == site) {
+      ss = &memory_sample_sites[i];
+      break;
+    }
+  }
 
-    if (memory_malloc_fail >= M_FAIL_ONCE) {
-      if (memory_malloc_fail == M_FAIL_ONCE) {
-        memory_malloc_fail = M_WAS_EXPECTED;
-      }
-      ++memory_malloc_forced_failures;
-      return NULL;
+  if (!ss) {
+    if (memory_sample_site_count >= memory_sample_sites_max) {
+      ++memory_sample_dropped;
+      return;
     }
+    ss = &memory_sample_sites[memory_sample_site_count++];
+    *ss = (SampleSite) { .site = site };
+    ss->stack_size = memory_sample_backtrace(ss->stack, memory_sample_depth);
+  }
 
-    if (record->block + memory_size_fence == mem) {
+  /* the odds this allocation was picked, so the sample stands in for 1/p */
+  double p = 1.0 - sample_exp(-(double)size / (double)memory_sample_interval);
+  double weight = p > 0 ? 1.0 / p : 1.0;
+
+  ++ss->samples;
+  ss->allocs += weight;
+  ss->bytes += weight * (double)size;
+  ss->live += weight * (double)size;
+
+  SampleLive* live = memory_sample_slot(ptr, TRUE);
+  if (live) {
+    *live = (SampleLive) {
+      .ptr = ptr,
+      .site = (int)(ss - memory_sample_sites),
+      .bytes = weight * (double)size
+    };
+  }
+}
 
-      if (!memory_check_fence(record)) {
-        _cspec_error_mem("realloc: broken fence", record);
-        return NULL;
-      }
+static void memory_sample_free(const void* ptr) {
+  if (!ptr || !test_in_function) return;
 
-      if (nsize == record->size) {
-        return mem;
-      }
+  SampleLive* live = memory_sample_slot(ptr, FALSE);
+  if (!live) return;
 
-      csByte* block_start = record->block + memory_size_fence;
+  memory_sample_sites[live->site].live -= live->bytes;
+  live->ptr = &memory_sample_removed;
+}
 
-      /* different behavior between expanding vs contracting memory space */
-      if (nsize > record->size) {
-        cspec_memset(block_start + nsize, 'e', memory_size_fence);
-        cspec_memset(block_start + record->size, 'N', nsize - record->size);
+static void output_estimate(double value) {
+  output_uint((unsigned long long)(value + 0.5));
+}
 
-      /* case for shrinking the space */
-      } else {
-        cspec_memset(block_start + nsize, 'e', memory_size_fence);
-        cspec_memset(block_start + nsize + memory_size_fence, 'X', record->size - nsize);
-      }
+static void memory_sample_report(void) {
+  if (!memory_sample_interval || !memory_sample_site_count
+  ||  param_verbose < V_NOTES
+  ) {
+    return;
+  }
 
-      record->size = nsize;
-      memory_ptr = block_start + record->size + memory_size_fence - memory;
+  double bytes = 0, allocs = 0, live = 0;
+  csUint samples = 0;
+  for (int i = 0; i < memory_sample_site_count; ++i) {
+    bytes += memory_sample_sites[i].bytes;
+    allocs += memory_sample_sites[i].allocs;
+    live += memory_sample_sites[i].live;
+    samples += memory_sample_sites[i].samples;
+  }
 
-      return record->block + memory_size_fence; // mem
+  int level = print_headers(CONCOL_bWhite, LOGGED, NULL);
+  output_pad(param_tabsize * level, ' ');
+  output_str("heap profile: ~{} bytes in ~{} allocations, ~{} bytes live");
+  output_estimate(bytes);
+  output_estimate(allocs);
+  output_estimate(live > 0 ? live : 0);
+  output_str(" ({} samples, one per ~{} bytes)");
+  output_uint(samples);
+  output_uint(memory_sample_interval);
+  output_print();
 
-    } else {
-      void* ret = cspec_malloc(nsize);
-      if (!ret) {
-        _cspec_error_mem("realloc: malloc failed in realloc", NULL);
-        return ret;
+  for (int i = 0; i < memory_sample_site_count; ++i) {
+    const SampleSite* ss = &memory_sample_sites[i];
+    output_pad(param_tabsize * (level + 1), ' ');
+    output_str("at {}: ~{} bytes in ~{} allocations, ~{} bytes live");
+    output_ptr(ss->site);
+    output_estimate(ss->bytes);
+    output_estimate(ss->allocs);
+    output_estimate(ss->live > 0 ? ss->live : 0);
+    output_print();
+
+    /* skip the frames inside the profiler, and the call site itself */
+    int first = 0;
+    for (int f = 0; f < ss->stack_size; ++f) {
+      if (ss->stack[f] == ss->site) first = f + 1;
+    }
+    if (first && first < ss->stack_size) {
+      output_pad(param_tabsize * (level + 2), ' ');
+      output_str("called from:");
+      for (int f = first; f < ss->stack_size; ++f) {
+        output_char(' ');
+        output_ptr(ss->stack[f]);
       }
-
-      cspec_memcpy(ret, record->block, record->size + memory_size_fence * 2);
-      cspec_free(record->block + memory_size_fence);
-      return ret;
+      output_print();
     }
   }
 
-  _cspec_error_mem("realloc: nothing previously allocated", NULL);
-  return cspec_malloc(nsize);
+  if (memory_sample_dropped) {
+    output_pad(param_tabsize * (level + 1), ' ');
+    output_str("({} samples from further call sites not shown)");
+    output_uint(memory_sample_dropped);
+    output_print();
+  }
 }
 
-#else
+void _cspec_memory_log_block(int line, const void* ptr) {
+  if ((test_current_line && test_current_line >= line)
+  || param_verbose < V_NOTES
+  ) {
+    return;
+  }
 
-static void memory_final_checks() { }
-static void memory_test_reset(csBool enable) { (void)enable; }
-void _memory_print_block(const void* ptr, int rows) { (void)ptr; (void)rows; }
+  const csByte* bytes = ptr;
+  const csByte* lo = _memory;
+  const csByte* hi = _memory + memory_size_full;
 
-#endif
+  /* check if the pointer is in our allocated blocks list */
+  MemoryRecord* record = NULL;
+  if (memory_records && memory_active_level >= memory_level_track) {
+    record = memory_record_find(bytes);
+  }
 
-/*----------------------------------------------------------------------------*\
-  Test Context
-\*----------------------------------------------------------------------------*\
-* A test context allows pre-test setup to be shared between multiple tests.
-* Variables can be created and accessed within the tests, and other setup can
-* be performed before running the tests. After each test, the test group
-* function is exited and re-entered, meaning the context is recreated for every
-* test (ie, incrementing a shared value in one test will not affect the next
-* test), and after the context is passed, the setup won't be run again for any
-* tests that follow it.
-*/
+  int level = print_headers(CONCOL_bWhite, LOGGED, NULL);
 
-/*
-* To allow nested contexts, we need a stack... the stack persists for the whole
-* test group (between multiple calls of the group function), and is used to
-* keep track of
-*/
-typedef struct Context {
-  const char* desc;
-  csBool printed;
-  csBool requested_context;
-} Context;
+  if (param_padding) output_print();
 
-#ifndef cspec_ctx_stack_size_max
-# define cspec_ctx_stack_size_max 20
-#endif
+  if (record) {
+    memory_print_record(record, level);
+  } else {
+    memory_print_row(bytes - 16, level, FALSE, lo, hi);
+    memory_print_row(bytes, level, TRUE, lo, hi);
+    memory_print_row(bytes + 16, level, FALSE, lo, hi);
+  }
+}
 
-static Context ctx_stack[cspec_ctx_stack_size_max] = {
-  {
-    .desc = "<root context>",
-    .printed = FALSE,
-    .requested_context = FALSE,
+static void memory_records_reserve(void) {
+  /* Do a simple reset if we already have the records allocated */
+  if (!memory_records) {
+    memory_records_capacity = 16;
+    memory_records = malloc(memory_records_capacity * sizeof(MemoryRecord));
   }
-};
+}
 
-/*
-* Iterator through the stack.
-* This is reset to the root between each each call to the test function.
-*/
-static int ctx_stack_index = 0;
+static void memory_arena_pattern(void) {
+  cspec_memset(_memory, 0xFF, memory_size_barrier);
+  cspec_memset(memory, 'X', memory_size_max);
+  cspec_memset(
+    _memory + memory_size_barrier + memory_size_max,
+    0xFF, memory_size_barrier
+  );
+}
 
-/*
-* Index of the top of the stack.
+static void memory_test_reset(MemoryLevel level) {
+  /* unmap guard pages and release heap blocks left over from the last pass */
+  for (size_t i = 0; i < memory_records_size; ++i) {
+    if (memory_records[i].guard) {
+      memory_guard_release(&memory_records[i]);
+    } else if (memory_heap_active && memory_records[i].block) {
+      free(memory_records[i].block);
+    }
+  }
+
+  memory_index_clear(&memory_index);
+  memory_index_clear(&memory_count_index);
+
+  memory_active_level = memory_level_supported(level);
+  /* arena blocks can't outlive the test for the ledger to keep them */
+  memory_heap_active = param_memory_heap || param_memory_global;
+  memory_heap_quarantined = 0;
+  memory_heap_release_next = 0;
+  memory_expect_error = FALSE;
+  memory_malloc_forced_failures = 0;
+  memory_malloc_fail = M_NORMAL;
+  memory_error = FALSE;
+  memory_count_mallocs = 0;
+  memory_count_frees = 0;
+  memory_records_size = 0;
+  memory_ptr = 0;
+  memory_realloc_site_count = 0;
+  memory_realloc_copied = 0;
+  memory_realloc_grown = 0;
+  memory_sample_set(param_sample_bytes);
+
+  if (level == memory_level_off) {
+    free(memory_records);
+    memory_records = NULL;
+    memory_index_free(&memory_index);
+    memory_index_free(&memory_count_index);
+    return;
+  }
+
+  memory_records_reserve();
+
+  /* only the fence level patterns the arena */
+  if (memory_active_level == memory_level_fence) {
+    memory_arena_pattern();
+  }
+}
+
+/*
+* Fixtures can save the arena at the end of their setup and put it back before
+* later tests instead of running the setup again. Only arena blocks can be put
+* back; heap and guard blocks are released between passes.
+*/
+typedef struct MemorySnapshot {
+  size_t ptr;
+  size_t records_size;
+  int mallocs;
+  int frees;
+} MemorySnapshot;
+
+static csBool memory_snapshot_supported(void) {
+  return !memory_heap_active
+    && (memory_active_level == memory_level_track
+    ||  memory_active_level == memory_level_fence);
+}
+
+static csSize memory_snapshot_size(void) {
+  return sizeof(MemorySnapshot) + memory_ptr
+    + memory_records_size * sizeof(MemoryRecord);
+}
+
+static void memory_snapshot_save(csByte* out) {
+  MemorySnapshot snapshot = {
+    memory_ptr, memory_records_size, memory_count_mallocs, memory_count_frees
+  };
+  cspec_memcpy(out, &snapshot, sizeof(snapshot));
+  out += sizeof(snapshot);
+  cspec_memcpy(out, memory, memory_ptr);
+  out += memory_ptr;
+  cspec_memcpy(out, memory_records, memory_records_size * sizeof(MemoryRecord));
+}
+
+static csBool memory_snapshot_restore(const csByte* in) {
+  MemorySnapshot snapshot;
+  cspec_memcpy(&snapshot, in, sizeof(snapshot));
+  in += sizeof(snapshot);
+
+  if (snapshot.records_size > memory_records_capacity) {
+    MemoryRecord* records = realloc(
+      memory_records, snapshot.records_size * sizeof(MemoryRecord)
+    );
+    if (!records) return FALSE;
+    memory_records = records;
+    memory_records_capacity = snapshot.records_size;
+  }
+
+  cspec_memcpy(memory, in, snapshot.ptr);
+  in += snapshot.ptr;
+  cspec_memcpy(
+    memory_records, in, snapshot.records_size * sizeof(MemoryRecord)
+  );
+  memory_ptr = snapshot.ptr;
+  memory_records_size = snapshot.records_size;
+  memory_count_mallocs = snapshot.mallocs;
+  memory_count_frees = snapshot.frees;
+  return TRUE;
+}
+
+static void memory_final_checks(void) {
+  if (memory_active_level == memory_level_off) return;
+
+  /* Validate all memory records */
+  for (size_t i = 0; i < memory_records_size; ++i) {
+    MemoryRecord* record = &memory_records[i];
+
+    /* Heap blocks released from quarantine were already checked */
+    if (!record->block) continue;
+
+    /* Ensure all fences are in - tact */
+    if (!memory_check_fence(record)) {
+      _cspec_error_mem("after: detected buffer over/underrun", record);
+    }
+
+    /* Ensure memory hasn't been modified after free (guard pages fault) */
+    if (record->is_free) {
+      if (memory_active_level == memory_level_fence) {
+        csByte* block = record->block + memory_size_fence;
+        for (size_t j = 0; j < record->size; ++j) {
+          if (block[j] != 'F') {
+            _cspec_error_mem("after: memory modified after free", record);
+          }
+        }
+      }
+
+    /* Another check for freeing records */
+    } else {
+      _cspec_error_mem("after: allocated memory not freed", record);
+    }
+  }
+
+  /* Check barrier fences */
+  if (memory_active_level == memory_level_fence) {
+    for (size_t i = 0; i < memory_size_barrier; ++i) {
+      if (0xFF != _memory[i]
+      ||  0xFF != _memory[i + memory_size_barrier + memory_size_max]
+      ) {
+        _cspec_error_mem("after: primary fence broken (large overrun)", NULL);
+      }
+    }
+  }
+
+  /* Ensure malloc / free parity */
+  if (memory_count_mallocs != memory_count_frees) {
+    int level = _cspec_error_mem("after: mismatched malloc/free calls", NULL);
+    if (test_in_progress) {
+      if (!memory_expect_error) {
+        output_pad(param_tabsize * level + 21, ' ');
+        output_str("mallocs: {}, frees: {}%n");
+        output_sint(memory_count_mallocs);
+        output_sint(memory_count_frees);
+        output_print();
+      }
+    }
+  }
+
+  /* Flag call sites that grew a buffer by a constant amount */
+  for (int i = 0; i < memory_realloc_site_count; ++i) {
+    if (memory_realloc_sites[i].additive_max >= memory_realloc_additive_limit) {
+      memory_warn_realloc(&memory_realloc_sites[i]);
+    }
+  }
+
+  /* Ensure malloc was called if it was asked to fail */
+  if (memory_malloc_fail >= M_WAS_EXPECTED && !memory_malloc_forced_failures) {
+    char err[] = "memory error: after: malloc fail requested, but never called";
+    /* 
+    * causes regular error rather than memory error, since this is a failure
+    * within the test design rather than memory actually breaking (ie, using
+    * `expect(memory_error)` will not succeed if you forget to call malloc)
+    */
+    _cspec_error_fn(err);
+  }
+}
+
+static void* memory_malloc(size_t size) {
+  if (memory_active_level == memory_level_off || !test_in_function) {
+    /* ++memory_count_mallocs; */
+    void* ret = malloc(size);
+
+    /* Still set the memory with memtesting off */
+    if (ret && test_in_function) {
+      cspec_memset(ret, 'X', size);
+    }
+
+    return ret;
+  }
+
+  if (size == 0) {
+    return NULL;
+  }
+
+  if (memory_forced_failure()) {
+    return NULL;
+  }
+
+  if (memory_active_level == memory_level_count) {
+    void* ret = malloc(size);
+    if (ret) memory_count_alloc(ret);
+    return ret;
+  }
+
+  MemoryRecord* record;
+
+  if (memory_active_level == memory_level_guard) {
+    record = memory_record_push();
+    if (!record) return NULL;
+
+    if (!memory_guard_alloc(record, size)) {
+      --memory_records_size;
+      _cspec_error_mem("malloc: unable to map guard pages", NULL);
+      return NULL;
+    }
+
+  } else if (memory_heap_active) {
+    csByte* block = malloc(size + memory_size_fence*2);
+    if (!block) return NULL;
+
+    record = memory_record_push();
+    if (!record) {
+      free(block);
+      return NULL;
+    }
+
+    record->block = block;
+
+  } else {
+    size_t next = memory_ptr + memory_size_fence*2 + size;
+
+    if (next >= memory_size_max - memory_size_fence*2) {
+      memory_expect_error = FALSE;
+      _cspec_error_mem(
+        "malloc: ran out of test memory space! Increase limit from "
+        STR(memory_size_max)" bytes.", NULL
+      );
+
+      return NULL;
+    }
+
+    record = memory_record_push();
+    if (!record) return NULL;
+
+    if (memory_ptr != 0 && memory_active_level == memory_level_fence) {
+      size_t fence = memory_ptr - memory_size_fence;
+      for (; fence < memory_ptr; ++fence) {
+        if (memory[fence] != 'e') {
+          _cspec_error_mem("malloc: preceeding fence broken", record - 1);
+          --memory_records_size;
+          return NULL;
+        }
+      }
+    }
+
+    record->block = memory + memory_ptr;
+    memory_ptr = next;
+  }
+
+  ++memory_count_mallocs;
+
+  record->size = size;
+  record->site = memory_ledger_site;
+  record->is_free = FALSE;
+
+  if (memory_index_active()) {
+    size_t record_id = (size_t)(record - memory_records);
+    memory_index_insert(
+      &memory_index, record->block + memory_size_fence, record_id
+    );
+  }
+
+  if (memory_active_level >= memory_level_fence) {
+    csByte* block_start = record->block + memory_size_fence;
+    cspec_memset(record->block, 'b', memory_size_fence);
+    cspec_memset(block_start, 'N', size);
+    cspec_memset(block_start + size, 'e', memory_trailing_fence(record));
+  }
+
+  return record->block + memory_size_fence;
+}
+
+static void memory_free(void* mem_) {
+  csByte* mem = mem_;
+
+  if (memory_active_level == memory_level_off || !test_in_function) {
+    /* ++memory_count_frees; */
+    free(mem);
+    return;
+  }
+
+  /* free(NULL) is a NOP */
+  if (mem == NULL)
+    return;
+
+  if (memory_active_level == memory_level_count) {
+    if (memory_count_free(mem, "free: pointer already freed")) {
+      free(mem);
+    }
+    return;
+  }
+
+  /* check for memory outside of our bounds */
+  if (!memory_index_active()
+  &&  (mem < memory || mem >= memory + memory_size_max)
+  ) {
+    MemoryRecord tmp = {
+      .block = mem_, .size = 16 - memory_size_fence * 2, .is_free = TRUE
+    };
+    _cspec_error_mem("free: invalid pointer, out of bounds", &tmp);
+    return;
+  }
+
+  /* check if the pointer is in our allocated pointers list */
+  MemoryRecord* record = memory_record_find(mem);
+
+  if (record == NULL) {
+    MemoryRecord tmp = {
+      .block = mem_, .size = 16 - memory_size_fence*2, .is_free = TRUE
+    };
+    _cspec_error_mem("free: invalid pointer, not malloc result", &tmp);
+    return;
+  }
+
+  /* check for double - free */
+  if (record->is_free) {
+    _cspec_error_mem("free: pointer already freed", NULL);
+    if (memory_index_active()) {
+      ++memory_count_frees;
+      return;
+    }
+  }
+
+  /* check fences */
+  if (!memory_check_fence(record)) {
+    _cspec_error_mem("free: broken fence", record);
+  }
+
+  /* free the memory */
+  if (memory_active_level >= memory_level_fence) {
+    cspec_memset(record->block + memory_size_fence, 'F', record->size);
+  }
+  if (record->guard) {
+    memory_guard_free(record);
+  }
+  record->is_free = TRUE;
+  ++memory_count_frees;
+
+  if (memory_heap_active && !record->guard) {
+    memory_heap_quarantine_add(record);
+  }
+}
+
+static void* memory_calloc(size_t ct, size_t sel) {
+  if (memory_active_level == memory_level_off || !test_in_function) {
+    return calloc(ct, sel);
+  }
+
+  csByte* ret = memory_malloc(ct * sel);
+  if (!ret) return NULL;
+
+  cspec_memset(ret, 0, ct * sel);
+  return ret;
+}
+
+static void* memory_realloc(void* mem, size_t nsize, const void* site) {
+  if (memory_active_level == memory_level_off || !test_in_function) {
+    /* if (mem == NULL) ++memory_count_mallocs; */
+    return realloc(mem, nsize);
+  }
+
+  if (mem == NULL) {
+    return memory_malloc(nsize);
+  }
+
+  if (memory_active_level == memory_level_count) {
+    /* resizing to nothing frees the block, as free would */
+    if (nsize == 0) {
+      if (memory_count_free(mem, "realloc: pointer already freed")) {
+        free(mem);
+      }
+      return NULL;
+    }
+
+    MemoryIndexSlot* slot = memory_index_find(&memory_count_index, mem);
+    if (slot && slot->record == memory_count_freed) {
+      _cspec_error_mem("realloc: pointer already freed", NULL);
+      return NULL;
+    }
+
+    if (memory_forced_failure()) return NULL;
+    void* ret = realloc(mem, nsize);
+
+    /* a block from before the test stays uncounted wherever it moves to */
+    if (ret && slot) {
+      slot->record = memory_count_freed;
+      memory_index_insert(&memory_count_index, ret, memory_count_live);
+    }
+    return ret;
+  }
+
+  if (!memory_records_size) {
+    _cspec_error_mem("realloc: nothing previously allocated", NULL);
+    return memory_malloc(nsize);
+  }
+
+  if (memory_forced_failure()) {
+    return NULL;
+  }
+
+  MemoryRecord* record = memory_record_find(mem);
+
+  if (record == NULL) {
+    MemoryRecord tmp = {
+      .block = mem, .size = 16 - memory_size_fence*2, .is_free = TRUE
+    };
+    _cspec_error_mem("realloc: invalid pointer, not malloc result", &tmp);
+    return NULL;
+  }
+
+  if (record->is_free) {
+    _cspec_error_mem("realloc: pointer already freed", record);
+    return NULL;
+  }
+
+  if (!memory_check_fence(record)) {
+    _cspec_error_mem("realloc: broken fence", record);
+    return NULL;
+  }
+
+  size_t old_size = record->size;
+
+  if (nsize == old_size) {
+    return mem;
+  }
+
+  /* heap blocks let the real realloc decide whether to move */
+  if (memory_heap_active && !record->guard) {
+    csByte* block = realloc(record->block, nsize + memory_size_fence*2);
+    if (!block) return NULL;
+
+    csByte* block_start = block + memory_size_fence;
+    csBool moved = block != record->block;
+
+    if (moved) {
+      memory_index_remove(&memory_index, mem);
+      memory_index_insert(
+        &memory_index, block_start, (size_t)(record - memory_records)
+      );
+    }
+
+    if (memory_active_level >= memory_level_fence) {
+      if (nsize > old_size) {
+        cspec_memset(block_start + old_size, 'N', nsize - old_size);
+      }
+      cspec_memset(block_start + nsize, 'e', memory_size_fence);
+    }
+
+    record->block = block;
+    record->size = nsize;
+
+    memory_realloc_track(site, mem, block_start, old_size, nsize, moved);
+    return block_start;
+  }
+
+  /* you can grow the last block in the arena in place, but that's it */
+  if (!memory_index_active()
+  &&  record == &memory_records[memory_records_size - 1]
+  ) {
+    csByte* block_start = record->block + memory_size_fence;
+
+    if (block_start + nsize + memory_size_fence > memory + memory_size_max) {
+      memory_expect_error = FALSE;
+      _cspec_error_mem(
+        "realloc: ran out of test memory space! Increase limit from "
+        STR(memory_size_max)" bytes.", NULL
+      );
+      return NULL;
+    }
+
+    /* different behavior between expanding vs contracting memory space */
+    if (memory_active_level < memory_level_fence) {
+      /* no patterning when only tracking */
+
+    } else if (nsize > old_size) {
+      cspec_memset(block_start + nsize, 'e', memory_size_fence);
+      cspec_memset(block_start + old_size, 'N', nsize - old_size);
+
+    /* case for shrinking the space */
+    } else {
+      cspec_memset(block_start + nsize, 'e', memory_size_fence);
+      cspec_memset(block_start + nsize + memory_size_fence, 'X', old_size - nsize);
+    }
+
+    record->size = nsize;
+    memory_ptr = block_start + record->size + memory_size_fence - memory;
+
+    memory_realloc_track(site, mem, mem, old_size, nsize, FALSE);
+    return mem;
+  }
+
+  /* otherwise move it to a new block (may move the records array) */
+  void* ret = memory_malloc(nsize);
+  if (!ret) {
+    _cspec_error_mem("realloc: malloc failed in realloc", NULL);
+    return ret;
+  }
+
+  cspec_memcpy(ret, mem, old_size < nsize ? old_size : nsize);
+  memory_free(mem);
+
+  memory_realloc_track(site, mem, ret, old_size, nsize, TRUE);
+  return ret;
+}
+
+static csBool memory_ledger_active(void) {
+  return !test_in_function
+    || (param_memory_global && memory_active_level <= memory_level_count);
+}
+
+static void memory_ledger_attribute(LedgerEntry* entry) {
+  entry->suite = current_suite;
+  entry->group = test_function;
+  entry->desc = test_description;
+  entry->line = test_current_line;
+  entry->test = memory_ledger_test;
+}
+
+static void memory_ledger_add(const void* site, const void* ptr, size_t size) {
+  if (!ptr) return;
+
+  if (memory_ledger_size >= memory_ledger_capacity) {
+    size_t new_cap = memory_ledger_capacity ? memory_ledger_capacity * 2 : 64;
+    LedgerEntry* new_ledger = realloc(
+      memory_ledger, new_cap * sizeof(LedgerEntry)
+    );
+    if (!new_ledger) return;
+    memory_ledger = new_ledger;
+    memory_ledger_capacity = new_cap;
+  }
+
+  LedgerEntry* entry = &memory_ledger[memory_ledger_size];
+  *entry = (LedgerEntry) {
+    .ptr = ptr, .block = (csByte*)ptr, .size = size, .site = site
+  };
+
+  /* outside of a test, it belongs to whichever test starts next */
+  if (test_in_progress) {
+    memory_ledger_attribute(entry);
+  } else {
+    ++memory_ledger_pending;
+  }
+
+  memory_index_insert(&memory_ledger_index, ptr, memory_ledger_size++);
+  memory_ledger_bytes += size;
+}
+
+static LedgerEntry* memory_ledger_find(const void* ptr) {
+  if (!memory_ledger_size || !ptr) return NULL;
+
+  MemoryIndexSlot* slot = memory_index_find(&memory_ledger_index, ptr);
+  return slot ? &memory_ledger[slot->record] : NULL;
+}
+
+/* Removing an entry moves the last entry into its place */
+static void memory_ledger_remove(LedgerEntry* entry) {
+  size_t hole = (size_t)(entry - memory_ledger);
+  LedgerEntry* last = &memory_ledger[--memory_ledger_size];
+
+  memory_index_remove(&memory_ledger_index, entry->ptr);
+  memory_ledger_bytes -= entry->size;
+  if (!entry->group && !entry->baseline) --memory_ledger_pending;
+
+  if (entry != last) {
+    *entry = *last;
+    memory_index_find(&memory_ledger_index, entry->ptr)->record = hole;
+  }
+}
+
+/* Resized blocks keep the test they were first attributed to */
+static void memory_ledger_move(LedgerEntry* entry, const void* ptr, size_t size) {
+  size_t record = (size_t)(entry - memory_ledger);
+  size_t fence = (size_t)((const csByte*)entry->ptr - entry->block);
+
+  memory_index_remove(&memory_ledger_index, entry->ptr);
+  memory_index_insert(&memory_ledger_index, ptr, record);
+  memory_ledger_bytes = memory_ledger_bytes - entry->size + size;
+
+  csUint test = memory_ledger_test;
+  if (size > entry->size && test != entry->test && test != entry->grown_test) {
+    entry->grown_test = test;
+    ++entry->grown;
+  }
+  entry->ptr = ptr;
+  entry->block = (csByte*)ptr - fence;
+  entry->size = size;
+}
+
+/*
+* Blocks that are live when the run starts are the program's own (static
+* initialization, caches built before the arguments were read). Tests can
+* still free them, but they're never attributed to a test or reported.
+*/
+static void memory_ledger_baseline(void) {
+  for (size_t i = 0; i < memory_ledger_size; ++i) {
+    memory_ledger[i].baseline = TRUE;
+  }
+  memory_ledger_pending = 0;
+  memory_ledger_test = memory_ledger_grew = 0;
+}
+
+/* With --global-memory, heap blocks a test didn't free move to the ledger */
+static void memory_ledger_keep(void) {
+  if (!param_memory_global || !memory_heap_active) return;
+
+  for (size_t i = 0; i < memory_records_size; ++i) {
+    MemoryRecord* record = &memory_records[i];
+    if (!record->block || record->is_free || record->guard) continue;
+
+    csByte* ptr = record->block + memory_size_fence;
+    memory_index_remove(&memory_index, ptr);
+    memory_ledger_add(record->site, ptr, record->size);
+    LedgerEntry* entry = memory_ledger_find(ptr);
+    if (entry) entry->block = record->block;
+
+    /* it's the ledger's now, and no longer counted against the test */
+    record->block = NULL;
+    ++memory_count_frees;
+  }
+}
+
+static void memory_ledger_begin(void) {
+  ++memory_ledger_test;
+  memory_ledger_bytes_at_begin = memory_ledger_bytes;
+
+  if (!memory_ledger_pending) return;
+
+  for (size_t i = 0; i < memory_ledger_size; ++i) {
+    if (!memory_ledger[i].group && !memory_ledger[i].baseline) {
+      memory_ledger_attribute(&memory_ledger[i]);
+    }
+  }
+  memory_ledger_pending = 0;
+}
+
+static void memory_ledger_end(void) {
+  if (memory_ledger_bytes > memory_ledger_bytes_at_begin) {
+    ++memory_ledger_grew;
+  }
+}
+
+static int memory_ledger_compare(const void* a_, const void* b_) {
+  const LedgerEntry* a = a_;
+  const LedgerEntry* b = b_;
+
+  if (a->site != b->site) return a->site < b->site ? -1 : 1;
+  if (a->test != b->test) return a->test < b->test ? -1 : 1;
+  return 0;
+}
+
+static void memory_ledger_report(void) {
+  if (!param_memory_global) return;
+
+  /* only what was allocated since the run started is reported */
+  size_t kept = 0;
+  for (size_t i = 0; i < memory_ledger_size; ++i) {
+    if (memory_ledger[i].baseline) {
+      memory_ledger_bytes -= memory_ledger[i].size;
+    } else {
+      memory_ledger[kept++] = memory_ledger[i];
+    }
+  }
+  memory_ledger_size = kept;
+
+  if (memory_ledger_size) {
+    output_str("global memory warning:%c {} bytes in {} allocations live at exit");
+    output_uint(memory_ledger_bytes);
+    output_uint(memory_ledger_size);
+    output_str(" (grew during {} of {} tests)");
+    output_uint(memory_ledger_grew);
+    output_uint(memory_ledger_test);
+    output_print_color(CONCOL_bYellow);
+    ++test_warnings_count;
+
+    /* group by call site, then by the test each allocation is from */
+    qsort(
+      memory_ledger, memory_ledger_size, sizeof(LedgerEntry),
+      memory_ledger_compare
+    );
+
+    size_t sites = 0;
+    for (size_t i = 0; i < memory_ledger_size;) {
+      const LedgerEntry* first = &memory_ledger[i];
+      size_t bytes = 0, count = 0;
+      csUint tests = 0, last_test = 0;
+
+      for (; i < memory_ledger_size; ++i) {
+        if (memory_ledger[i].site != first->site) break;
+        if (!count || memory_ledger[i].test != last_test) {
+          ++tests;
+          last_test = memory_ledger[i].test;
+        }
+        bytes += memory_ledger[i].size;
+        tests += memory_ledger[i].grown;
+        ++count;
+      }
+
+      if (++sites > memory_ledger_report_max) continue;
+
+      csBool growing = tests >= memory_ledger_growth_tests;
+      output_pad(param_tabsize, ' ');
+      output_str("at {}: {} bytes in {} allocations, from {} tests");
+      output_ptr(first->site);
+      output_uint(bytes);
+      output_uint(count);
+      output_uint(tests);
+      if (growing) output_str(" (keeps growing)");
+      output_print_color(growing ? CONCOL_bYellow : CONCOL_Yellow);
+
+      output_pad(param_tabsize * 2, ' ');
+      if (first->group) {
+        output_str("first from {} (test_{} in {})");
+        output_str(first->desc);
+        output_str(first->group->header);
+        output_str(first->suite->filename);
+        output_print_color(CONCOL_White);
+      } else {
+        output_str("allocated after the last test");
+        output_print();
+      }
+    }
+
+    if (sites > memory_ledger_report_max) {
+      output_pad(param_tabsize, ' ');
+      output_str("... and {} more call sites");
+      output_uint(sites - memory_ledger_report_max);
+      output_print();
+    }
+  }
+
+  /* the blocks belong to the program, only the ledger itself is freed */
+  free(memory_ledger);
+  memory_ledger = NULL;
+  memory_ledger_size = memory_ledger_capacity = 0;
+  memory_ledger_pending = memory_ledger_bytes = 0;
+  memory_ledger_test = memory_ledger_grew = 0;
+  memory_index_free(&memory_ledger_index);
+}
+
+/*
+* The entry points are kept separate from the allocator so that realloc and
+* calloc can use it without being counted twice by the sampling profiler, and
+* so blocks from the whole-run ledger always go back to the real allocator.
+*/
+void* cspec_malloc(size_t size) {
+  const void* site = memory_caller();
+  csBool global = memory_ledger_active();
+  memory_ledger_site = site;
+  void* ret = memory_malloc(size);
+  if (memory_sample_interval) {
+    memory_sample_alloc(site, ret, size);
+  }
+  if (global) {
+    memory_ledger_add(site, ret, size);
+  }
+  return ret;
+}
+
+void cspec_free(void* mem) {
+  if (memory_sample_interval) {
+    memory_sample_free(mem);
+  }
+
+  LedgerEntry* entry = memory_ledger_find(mem);
+  if (entry) {
+    csByte* block = entry->block;
+    memory_ledger_remove(entry);
+    /* a block a test left behind still has its fences */
+    if (block != mem) {
+      free(block);
+    /* still counted by tests that count, but never checked against records */
+    } else if (test_in_function && memory_active_level > memory_level_count) {
+      free(mem);
+    } else {
+      memory_free(mem);
+    }
+    return;
+  }
+
+  memory_free(mem);
+}
+
+void* cspec_calloc(size_t ct, size_t sel) {
+  const void* site = memory_caller();
+  csBool global = memory_ledger_active();
+  memory_ledger_site = site;
+  void* ret = memory_calloc(ct, sel);
+  if (memory_sample_interval) {
+    memory_sample_alloc(site, ret, ct * sel);
+  }
+  if (global) {
+    memory_ledger_add(site, ret, ct * sel);
+  }
+  return ret;
+}
+
+void* cspec_realloc(void* mem, size_t nsize) {
+  const void* site = memory_caller();
+  LedgerEntry* entry = memory_ledger_find(mem);
+  void* ret;
+
+  /* resizing a ledger block to nothing frees it, and counts as a free */
+  if (entry && !nsize) {
+    cspec_free(mem);
+    return NULL;
+  }
+
+  /* ledger blocks are real heap blocks wherever they're resized */
+  if (entry) {
+    size_t fence = (size_t)((csByte*)mem - entry->block);
+    csByte* block = realloc(entry->block, nsize + fence * 2);
+    ret = block ? block + fence : NULL;
+    if (ret) {
+      memory_ledger_move(entry, ret, nsize);
+    }
+  } else {
+    csBool global = memory_ledger_active();
+    memory_ledger_site = site;
+    ret = memory_realloc(mem, nsize, site);
+    if (global) {
+      memory_ledger_add(site, ret, nsize);
+    }
+  }
+  if (memory_sample_interval && (ret || !nsize)) {
+    memory_sample_free(mem);
+    memory_sample_alloc(site, ret, nsize);
+  }
+  return ret;
+}
+
+#else
+
+static void memory_final_checks() { }
+static void memory_sample_report(void) { }
+static void memory_ledger_begin(void) { }
+static void memory_ledger_end(void) { }
+static void memory_ledger_baseline(void) { }
+static void memory_ledger_keep(void) { }
+static void memory_ledger_report(void) { }
+static void memory_test_reset(MemoryLevel level) { (void)level; }
+static csBool memory_snapshot_supported(void) { return TRUE; }
+static csSize memory_snapshot_size(void) { return 0; }
+static void memory_snapshot_save(csByte* out) { (void)out; }
+static csBool memory_snapshot_restore(const csByte* in) {
+  (void)in;
+  return TRUE;
+}
+void _memory_print_block(const void* ptr, int rows) { (void)ptr; (void)rows; }
+
+#endif
+
+/*----------------------------------------------------------------------------*\
+  Resource Testing
+\*----------------------------------------------------------------------------*\
+* The same idea as memory testing, for everything else a test can leave open.
+* Building with -Dopen=cspec_open (and likewise for close, socket, fopen,
+* fclose, mmap, munmap, pthread_create, pthread_join and pthread_detach) routes
+* those calls through here. Anything opened while a test group is running is
+* recorded until it's released, and whatever is still open when the test ends
+* fails the test. Handles opened outside of tests aren't tracked, and releasing
+* them just passes through.
+*
+* The I/O calls a test might want a budget for (read, write, fsync, etc.) are
+* wrapped the same way, and only counted. Locks are too: each acquisition
+* tries the lock first, and only if that fails is it counted as contended and
+* timed while it blocks, grouped by the call site that took it.
+*/
+
+#ifdef _CSPEC_USE_RESOURCE_TESTING_
+
+#if defined(__GNUC__)
+# define resource_caller() __builtin_return_address(0)
+#else
+# define resource_caller() NULL
+#endif
+
+#define resource_records_max 256
+
+typedef struct ResourceRecord {
+  ResourceKind kind;
+  const char* name;   /* what was opened, for reporting */
+  csSize handle;      /* descriptor, FILE*, mapping address, or pthread_t */
+  csSize size;        /* length of a mapping, in whole pages */
+  const void* site;   /* address of the code that opened it */
+} ResourceRecord;
+
+static ResourceRecord resource_records[resource_records_max];
+static int resource_records_size = 0;
+static csBool resource_records_full = FALSE;
+static volatile char resource_lock_flag = 0;
+
+#define resource_syscalls_max (syscall_epoll_wait + 1)
+static int resource_syscalls[resource_syscalls_max];
+
+#define resource_lock_sites_max 32
+
+typedef struct LockSite {
+  const void* site;
+  csUint acquired;
+  csUint contended;
+  csUint cond_waits;
+  csSize blocked_ns;  /* time spent waiting on contended acquisitions */
+  csSize cond_ns;     /* time spent waiting on condition variables */
+} LockSite;
+
+static LockSite resource_lock_sites[resource_lock_sites_max];
+static int resource_lock_site_count = 0;
+static int resource_lock_acquired = 0;
+static int resource_lock_contended = 0;
+
+/* Threads started by a test can open and close things at the same time */
+static void resource_lock(void) {
+  while (__atomic_test_and_set(&resource_lock_flag, __ATOMIC_ACQUIRE)) { }
+}
+
+static void resource_unlock(void) {
+  __atomic_clear(&resource_lock_flag, __ATOMIC_RELEASE);
+}
+
+static csSize resource_page_round(csSize size) {
+  csSize page = (csSize)sysconf(_SC_PAGESIZE);
+  return (size + page - 1) / page * page;
+}
+
+/* expects the lock to be held */
+static void resource_push(
+  ResourceKind kind, const char* name, csSize handle, csSize size,
+  const void* site
+) {
+  if (resource_records_size >= resource_records_max) {
+    resource_records_full = TRUE;
+    return;
+  }
+
+  ResourceRecord* record = &resource_records[resource_records_size++];
+  record->kind = kind;
+  record->name = name;
+  record->handle = handle;
+  record->size = size;
+  record->site = site;
+}
+
+/* expects the lock to be held, keeps records in the order they were opened */
+static void resource_erase(int index) {
+  --resource_records_size;
+  for (int i = index; i < resource_records_size; ++i) {
+    resource_records[i] = resource_records[i + 1];
+  }
+}
+
+static void resource_add(
+  ResourceKind kind, const char* name, csSize handle, csSize size,
+  const void* site
+) {
+  if (!test_in_function) return;
+
+  resource_lock();
+  resource_push(kind, name, handle, size, site);
+  resource_unlock();
+}
+
+static void resource_remove(ResourceKind kind, csSize handle) {
+  resource_lock();
+  for (int i = 0; i < resource_records_size; ++i) {
+    if (resource_records[i].kind == kind
+    &&  resource_records[i].handle == handle
+    ) {
+      resource_erase(i);
+      break;
+    }
+  }
+  resource_unlock();
+}
+
+/* munmap can release any part of a mapping, splitting it in the middle */
+static void resource_unmap(csSize addr, csSize size) {
+  csSize end = addr + resource_page_round(size);
+
+  resource_lock();
+  for (int i = 0; i < resource_records_size; ++i) {
+    ResourceRecord* record = &resource_records[i];
+    csSize lo = record->handle;
+    csSize hi = record->handle + record->size;
+
+    if (record->kind != resource_map || hi <= addr || lo >= end) continue;
+
+    if (addr <= lo && end >= hi) {
+      resource_erase(i--);
+    } else if (addr <= lo) {
+      record->handle = end;
+      record->size = hi - end;
+    } else if (end >= hi) {
+      record->size = addr - lo;
+    } else {
+      record->size = addr - lo;
+      resource_push(resource_map, record->name, end, hi - end, record->site);
+    }
+  }
+  resource_unlock();
+}
+
+static void resource_test_reset(void) {
+  resource_records_size = 0;
+  resource_records_full = FALSE;
+  for (int i = 0; i < resource_syscalls_max; ++i) {
+    resource_syscalls[i] = 0;
+  }
+  resource_lock_site_count = 0;
+  resource_lock_acquired = 0;
+  resource_lock_contended = 0;
+}
+
+static void resource_syscall(SyscallKind kind) {
+  if (test_in_function) {
+    __atomic_fetch_add(&resource_syscalls[kind], 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void resource_final_checks(void) {
+  if (resource_records_full) {
+    _cspec_warn_fn(0xFFFFFFFF,
+      "warning: too many resources open at once, not all were tracked"
+    );
+  }
+
+  for (int i = 0; i < resource_records_size; ++i) {
+    const ResourceRecord* record = &resource_records[i];
+
+    if (!test_expect_fail) {
+      csUint mark = output_index;
+      output_str("resource error: after: {} {}");
+      output_str(record->name);
+      if (record->kind == resource_fd) {
+        output_sint((long long int)record->handle);
+      } else {
+        output_ptr((const void*)(size_t)record->handle);
+      }
+      if (record->kind == resource_map) {
+        output_str(" ({} bytes)");
+        output_uint(record->size);
+      }
+      output_str(" left open");
+      if (record->site) {
+        output_str(", opened from {}");
+        output_ptr(record->site);
+      }
+      report_error(NULL, report_capture(mark));
+    }
+    test_failed = TRUE;
+  }
+}
+
+static int resource_count(ResourceKind kind) {
+  int count = 0;
+  resource_lock();
+  for (int i = 0; i < resource_records_size; ++i) {
+    if (resource_records[i].kind == kind) ++count;
+  }
+  resource_unlock();
+  return count;
+}
+
+int cspec_open(const char* path, int flags, ...) {
+  const void* site = resource_caller();
+  int mode = 0;
+
+  /* the mode is only passed along when a file might be created */
+  if (flags & O_CREAT
+#ifdef O_TMPFILE
+  ||  (flags & O_TMPFILE) == O_TMPFILE
+#endif
+  ) {
+    va_list args;
+    va_start(args, flags);
+    mode = va_arg(args, int);
+    va_end(args);
+  }
+
+  int fd = open(path, flags, mode);
+  if (fd >= 0) {
+    resource_add(resource_fd, "file descriptor", (csSize)fd, 0, site);
+  }
+  return fd;
+}
+
+int cspec_socket(int domain, int type, int protocol) {
+  const void* site = resource_caller();
+  int fd = socket(domain, type, protocol);
+  if (fd >= 0) {
+    resource_add(resource_fd, "socket", (csSize)fd, 0, site);
+  }
+  return fd;
+}
+
+/* forget the descriptor first, so a reused number can't be dropped instead */
+int cspec_close(int fd) {
+  if (fd >= 0) {
+    resource_remove(resource_fd, (csSize)fd);
+  }
+  return close(fd);
+}
+
+FILE* cspec_fopen(const char* path, const char* mode) {
+  const void* site = resource_caller();
+  FILE* file = fopen(path, mode);
+  if (file) {
+    resource_add(resource_file, "FILE stream", (csSize)(size_t)file, 0, site);
+  }
+  return file;
+}
+
+int cspec_fclose(FILE* file) {
+  if (file) {
+    resource_remove(resource_file, (csSize)(size_t)file);
+  }
+  return fclose(file);
+}
+
+void* cspec_mmap(
+  void* addr, size_t size, int prot, int flags, int fd, off_t offset
+) {
+  const void* site = resource_caller();
+  resource_syscall(syscall_mmap);
+  void* ret = mmap(addr, size, prot, flags, fd, offset);
+  if (ret != MAP_FAILED && test_in_function) {
+    csSize start = (csSize)(size_t)ret;
+    /* a fixed mapping replaces whatever was mapped there before */
+    if (flags & MAP_FIXED) {
+      resource_unmap(start, size);
+    }
+    resource_add(resource_map, "mapping", start, resource_page_round(size), site);
+  }
+  return ret;
+}
+
+int cspec_munmap(void* addr, size_t size) {
+  resource_syscall(syscall_munmap);
+  int ret = munmap(addr, size);
+  if (!ret) {
+    resource_unmap((csSize)(size_t)addr, size);
+  }
+  return ret;
+}
+
+int cspec_pthread_create(
+  pthread_t* thread, const pthread_attr_t* attr,
+  void* (*start_routine)(void*), void* arg
+) {
+  const void* site = resource_caller();
+  int ret = pthread_create(thread, attr, start_routine, arg);
+  if (ret) return ret;
+
+  /* threads created detached never need to be joined */
+  int detached = PTHREAD_CREATE_JOINABLE;
+  if (attr) {
+    pthread_attr_getdetachstate(attr, &detached);
+  }
+  if (detached != PTHREAD_CREATE_DETACHED) {
+    resource_add(resource_thread, "thread", (csSize)*thread, 0, site);
+  }
+  return ret;
+}
+
+int cspec_pthread_join(pthread_t thread, void** result) {
+  int ret = pthread_join(thread, result);
+  if (!ret) {
+    resource_remove(resource_thread, (csSize)thread);
+  }
+  return ret;
+}
+
+int cspec_pthread_detach(pthread_t thread) {
+  int ret = pthread_detach(thread);
+  if (!ret) {
+    resource_remove(resource_thread, (csSize)thread);
+  }
+  return ret;
+}
+
+ssize_t cspec_read(int fd, void* buffer, size_t size) {
+  resource_syscall(syscall_read);
+  return read(fd, buffer, size);
+}
+
+ssize_t cspec_write(int fd, const void* buffer, size_t size) {
+  resource_syscall(syscall_write);
+  return write(fd, buffer, size);
+}
+
+ssize_t cspec_readv(int fd, const struct iovec* iov, int count) {
+  resource_syscall(syscall_readv);
+  return readv(fd, iov, count);
+}
+
+ssize_t cspec_writev(int fd, const struct iovec* iov, int count) {
+  resource_syscall(syscall_writev);
+  return writev(fd, iov, count);
+}
+
+int cspec_fsync(int fd) {
+  resource_syscall(syscall_fsync);
+  return fsync(fd);
+}
+
+#ifdef __linux__
+int cspec_epoll_wait(
+  int epfd, struct epoll_event* events, int max_events, int timeout
+) {
+  resource_syscall(syscall_epoll_wait);
+  return epoll_wait(epfd, events, max_events, timeout);
+}
+#endif
+
+static csSize resource_clock_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (csSize)now.tv_sec * 1000000000 + (csSize)now.tv_nsec;
+}
+
+/* expects the lock to be held */
+static LockSite* resource_lock_site(const void* site) {
+  for (int i = 0; i < resource_lock_site_count; ++i) {
+    if (resource_lock_sites[i].site == site) {
+      return &resource_lock_sites[i];
+    }
+  }
+
+  if (resource_lock_site_count >= resource_lock_sites_max) return NULL;
+  LockSite* ls = &resource_lock_sites[resource_lock_site_count++];
+  *ls = (LockSite) { .site = site };
+  return ls;
+}
+
+static void resource_lock_record(
+  const void* site, csBool acquired, csBool contended, csSize blocked_ns
+) {
+  if (!test_in_function) return;
+
+  resource_lock();
+  if (acquired) ++resource_lock_acquired;
+  if (contended) ++resource_lock_contended;
+
+  LockSite* ls = resource_lock_site(site);
+  if (ls) {
+    if (acquired) ++ls->acquired;
+    if (contended) ++ls->contended;
+    ls->blocked_ns += blocked_ns;
+  }
+  resource_unlock();
+}
+
+static void resource_cond_record(const void* site, csSize waited_ns) {
+  if (!test_in_function) return;
+
+  resource_lock();
+  LockSite* ls = resource_lock_site(site);
+  if (ls) {
+    ++ls->cond_waits;
+    ls->cond_ns += waited_ns;
+  }
+  resource_unlock();
+}
+
+static void resource_lock_report(void) {
+  if (!resource_lock_site_count || param_verbose < V_RUN) return;
+
+  for (int i = 0; i < resource_lock_site_count; ++i) {
+    const LockSite* ls = &resource_lock_sites[i];
+    int level = print_headers(CONCOL_bWhite, LOGGED, NULL);
+    output_pad(param_tabsize * level, ' ');
+    output_str("lock at {}: {} acquired, {} contended ({} us blocked)");
+    output_ptr(ls->site);
+    output_uint(ls->acquired);
+    output_uint(ls->contended);
+    output_uint(ls->blocked_ns / 1000);
+    if (ls->cond_waits) {
+      output_str(", {} condition waits ({} us)");
+      output_uint(ls->cond_waits);
+      output_uint(ls->cond_ns / 1000);
+    }
+    output_print();
+  }
+}
+
+/* a robust mutex whose owner died is still acquired, and has to be fixed up */
+#ifdef EOWNERDEAD
+# define resource_lock_held(ret) (!(ret) || (ret) == EOWNERDEAD)
+#else
+# define resource_lock_held(ret) (!(ret))
+#endif
+
+/*
+* Each lock is tried first, and only waited on if it's busy. Any other result
+* from the try (an error, or a lock taken from a dead owner) is returned as is.
+*/
+int cspec_pthread_mutex_lock(pthread_mutex_t* mutex) {
+  const void* site = resource_caller();
+  int ret = pthread_mutex_trylock(mutex);
+  if (ret != EBUSY) {
+    if (resource_lock_held(ret)) resource_lock_record(site, TRUE, FALSE, 0);
+    return ret;
+  }
+
+  csSize start = resource_clock_ns();
+  ret = pthread_mutex_lock(mutex);
+  if (resource_lock_held(ret)) {
+    resource_lock_record(site, TRUE, TRUE, resource_clock_ns() - start);
+  }
+  return ret;
+}
+
+/* a failed try is still a sign the lock is contended */
+int cspec_pthread_mutex_trylock(pthread_mutex_t* mutex) {
+  const void* site = resource_caller();
+  int ret = pthread_mutex_trylock(mutex);
+  if (resource_lock_held(ret) || ret == EBUSY) {
+    resource_lock_record(site, resource_lock_held(ret), ret == EBUSY, 0);
+  }
+  return ret;
+}
+
+int cspec_pthread_rwlock_rdlock(pthread_rwlock_t* lock) {
+  const void* site = resource_caller();
+  int ret = pthread_rwlock_tryrdlock(lock);
+  if (ret != EBUSY) {
+    if (!ret) resource_lock_record(site, TRUE, FALSE, 0);
+    return ret;
+  }
+
+  csSize start = resource_clock_ns();
+  ret = pthread_rwlock_rdlock(lock);
+  if (!ret) {
+    resource_lock_record(site, TRUE, TRUE, resource_clock_ns() - start);
+  }
+  return ret;
+}
+
+int cspec_pthread_rwlock_wrlock(pthread_rwlock_t* lock) {
+  const void* site = resource_caller();
+  int ret = pthread_rwlock_trywrlock(lock);
+  if (ret != EBUSY) {
+    if (!ret) resource_lock_record(site, TRUE, FALSE, 0);
+    return ret;
+  }
+
+  csSize start = resource_clock_ns();
+  ret = pthread_rwlock_wrlock(lock);
+  if (!ret) {
+    resource_lock_record(site, TRUE, TRUE, resource_clock_ns() - start);
+  }
+  return ret;
+}
+
+int cspec_pthread_rwlock_tryrdlock(pthread_rwlock_t* lock) {
+  const void* site = resource_caller();
+  int ret = pthread_rwlock_tryrdlock(lock);
+  if (!ret || ret == EBUSY) {
+    resource_lock_record(site, !ret, ret == EBUSY, 0);
+  }
+  return ret;
+}
+
+int cspec_pthread_rwlock_trywrlock(pthread_rwlock_t* lock) {
+  const void* site = resource_caller();
+  int ret = pthread_rwlock_trywrlock(lock);
+  if (!ret || ret == EBUSY) {
+    resource_lock_record(site, !ret, ret == EBUSY, 0);
+  }
+  return ret;
+}
+
+int cspec_pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+  const void* site = resource_caller();
+  csSize start = resource_clock_ns();
+  int ret = pthread_cond_wait(cond, mutex);
+  resource_cond_record(site, resource_clock_ns() - start);
+  return ret;
+}
+
+int cspec_pthread_cond_timedwait(
+  pthread_cond_t* cond, pthread_mutex_t* mutex, const struct timespec* time
+) {
+  const void* site = resource_caller();
+  csSize start = resource_clock_ns();
+  int ret = pthread_cond_timedwait(cond, mutex, time);
+  resource_cond_record(site, resource_clock_ns() - start);
+  return ret;
+}
+
+#else
+
+static void resource_test_reset(void) { }
+static void resource_final_checks(void) { }
+static void resource_lock_report(void) { }
+
+#endif
+
+/*----------------------------------------------------------------------------*\
+  Stack Testing
+\*----------------------------------------------------------------------------*\
+* With a stack size set (CSPEC_STACK_SIZE at compile time, or --stack-size),
+* each pass of a test group runs on a dedicated stack of that size instead of
+* the main one. The stack is painted with a pattern before the pass, and again
+* below the stack pointer when the test begins, so the deepest byte no longer
+* holding the pattern is the high-water mark for the test. A protected page
+* under the stack turns an overflow into a crash at the call that caused it.
+*/
+
+#if defined(__linux__) && !defined(__WASM__)
+# include <ucontext.h>
+# include <sys/mman.h>
+# include <unistd.h>
+# if defined(__GLIBC__) && defined(MAP_ANONYMOUS)
+#  define _CSPEC_USE_STACK_TESTING_
+# endif
+#endif
+
+#ifdef CSPEC_STACK_SIZE
+# define stack_size_default CSPEC_STACK_SIZE
+#else
+# define stack_size_default 0
+#endif
+
+#ifdef _CSPEC_USE_STACK_TESTING_
+
+#define stack_pattern 0xA5
+#define stack_margin 512      /* left unpainted below the painting function */
+#define stack_size_min 16384  /* cspec itself needs some room to report */
+
+static csByte* stack_base = NULL;
+static csByte* stack_mapping = NULL;
+static size_t stack_size = 0;
+static size_t stack_mapped = 0;
+static csByte* stack_test_top = NULL;
+static csBool stack_in_use = FALSE;
+static ucontext_t stack_caller;
+static ucontext_t stack_callee;
+static test_fn stack_fn = NULL;
+
+static __attribute__((noinline)) csByte* stack_pointer(void) {
+  return __builtin_frame_address(0);
+}
+
+static void stack_paint(csByte* lo, csByte* hi) {
+  if (lo < stack_base) lo = stack_base;
+  if (hi > lo) cspec_memset(lo, stack_pattern, (csSize)(hi - lo));
+}
+
+static csBool stack_prepare(void) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t size = param_stack_size < stack_size_min
+    ? stack_size_min : (size_t)param_stack_size;
+  size = (size + page - 1) / page * page;
+
+  if (stack_mapping && stack_size == size) return TRUE;
+  if (stack_mapping) munmap(stack_mapping, stack_mapped);
+
+  stack_mapped = size + page;
+  void* mapping = mmap(
+    NULL, stack_mapped, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+  );
+  if (mapping == MAP_FAILED) {
+    stack_mapping = NULL;
+    return FALSE;
+  }
+
+  stack_mapping = mapping;
+  mprotect(stack_mapping, page, PROT_NONE);
+  stack_base = stack_mapping + page;
+  stack_size = size;
+  return TRUE;
+}
+
+static void stack_entry(void) {
+  stack_fn();
+}
+
+static void stack_run(test_fn fn) {
+  stack_test_top = NULL;
+
+  /* a run started from inside a test stays on the stack it's already on */
+  if (!param_stack_size || stack_in_use || !stack_prepare()) {
+    fn();
+    return;
+  }
+
+  stack_paint(stack_base, stack_base + stack_size);
+  stack_fn = fn;
+
+  getcontext(&stack_callee);
+  stack_callee.uc_stack.ss_sp = stack_base;
+  stack_callee.uc_stack.ss_size = stack_size;
+  stack_callee.uc_link = &stack_caller;
+  makecontext(&stack_callee, stack_entry, 0);
+
+  stack_in_use = TRUE;
+  swapcontext(&stack_caller, &stack_callee);
+  stack_in_use = FALSE;
+}
+
+/* Forget whatever the context setup used, only the test itself counts */
+static void stack_begin(void) {
+  if (!stack_in_use) return;
+
+  stack_test_top = stack_pointer();
+  stack_paint(stack_base, stack_test_top - stack_margin);
+}
+
+static csSize stack_high_water(void) {
+  if (!stack_test_top) return 0;
+
+  const csByte* deepest = stack_base;
+  while (deepest < stack_test_top && *deepest == stack_pattern) ++deepest;
+  return (csSize)(stack_test_top - deepest);
+}
+
+static void stack_report(void) {
+  /* The test ends after its pass returns, so the dedicated stack is idle */
+  if (!stack_test_top || param_verbose < V_NOTES) return;
+
+  int level = print_headers(CONCOL_bWhite, LOGGED, NULL);
+  output_pad(param_tabsize * level, ' ');
+  output_str("stack usage: {} bytes (of {} available)");
+  output_uint(stack_high_water());
+  output_uint((csSize)(stack_test_top - stack_base));
+  output_print();
+}
+
+#else
+
+static void stack_run(test_fn fn) { fn(); }
+static void stack_begin(void) { }
+static void stack_report(void) { }
+
+#endif
+
+/*----------------------------------------------------------------------------*\
+  Test Context
+\*----------------------------------------------------------------------------*\
+* A test context allows pre-test setup to be shared between multiple tests.
+* Variables can be created and accessed within the tests, and other setup can
+* be performed before running the tests. After each test, the test group
+* function is exited and re-entered, meaning the context is recreated for every
+* test (ie, incrementing a shared value in one test will not affect the next
+* test), and after the context is passed, the setup won't be run again for any
+* tests that follow it.
+*/
+
+/*
+* To allow nested contexts, we need a stack... the stack persists for the whole
+* test group (between multiple calls of the group function), and is used to
+* keep track of
+*/
+typedef struct Context {
+  const char* desc;
+  int line;
+  csBool printed;
+  csBool requested_context;
+} Context;
+
+#ifndef cspec_ctx_stack_size_max
+# define cspec_ctx_stack_size_max 20
+#endif
+
+static Context ctx_stack[cspec_ctx_stack_size_max] = {
+  {
+    .desc = "<root context>",
+    .line = 0,
+    .printed = FALSE,
+    .requested_context = FALSE,
+  }
+};
+
+/*
+* Iterator through the stack.
+* This is reset to the root between each each call to the test function.
+*/
+static int ctx_stack_index = 0;
+
+/*
+* Index of the top of the stack.
 * The stack is cleared between each test group. Root node cannot be popped.
 */
-static int ctx_stack_top = 0; // rename to ctx_stack_top
+static int ctx_stack_top = 0; // rename to ctx_stack_top
+
+static void fixture_pop(int depth);
+static void report_context(int line, csBool entering);
+
+/* Called whenever the test enters a "context()" block */
+csBool _cspec_context_begin(int line, const char* desc) {
+
+  /*
+  * If we are currently executing a test, skip the context (allow previous
+  * contexts to close out their post-test statements)
+  */
+  if (test_in_progress) {
+    return FALSE;
+  }
+
+  /*
+  * On each pass of the test function, we have to walk up the stack. If our
+  * context is already there, don't create a duplicate of it.
+  */
+  if (ctx_stack_index < ctx_stack_top
+  && ctx_stack[ctx_stack_index + 1].desc == desc
+  ) {
+    ++ctx_stack_index;
+    return TRUE;
+  }
+
+  /*
+  * If we're completing execution of the context, we expect it to be at the
+  * top of the stack
+  */
+  if (ctx_stack[ctx_stack_index].desc == desc) {
+    return TRUE;
+  }
+
+  /*
+  * If we're not on the stack anymore, and the current test line is past our
+  * context, we've completed the tests in it and can skip it.
+  */
+  if (test_current_line > line) {
+    return FALSE;
+  }
+
+  /*
+  * Any other context on the stack should still be open (and thus already
+  * passed by the stack ptr), or have already closed out and be gone.
+  */
+  assert(ctx_stack_index == ctx_stack_top);
+
+  /*
+  * If this context's line was specified in the input params, run all the
+  * tests in this context, and end the tests as soon as it's popped.
+  */
+  csBool is_requested = FALSE;
+  if (line == param_line) {
+    is_requested = TRUE;
+    param_line = 0;
+  }
+
+  /*
+  * When this is added to the stack, we can set it as the current line.
+  * (not strictly necessary, but good for bookkeeping?)
+  */
+  test_current_line = line;
+
+  /* Make sure we won't overflow the stack if we add another context */
+  if (ctx_stack_top + 1 >= cspec_ctx_stack_size_max) {
+    _cspec_warn_fn(line,
+      "context error:%c Too many nested contexts - maximum depth allowed: "
+      STR(cspec_ctx_stack_size_max)
+    );
+    _cspec_warn_fn(line,
+      "%cStack limit can be increased by defining cspec_ctx_stack_size_max"
+    );
+    return FALSE;
+  }
+
+  /* If we get here, we are entering a context for the first time. */
+  ctx_stack_index = ++ctx_stack_top;
+  ctx_stack[ctx_stack_index] = (Context) {
+    .desc = desc,
+    .line = line,
+    .printed = FALSE,
+    .requested_context = is_requested
+  };
+
+  report_context(line, TRUE);
+
+  return TRUE;
+}
+
+/* Called at the end of a context block in "context_end" */
+csBool _cspec_context_end(int line) {
+
+  /*
+  * If we're at the end of a context, we want to pop it off the stack if we
+  * didn't actually run any tests in this pass. Otherwise, return false to
+  * keep executing within this context.
+  */
+  if (test_in_progress) {
+    return FALSE;
+  }
+
+  /*
+  * Sanity check - this generally shouldn't be possible to hit?
+  */
+  /*
+  assert(test_current_line < line);
+  if (test_current_line >= line) {
+    return FALSE;
+  }
+  */
+
+  /*
+  * Update to the next line, because the context begin and end statements
+  * should actually be on the same line.
+  *
+  * This will usually make the line value go down (unless the context is
+  * empty), which is ok because as long as it's above the context line
+  * the entire block will be skipped.
+  */
+  test_current_line = line + 1;
+
+  /*
+  * Once we pop a specifically requested context, end the tests.
+  * If we're in verbose mode, we want to still go thorugh them all to print
+  * the descriptions of un-run tests.
+  */
+  if (ctx_stack[ctx_stack_top].requested_context) {
+    param_line = -1;
+  }
+
+  /* Make sure we're not trying to pop the stack root */
+  assert(ctx_stack_top != 0);
+
+  /* Pop the context from the stack, along with any fixtures it set up */
+  report_context(ctx_stack[ctx_stack_top].line, FALSE);
+  ctx_stack_index = --ctx_stack_top;
+  fixture_pop(ctx_stack_top);
+
+  return TRUE;
+}
+
+/* Called between each test group, after all passes on a function are completed */
+static void context_clear_stack(void) {
+  while (ctx_stack_top > 0) {
+    report_context(ctx_stack[ctx_stack_top].line, FALSE);
+    --ctx_stack_top;
+  }
+  ctx_stack_index = 0;
+  fixture_pop(-1);
+}
+
+/*----------------------------------------------------------------------------*\
+  Fixtures
+\*----------------------------------------------------------------------------*\
+* Context setup normally runs again for every test in the context. Setup in a
+* fixture block only runs for the first one: when the block ends, the data
+* registered with fixture_data (and the memory testing arena) is copied aside,
+* and for the later tests in the context it's copied back instead of running
+* the block again. This needs no fork or libc, so it works the same on WASM.
+* Snapshots are stacked with the contexts that own them, and dropped when the
+* context is done.
+*/
+
+#ifndef cspec_fixture_size_max
+# define cspec_fixture_size_max 65536
+#endif
+
+#ifndef cspec_fixture_regions_max
+# define cspec_fixture_regions_max 16
+#endif
+
+typedef struct FixtureRegion {
+  void* data;
+  csSize size;
+} FixtureRegion;
+
+typedef struct Fixture {
+  int line;
+  int depth;        /* index of the context that owns the fixture */
+  csSize start;     /* offset of the snapshot in the fixture buffer */
+  csSize regions;   /* bytes of registered data at the start of the snapshot */
+} Fixture;
+
+static csByte fixture_buffer[cspec_fixture_size_max];
+static csSize fixture_buffer_top = 0;
+static Fixture fixture_stack[cspec_ctx_stack_size_max];
+static int fixture_stack_top = 0;
+static FixtureRegion fixture_regions[cspec_fixture_regions_max];
+static int fixture_region_count = 0;
+static int fixture_recording = 0; /* line of the fixture being set up */
+
+static void fixture_pop(int depth) {
+  while (fixture_stack_top && fixture_stack[fixture_stack_top - 1].depth > depth) {
+    fixture_buffer_top = fixture_stack[--fixture_stack_top].start;
+  }
+}
+
+static csSize fixture_regions_size(void) {
+  csSize size = 0;
+  for (int i = 0; i < fixture_region_count; ++i) {
+    size += fixture_regions[i].size;
+  }
+  return size;
+}
+
+static csBool fixture_restore(const Fixture* fx) {
+  const csByte* in = fixture_buffer + fx->start;
+
+  if (fx->regions != fixture_regions_size()
+  ||  !memory_snapshot_restore(in + fx->regions)
+  ) {
+    return FALSE;
+  }
+
+  for (int i = 0; i < fixture_region_count; ++i) {
+    cspec_memcpy(fixture_regions[i].data, in, fixture_regions[i].size);
+    in += fixture_regions[i].size;
+  }
+  return TRUE;
+}
+
+static void fixture_save(int line) {
+  csSize regions = fixture_regions_size();
+  csSize size = regions + memory_snapshot_size();
+
+  if (fixture_stack_top >= cspec_ctx_stack_size_max
+  ||  fixture_buffer_top + size > cspec_fixture_size_max
+  ) {
+    _cspec_warn_fn(line, "warning: fixture is too large to keep, so it will "
+      "run for every test (see cspec_fixture_size_max)"
+    );
+    return;
+  }
+
+  fixture_stack[fixture_stack_top++] = (Fixture) {
+    .line = line,
+    .depth = ctx_stack_index,
+    .start = fixture_buffer_top,
+    .regions = regions
+  };
+
+  csByte* out = fixture_buffer + fixture_buffer_top;
+  for (int i = 0; i < fixture_region_count; ++i) {
+    cspec_memcpy(out, fixture_regions[i].data, fixture_regions[i].size);
+    out += fixture_regions[i].size;
+  }
+  memory_snapshot_save(out);
+  fixture_buffer_top += size;
+}
+
+/* Called before each pass of the test function */
+static void fixture_reset(void) {
+  fixture_region_count = 0;
+  fixture_recording = 0;
+}
+
+void _cspec_fixture_data(int line, void* data, csSize size) {
+  if (fixture_region_count >= cspec_fixture_regions_max) {
+    _cspec_warn_fn(line, "warning: too many fixture_data regions, maximum: "
+      STR(cspec_fixture_regions_max)
+    );
+    return;
+  }
+  fixture_regions[fixture_region_count++] = (FixtureRegion) { data, size };
+}
+
+/* Returns true if the fixture's block needs to be run */
+csBool _cspec_fixture_begin(int line) {
+  fixture_recording = 0;
+
+  /* past a test, the rest of the pass runs the same as it would otherwise */
+  if (test_in_progress || !memory_snapshot_supported()) {
+    return TRUE;
+  }
+
+  for (int i = 0; i < fixture_stack_top; ++i) {
+    if (fixture_stack[i].line != line) continue;
+
+    if (fixture_restore(&fixture_stack[i])) {
+      fixture_region_count = 0;
+      return FALSE;
+    }
+
+    /* couldn't put it back, so drop it and set up from scratch */
+    fixture_buffer_top = fixture_stack[i].start;
+    fixture_stack_top = i;
+    break;
+  }
+
+  fixture_recording = line;
+  return TRUE;
+}
+
+/* Called after the fixture's block runs, ends the loop */
+csBool _cspec_fixture_end(int line) {
+  if (fixture_recording == line && !test_in_progress) {
+    fixture_save(line);
+  }
+  fixture_reset();
+  return FALSE;
+}
+
+/*----------------------------------------------------------------------------*\
+  Reporters
+\*----------------------------------------------------------------------------*\
+* Everything that happens in a run is sent as an event to each active reporter.
+* The console reporter below is the one that prints the usual output, other
+* formats can be added next to it with cspec_add_reporter. Output that's only
+* meant for the console (memory records, profiles, notes and such) is still
+* printed directly, and is dropped along with the rest if it's removed.
+*/
+
+#ifndef cspec_reporters_max
+# define cspec_reporters_max 8
+#endif
+
+#ifndef cspec_report_text_size
+# define cspec_report_text_size output_size
+#endif
+
+#define report_values_max 10
+
+#define report(CALLBACK, EVENT)                                               \
+  for (int _report_i = 0; _report_i < report_count; ++_report_i)             \
+    if (report_list[_report_i]->CALLBACK)                                     \
+      report_list[_report_i]->CALLBACK(report_list[_report_i]->data, EVENT)
+
+static const Reporter* report_list[cspec_reporters_max] = {
+  &cspec_console_reporter
+};
+static int report_count = 1;
+
+static const char* report_path[cspec_ctx_stack_size_max + 1];
+static const char* report_values[report_values_max];
+static const char* report_types[report_values_max];
+static char report_text[cspec_report_text_size];
+static csUint report_text_index = 0;
+static csUint report_text_end = cspec_report_text_size; /* room left after */
+
+static csSize report_run_start = 0;
+static csSize report_suite_start = 0;
+static csSize report_group_start = 0;
+static csSize report_test_start = 0;
+
+static csSize report_clock_ns(void) {
+#ifdef __WASM__
+  return 0;
+#else
+  struct timespec now;
+  timespec_get(&now, TIME_UTC);
+  return (csSize)now.tv_sec * 1000000000 + (csSize)now.tv_nsec;
+#endif
+}
+
+csBool cspec_add_reporter(const Reporter* reporter) {
+  if (!reporter || report_count >= cspec_reporters_max) return FALSE;
+  for (int i = 0; i < report_count; ++i) {
+    if (report_list[i] == reporter) return FALSE;
+  }
+  report_list[report_count++] = reporter;
+  if (reporter == &cspec_console_reporter) output_muted = FALSE;
+  return TRUE;
+}
+
+csBool cspec_remove_reporter(const Reporter* reporter) {
+  for (int i = 0; i < report_count; ++i) {
+    if (report_list[i] != reporter) continue;
+    for (--report_count; i < report_count; ++i) {
+      report_list[i] = report_list[i + 1];
+    }
+    if (reporter == &cspec_console_reporter) output_muted = TRUE;
+    return TRUE;
+  }
+  return FALSE;
+}
+
+/* Skips the "test %c[12] " style prefix descriptions are printed with */
+static const char* report_name(const char* desc) {
+  for (const char* s = desc; *s; ++s) {
+    if (s[0] == ']' && s[1] == ' ') return s + 2;
+  }
+  return desc;
+}
+
+/* Fills in where the run is for a new event */
+static ReportEvent report_event(int line) {
+  int depth = 0;
+  for (int i = 1; i <= ctx_stack_top; ++i) {
+    report_path[depth++] = report_name(ctx_stack[i].desc);
+  }
+  if (test_in_progress) {
+    report_path[depth++] = report_name(test_description);
+  }
+  report_text_index = 0;
+
+  return (ReportEvent) {
+    .file = current_suite ? current_suite->filename : NULL,
+    .group = test_function ? test_function->header : NULL,
+    .path = report_path,
+    .depth = depth,
+    .line = line,
+  };
+}
+
+static void report_test_begin(int line) {
+  ReportEvent event = report_event(line);
+  report(test_begin, &event);
+}
+
+static void report_test_skipped(int line) {
+  ReportEvent event = report_event(line);
+  event.outcome = report_skipped;
+  report(test_end, &event);
+}
+
+static void report_context(int line, csBool entering) {
+  ReportEvent event = report_event(line);
+  if (entering) {
+    report(context_begin, &event);
+  } else {
+    report(context_end, &event);
+  }
+}
+
+static void report_text_char(char c) {
+  if (report_text_index + 1 < report_text_end) {
+    report_text[report_text_index++] = c;
+  }
+}
+
+/* Copies text as the console would print it, minus the color markers */
+static void report_text_str(const char* s) {
+  while (s && *s) {
+    if (s[0] == '%' && (s[1] == 'c' || s[1] == 'n')) {
+      s += 2;
+      continue;
+    }
+    report_text_char(*s++);
+  }
+}
+
+static const char* report_text_finish(const char* start) {
+  report_text[report_text_index] = '\0';
+  if (report_text_index + 1 < report_text_end) ++report_text_index;
+  return start;
+}
+
+static const char* report_text_copy(const char* s) {
+  const char* start = report_text + report_text_index;
+  report_text_str(s);
+  return report_text_finish(start);
+}
+
+/* Takes up to max bytes printed after mark, ending with "..." when it's cut */
+static const char* report_capture_max(csUint mark, csUint max) {
+  const char* start = report_text + report_text_index;
+  csUint end = output_index;
+  if (end - mark > max) {
+    end = mark + max - 3;
+    /* doesn't stop partway through a UTF-8 character */
+    while (end > mark && ((csByte)output_buffer[end] & 0xC0) == 0x80) --end;
+  }
+  for (csUint i = mark; i < end; ++i) {
+    report_text_char(output_buffer[i]);
+  }
+  if (end < output_index) report_text_str("...");
+  output_index = mark;
+  output_buffer[output_index] = '\0';
+  return report_text_finish(start);
+}
+
+/* Takes whatever was printed to the output buffer after mark */
+static const char* report_capture(csUint mark) {
+  return report_capture_max(mark, (csUint)-1);
+}
+
+/* Writes the full failure message, filling each {} in fmt with its value */
+static void report_compose_text(const char* pre, const char* fmt,
+  const char* const* values, int count
+) {
+  int value = 0;
+  report_text_str(pre);
+  while (fmt && *fmt) {
+    if (fmt[0] == '{' && fmt[1] == '}') {
+      for (const char* v = value < count ? values[value++] : ""; *v; ++v) {
+        report_text_char(*v);
+      }
+      fmt += 2;
+    } else if (fmt[0] == '{' && fmt[1] == '{') {
+      report_text_char('{');
+      fmt += 2;
+    } else if (fmt[0] == '%' && (fmt[1] == 'c' || fmt[1] == 'n')) {
+      fmt += 2;
+    } else {
+      report_text_char(*fmt++);
+    }
+  }
+  /* values without a place in the format are printed after it */
+  for (; value < count; ++value) {
+    for (const char* v = values[value]; *v; ++v) {
+      report_text_char(*v);
+    }
+  }
+}
+
+static const char* report_compose(const char* pre, const char* fmt,
+  const char* const* values, int count
+) {
+  const char* start = report_text + report_text_index;
+  report_compose_text(pre, fmt, values, count);
+  return report_text_finish(start);
+}
+
+/* Builds a failure that isn't tied to an expectation's line */
+static ReportEvent report_error_event(const char* prefix, const char* message) {
+  ReportEvent event = report_event(test_current_line);
+  const char* start = report_text + report_text_index;
+  report_text_str(prefix);
+  report_text_str(message);
+  event.message = report_text_finish(start);
+  event.format = event.message;
+  return event;
+}
+
+static void report_error(const char* prefix, const char* message) {
+  ReportEvent event = report_error_event(prefix, message);
+  report(failure, &event);
+}
+
+/*
+* The console reporter. Headers for the file, group, contexts and test are
+* only printed once something under them has to be.
+*/
+
+/* Keeps what was printed before the test ahead of anything the test prints */
+static void console_test_begin(void* data, const ReportEvent* event) {
+  (void)data; (void)event;
+  output_flush();
+}
+
+static void console_group_end(void* data, const ReportEvent* event) {
+  (void)data; (void)event;
+  output_flush();
+}
+
+static void console_test_end(void* data, const ReportEvent* event) {
+  (void)data;
+  if (event->outcome == report_skipped) {
+    print_headers(CONCOL_Blue, LOGGED, NULL);
+  } else if (event->outcome == report_passed) {
+    if (param_verbose >= V_RUN || param_line) {
+      const char* failnote = event->expected_fail
+        ? " (failed successfully)" : NULL;
+      print_headers(CONCOL_Green, LOGGED, failnote);
+    }
+  } else {
+    /* get failures out in case a later test crashes */
+    output_flush();
+  }
+}
+
+static void console_failure(void* data, const ReportEvent* event) {
+  (void)data;
+  int level = print_headers(CONCOL_Red, PRINTED, NULL);
+
+  if (!event->expectation) {
+    output_pad(param_tabsize * level, ' ');
+    output_str(event->message);
+    output_print();
+    if (param_padding) output_print();
+    return;
+  }
+
+  if (output_indent) {
+    output_pad(output_indent, ' ');
+  }
+  else {
+    output_pad(param_tabsize * level, ' ');
+    output_str("line {}: ");
+    output_sint(event->line);
+    output_indent = output_index - output_line;
+  }
+  output_str("{}");
+  output_str(event->expectation);
+
+  if (event->format) {
+    output_str(event->format);
+    for (int i = 0; i < event->value_count; ++i) {
+      output_raw(event->values[i]);
+    }
+
+    /* Follows the line with the given types for debugging, ie. : (int, int) */
+    if (param_show_types) {
+      output_str(" : ( ");
+      for (int i = 0; i < event->value_count; ++i) {
+        if (i) output_str(", ");
+        output_str(event->types[i]);
+      }
+      output_str(" )");
+    }
+  }
+
+  output_print();
+
+  /* the diff is escaped already, so it's copied as-is */
+  for (const char* s = event->diff; s && *s; ) {
+    output_pad(output_indent, ' ');
+    while (*s && *s != '\n') output_char_no_fmt(*s++);
+    output_buffer[output_index] = '\0';
+    output_print();
+    if (*s) ++s;
+  }
+
+  /* print empty line for padding */
+  if (param_padding) output_print();
+}
+
+static void console_warning(void* data, const ReportEvent* event) {
+  (void)data;
+  int level = print_headers(CONCOL_Yellow, LOGGED, NULL);
+  output_pad(param_tabsize * level, ' ');
+  output_str("line {}:%c ");
+  output_sint(event->line);
+  output_str(event->format);
+  output_print_color(test_warned ? CONCOL_Yellow : CONCOL_bYellow);
+}
+
+static void console_summary(void* data, const ReportEvent* event) {
+  (void)data;
+  if (event->tests) {
+    ConsoleColor color = event->tests == event->passed
+      ? CONCOL_bGreen : CONCOL_bRed;
+    output_str("Tests passed:%c {} out of {}, or {}%");
+    output_sint(event->passed);
+    output_sint(event->tests);
+    output_sint((int)(100.f * (float)event->passed / (float)event->tests));
+    if (event->warnings) {
+      output_str(" - warnings: ");
+      output_sint(event->warnings);
+      if (color == CONCOL_bGreen) color = CONCOL_bYellow;
+    }
+    output_print_color(color);
+  } else {
+    output_str("Tests passed:%c 0 out of 0");
+    output_print_color(CONCOL_bYellow);
+  }
+
+  output_flush();
+}
+
+const Reporter cspec_console_reporter = {
+  .group_end = console_group_end,
+  .test_begin = console_test_begin,
+  .test_end = console_test_end,
+  .failure = console_failure,
+  .warning = console_warning,
+  .summary = console_summary,
+};
+
+/*----------------------------------------------------------------------------*\
+  Report Formats
+\*----------------------------------------------------------------------------*\
+* Reporters for CI systems, added with --reporter. JUnit XML is written to a
+* file, TAP to a file or in place of the console output. The counts on each
+* JUnit suite aren't known until its tests have run, so room is left for them
+* in the opening tag and they're written in once the suite ends.
+*/
+
+#ifndef __WASM__
+
+#ifndef cspec_format_failure_size
+# define cspec_format_failure_size 8192
+#endif
+
+#define format_counts_width 96
+
+typedef struct FormatState {
+  FILE* file;
+  long run_counts;      /* file offset of the room left for the run's counts */
+  long suite_counts;    /* and for the counts of the suite being written */
+  int tests;
+  int failures;
+  int skipped;
+  int total_tests;
+  int total_failures;
+  int total_skipped;
+  int failure_line;     /* line of the first failure in the test */
+  csUint failure_size;
+  char failure_text[cspec_format_failure_size];
+} FormatState;
+
+static FormatState format_junit;
+static FormatState format_tap;
+static csBool format_took_console = FALSE;
+
+static void format_append(FormatState* state, const char* s) {
+  while (s && *s && state->failure_size + 1 < cspec_format_failure_size) {
+    state->failure_text[state->failure_size++] = *s++;
+  }
+  state->failure_text[state->failure_size] = '\0';
+}
+
+static void format_test_begin(void* data, const ReportEvent* event) {
+  FormatState* state = data;
+  (void)event;
+  state->failure_line = 0;
+  state->failure_size = 0;
+  state->failure_text[0] = '\0';
+}
+
+/* Collects the failures of a test to write out with its result */
+static void format_failure(void* data, const ReportEvent* event) {
+  FormatState* state = data;
+  if (!state->failure_line) state->failure_line = event->line;
+  if (state->failure_size) format_append(state, "\n");
+  if (event->expectation) {
+    char line[32];
+    snprintf(line, sizeof(line), "line %d: ", event->line);
+    format_append(state, line);
+  }
+  format_append(state, event->message);
+}
+
+/* Escapes text for XML, stopping at the first newline if one_line is set */
+static void format_xml(FILE* file, const char* s, csBool one_line) {
+  for (; s && *s; ++s) {
+    switch (*s) {
+      case '&': fputs("&amp;", file); break;
+      case '<': fputs("&lt;", file); break;
+      case '>': fputs("&gt;", file); break;
+      case '"': fputs("&quot;", file); break;
+      case '\n': if (one_line) return; fputc('\n', file); break;
+      default:
+        /* most control characters aren't allowed in XML at all */
+        fputc((unsigned char)*s < 0x20 && *s != '\t' ? '?' : *s, file);
+    }
+  }
+}
+
+/* Escapes text for a TAP test line or a quoted YAML string in its details */
+static void format_tap_str(FILE* file, const char* s, csBool yaml) {
+  for (; s && *s; ++s) {
+    if (*s == '\n') {
+      fputs(yaml ? "\\n" : " ", file);
+    } else if (yaml && (*s == '"' || *s == '\\')) {
+      fputc('\\', file);
+      fputc(*s, file);
+    } else if (!yaml && *s == '#') {
+      fputs("\\#", file);
+    } else {
+      fputc((unsigned char)*s < 0x20 && *s != '\t' ? '?' : *s, file);
+    }
+  }
+}
+
+/* Writes the context and test descriptions, ie. "with a value it works" */
+static void format_path(FILE* file, const ReportEvent* event, csBool xml) {
+  for (int i = 0; i < event->depth; ++i) {
+    if (i) fputc(' ', file);
+    if (xml) {
+      format_xml(file, event->path[i], TRUE);
+    } else {
+      format_tap_str(file, event->path[i], FALSE);
+    }
+  }
+}
+
+/* Leaves room for counts that will be filled in later */
+static long junit_counts_reserve(FILE* file) {
+  long at = ftell(file);
+  fprintf(file, "%*s", format_counts_width, "");
+  return at;
+}
+
+/* Whitespace between attributes is allowed, so the counts are padded out */
+static void junit_counts_write(
+  FILE* file, long at, int tests, int failures, int skipped, csSize ns
+) {
+  char counts[format_counts_width + 1];
+  long end = ftell(file);
+  if (at < 0 || end < 0) return;
+
+  snprintf(counts, sizeof(counts),
+    " tests=\"%d\" failures=\"%d\" errors=\"0\" skipped=\"%d\" time=\"%.6f\"",
+    tests, failures, skipped, (double)ns / 1e9
+  );
+  fseek(file, at, SEEK_SET);
+  fprintf(file, "%-*s", format_counts_width, counts);
+  fseek(file, end, SEEK_SET);
+}
+
+static void junit_suite_begin(void* data, const ReportEvent* event) {
+  FormatState* state = data;
+  fputs("  <testsuite name=\"", state->file);
+  format_xml(state->file, event->file, TRUE);
+  fputc('"', state->file);
+  state->suite_counts = junit_counts_reserve(state->file);
+  fputs(">\n", state->file);
+  state->tests = 0;
+  state->failures = 0;
+  state->skipped = 0;
+}
+
+static void junit_suite_end(void* data, const ReportEvent* event) {
+  FormatState* state = data;
+  fputs("  </testsuite>\n", state->file);
+  junit_counts_write(state->file, state->suite_counts,
+    state->tests, state->failures, state->skipped, event->duration_ns
+  );
+  state->total_tests += state->tests;
+  state->total_failures += state->failures;
+  state->total_skipped += state->skipped;
+}
+
+static void junit_test_end(void* data, const ReportEvent* event) {
+  FormatState* state = data;
+  FILE* file = state->file;
+  ++state->tests;
+
+  fputs("    <testcase classname=\"", file);
+  format_xml(file, event->file, TRUE);
+  fputc('.', file);
+  format_xml(file, event->group, TRUE);
+  fputs("\" name=\"", file);
+  format_path(file, event, TRUE);
+  fprintf(file, "\" time=\"%.6f\" file=\"", (double)event->duration_ns / 1e9);
+  format_xml(file, event->file, TRUE);
+  fprintf(file, "\" line=\"%d\"", event->line);
+
+  if (event->outcome == report_skipped) {
+    ++state->skipped;
+    fputs(">\n      <skipped/>\n    </testcase>\n", file);
+
+  } else if (event->outcome == report_failed) {
+    const char* text = state->failure_size ? state->failure_text : "failed";
+    ++state->failures;
+    fputs(">\n      <failure message=\"", file);
+    format_xml(file, text, TRUE);
+    fputs("\" type=\"failure\">", file);
+    format_xml(file, text, FALSE);
+    fputs("</failure>\n    </testcase>\n", file);
+
+  } else {
+    fputs("/>\n", file);
+  }
+}
+
+static void junit_summary(void* data, const ReportEvent* event) {
+  FormatState* state = data;
+  fputs("</testsuites>\n", state->file);
+  junit_counts_write(state->file, state->run_counts, state->total_tests,
+    state->total_failures, state->total_skipped, event->duration_ns
+  );
+  fclose(state->file);
+  state->file = NULL;
+}
+
+static void tap_test_end(void* data, const ReportEvent* event) {
+  FormatState* state = data;
+  FILE* file = state->file;
+  csBool failed = event->outcome == report_failed;
+
+  fprintf(file, "%s %d - ", failed ? "not ok" : "ok", ++state->total_tests);
+  format_tap_str(file, event->group, FALSE);
+  fputs(": ", file);
+  format_path(file, event, FALSE);
+  if (event->outcome == report_skipped) fputs(" # SKIP", file);
+  fputc('\n', file);
+
+  if (!failed) return;
+
+  const char* text = state->failure_size ? state->failure_text : "failed";
+  fputs("  ---\n  message: \"", file);
+  format_tap_str(file, text, TRUE);
+  fputs("\"\n  at: \"", file);
+  format_tap_str(file, event->file, TRUE);
+  fprintf(file, ":%d\"\n  duration_ms: %.3f\n  ...\n",
+    state->failure_line ? state->failure_line : event->line,
+    (double)event->duration_ns / 1e6
+  );
+}
+
+static void tap_warning(void* data, const ReportEvent* event) {
+  FormatState* state = data;
+  fprintf(state->file, "# warning: line %d: ", event->line);
+  format_tap_str(state->file, event->message, FALSE);
+  fputc('\n', state->file);
+}
+
+static void tap_summary(void* data, const ReportEvent* event) {
+  FormatState* state = data;
+  (void)event;
+  fprintf(state->file, "1..%d\n", state->total_tests);
+  if (state->file == stdout) {
+    fflush(state->file);
+  } else {
+    fclose(state->file);
+  }
+  state->file = NULL;
+}
+
+static const Reporter format_junit_reporter = {
+  .suite_begin = junit_suite_begin,
+  .suite_end = junit_suite_end,
+  .test_begin = format_test_begin,
+  .test_end = junit_test_end,
+  .failure = format_failure,
+  .summary = junit_summary,
+  .data = &format_junit,
+};
+
+static const Reporter format_tap_reporter = {
+  .test_begin = format_test_begin,
+  .test_end = tap_test_end,
+  .failure = format_failure,
+  .warning = tap_warning,
+  .summary = tap_summary,
+  .data = &format_tap,
+};
+
+/*
+* NDJSON events are written as they happen, one object per line. Each event is
+* put together in a buffer and written out whole, in a single write where the
+* system has one, so a reader never sees part of an event. The buffer is
+* static, and only moves to the heap for an event that doesn't fit in it.
+*/
+
+#if defined(__unix__) || defined(__APPLE__)
+# include <errno.h>
+# include <unistd.h>
+extern FILE* fdopen(int fd, const char* mode);
+extern int fileno(FILE* file);
+#endif
+
+static FILE* format_events = NULL;
+static char format_events_static[BUFSIZ];
+static char* format_events_buffer = format_events_static;
+static size_t format_events_capacity = sizeof(format_events_static);
+static size_t format_events_size = 0;
+
+static void ndjson_put(const char* s, size_t size) {
+  size_t needed = format_events_size + size;
+
+  if (needed > format_events_capacity) {
+    size_t capacity = format_events_capacity * 2;
+    while (capacity < needed) capacity *= 2;
+
+    char* buffer = malloc(capacity);
+    if (!buffer) return;
+    cspec_memcpy(buffer, format_events_buffer, format_events_size);
+    if (format_events_buffer != format_events_static) {
+      free(format_events_buffer);
+    }
+    format_events_buffer = buffer;
+    format_events_capacity = capacity;
+  }
+
+  cspec_memcpy(format_events_buffer + format_events_size, s, size);
+  format_events_size = needed;
+}
+
+static void ndjson_puts(const char* s) {
+  ndjson_put(s, cspec_strlen(s));
+}
+
+static void ndjson_printf(const char* format, ...) {
+  char text[256];
+  va_list args;
+  va_start(args, format);
+  int size = vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  if (size > 0) {
+    ndjson_put(text, (size_t)size < sizeof(text) ? (size_t)size : sizeof(text) - 1);
+  }
+}
+
+/* Writes out the event, after anything the program printed before it */
+static void ndjson_write(void) {
+  const char* at = format_events_buffer;
+  size_t left = format_events_size;
+  format_events_size = 0;
+  fflush(format_events);
+
+#if defined(__unix__) || defined(__APPLE__)
+  int fd = fileno(format_events);
+  while (left) {
+    ssize_t written = write(fd, at, left);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) break;
+    at += written;
+    left -= (size_t)written;
+  }
+#else
+  fwrite(at, 1, left, format_events);
+  fflush(format_events);
+#endif
+}
+
+static void ndjson_str(const char* s) {
+  if (!s) {
+    ndjson_puts("null");
+    return;
+  }
+  ndjson_put("\"", 1);
+  while (*s) {
+    /* plain characters go in as one run */
+    const char* run = s;
+    while (*s && *s != '"' && *s != '\\' && (unsigned char)*s >= 0x20) ++s;
+    if (s != run) ndjson_put(run, (size_t)(s - run));
+    if (!*s) break;
+
+    switch (*s) {
+      case '"': ndjson_puts("\\\""); break;
+      case '\\': ndjson_puts("\\\\"); break;
+      case '\n': ndjson_puts("\\n"); break;
+      case '\t': ndjson_puts("\\t"); break;
+      default: ndjson_printf("\\u%04x", (unsigned)(unsigned char)*s);
+    }
+    ++s;
+  }
+  ndjson_put("\"", 1);
+}
+
+static void ndjson_bool(const char* key, csBool value) {
+  ndjson_printf(",\"%s\":%s", key, value ? "true" : "false");
+}
+
+/* Starts the object with the event name, time into the run, and location */
+static void ndjson_begin(const char* name, const ReportEvent* event) {
+  ndjson_printf("{\"event\":\"%s\",\"elapsed_ns\":%llu,\"file\":", name,
+    (unsigned long long)(report_clock_ns() - report_run_start)
+  );
+  ndjson_str(event->file);
+  ndjson_puts(",\"group\":");
+  ndjson_str(event->group);
+  ndjson_puts(",\"path\":[");
+  for (int i = 0; i < event->depth; ++i) {
+    if (i) ndjson_put(",", 1);
+    ndjson_str(event->path[i]);
+  }
+  ndjson_printf("],\"line\":%d", event->line);
+}
+
+static void ndjson_end(const ReportEvent* event, csBool timed) {
+  if (timed) {
+    ndjson_printf(",\"duration_ns\":%llu",
+      (unsigned long long)event->duration_ns
+    );
+  }
+  ndjson_puts("}\n");
+  ndjson_write();
+}
+static void ndjson_plain(const char* name, const ReportEvent* event) {
+  ndjson_begin(name, event);
+  ndjson_end(event, FALSE);
+}
+
+static void ndjson_timed(const char* name, const ReportEvent* event) {
+  ndjson_begin(name, event);
+  ndjson_end(event, TRUE);
+}
+
+static void ndjson_suite_begin(void* data, const ReportEvent* event) {
+  (void)data; ndjson_plain("suite_begin", event);
+}
+
+static void ndjson_suite_end(void* data, const ReportEvent* event) {
+  (void)data; ndjson_timed("suite_end", event);
+}
+
+static void ndjson_group_begin(void* data, const ReportEvent* event) {
+  (void)data; ndjson_plain("group_begin", event);
+}
+
+static void ndjson_group_end(void* data, const ReportEvent* event) {
+  (void)data; ndjson_timed("group_end", event);
+}
+
+static void ndjson_context_begin(void* data, const ReportEvent* event) {
+  (void)data; ndjson_plain("context_begin", event);
+}
+
+static void ndjson_context_end(void* data, const ReportEvent* event) {
+  (void)data; ndjson_plain("context_end", event);
+}
+
+static void ndjson_test_begin(void* data, const ReportEvent* event) {
+  (void)data; ndjson_plain("test_begin", event);
+}
+
+static void ndjson_test_end(void* data, const ReportEvent* event) {
+  static const char* outcomes[] = { "passed", "failed", "skipped" };
+  (void)data;
+  ndjson_begin("test_end", event);
+  ndjson_printf(",\"outcome\":\"%s\"", outcomes[event->outcome]);
+  ndjson_bool("expected_fail", event->expected_fail);
+  ndjson_end(event, TRUE);
+}
+
+static void ndjson_failure(void* data, const ReportEvent* event) {
+  (void)data;
+  ndjson_begin("failure", event);
+  ndjson_puts(",\"message\":");
+  ndjson_str(event->message);
+  ndjson_puts(",\"expectation\":");
+  ndjson_str(event->expectation);
+  ndjson_puts(",\"values\":[");
+  for (int i = 0; i < event->value_count; ++i) {
+    ndjson_puts(i ? ",{\"type\":" : "{\"type\":");
+    ndjson_str(event->types[i]);
+    ndjson_puts(",\"value\":");
+    ndjson_str(event->values[i]);
+    ndjson_put("}", 1);
+  }
+  ndjson_put("]", 1);
+  ndjson_bool("memory_error", event->memory_error);
+  if (event->block) {
+    ndjson_printf(",\"block\":{\"address\":\"%p\",\"size\":%llu",
+      event->block, (unsigned long long)event->block_size
+    );
+    ndjson_printf(",\"freed\":%s}", event->block_freed ? "true" : "false");
+  }
+  ndjson_end(event, FALSE);
+}
+
+static void ndjson_warning(void* data, const ReportEvent* event) {
+  (void)data;
+  ndjson_begin("warning", event);
+  ndjson_puts(",\"message\":");
+  ndjson_str(event->message);
+  ndjson_end(event, FALSE);
+}
+
+static void ndjson_summary(void* data, const ReportEvent* event) {
+  (void)data;
+  ndjson_begin("summary", event);
+  ndjson_printf(",\"tests\":%d,\"passed\":%d,\"warnings\":%d",
+    event->tests, event->passed, event->warnings
+  );
+  ndjson_end(event, TRUE);
+}
+
+static const Reporter format_ndjson_reporter = {
+  .suite_begin = ndjson_suite_begin,
+  .suite_end = ndjson_suite_end,
+  .group_begin = ndjson_group_begin,
+  .group_end = ndjson_group_end,
+  .context_begin = ndjson_context_begin,
+  .context_end = ndjson_context_end,
+  .test_begin = ndjson_test_begin,
+  .test_end = ndjson_test_end,
+  .failure = ndjson_failure,
+  .warning = ndjson_warning,
+  .summary = ndjson_summary,
+};
+
+/* Returns the rest of s if it starts with prefix, otherwise NULL */
+static const char* format_prefix(const char* s, const char* prefix) {
+  while (*prefix) {
+    if (*s++ != *prefix++) return NULL;
+  }
+  return s;
+}
+
+static csBool format_open(FormatState* state, const char* path) {
+  if (state->file || !path || !*path) return FALSE;
+  *state = (FormatState) { .file = fopen(path, "w") };
+  return state->file != NULL;
+}
+
+/* Handles "--reporter junit:file", "--reporter tap" or "--reporter tap:file" */
+static csBool format_add(const char* spec) {
+  const char* path;
+
+  if (cspec_strcmp(spec, "tap")) {
+    if (format_tap.file) return FALSE;
+    format_tap = (FormatState) { .file = stdout };
+    format_took_console |= cspec_remove_reporter(&cspec_console_reporter);
+    fputs("TAP version 13\n", format_tap.file);
+    return cspec_add_reporter(&format_tap_reporter);
+  }
+
+  if ((path = format_prefix(spec, "tap:"))) {
+    if (!format_open(&format_tap, path)) return FALSE;
+    fputs("TAP version 13\n", format_tap.file);
+    return cspec_add_reporter(&format_tap_reporter);
+  }
+
+  if ((path = format_prefix(spec, "junit:"))) {
+    if (!format_open(&format_junit, path)) return FALSE;
+    fputs("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n", format_junit.file);
+    fputs("<testsuites name=\"cspec\"", format_junit.file);
+    format_junit.run_counts = junit_counts_reserve(format_junit.file);
+    fputs(">\n", format_junit.file);
+    return cspec_add_reporter(&format_junit_reporter);
+  }
+
+  return FALSE;
+}
+
+/* Handles "--events ndjson", "--events ndjson:file" or "--events ndjson:fd:N" */
+static csBool format_add_events(const char* spec) {
+  const char* path;
+  if (format_events) return FALSE;
+
+  if (cspec_strcmp(spec, "ndjson")) {
+    format_events = stdout;
+    format_took_console |= cspec_remove_reporter(&cspec_console_reporter);
+
+#if defined(__unix__) || defined(__APPLE__)
+  } else if ((path = format_prefix(spec, "ndjson:fd:"))) {
+    if (!cspec_isdigit(*path)) return FALSE;
+    format_events = fdopen(cspec_atoi(path), "w");
+#endif
+
+  } else if ((path = format_prefix(spec, "ndjson:")) && *path) {
+    format_events = fopen(path, "w");
+  }
+
+  if (!format_events) return FALSE;
+  return cspec_add_reporter(&format_ndjson_reporter);
+}
+
+/* Removes the reporters added by arguments, without touching their files */
+static void format_detach(void) {
+  format_junit.file = NULL;
+  format_tap.file = NULL;
+  format_events = NULL;
+  cspec_remove_reporter(&format_junit_reporter);
+  cspec_remove_reporter(&format_tap_reporter);
+  cspec_remove_reporter(&format_ndjson_reporter);
+  if (format_took_console) {
+    cspec_add_reporter(&cspec_console_reporter);
+    format_took_console = FALSE;
+  }
+}
+
+/* Removes the reporters added by arguments, once the run is over */
+static void format_remove_all(void) {
+  FormatState* states[] = { &format_junit, &format_tap };
+  for (int i = 0; i < (int)ARRAY_COUNT(states); ++i) {
+    if (states[i]->file && states[i]->file != stdout) fclose(states[i]->file);
+  }
+  if (format_events && format_events != stdout) fclose(format_events);
+  format_detach();
+}
+
+#else
+
+static csBool format_add(const char* spec) { (void)spec; return FALSE; }
+static csBool format_add_events(const char* spec) { (void)spec; return FALSE; }
+static void format_detach(void) { }
+static void format_remove_all(void) { }
+
+#endif
+
+/*----------------------------------------------------------------------------*\
+  Tracing
+\*----------------------------------------------------------------------------*\
+* With --trace, the run is written out as trace event JSON that can be loaded
+* in Perfetto or chrome://tracing. Spans cover each suite, group, and pass
+* through a group function, split into the context setup before the test and
+* the test itself, plus the memory checks after it and the console output
+* being flushed. Events are streamed as begin/end pairs, so they nest as the
+* calls do. Each worker running tests gets its own track (trace_track).
+*/
 
-/* Called whenever the test enters a "context()" block */
-csBool _cspec_context_begin(int line, const char* desc) {
+#ifndef __WASM__
 
-  /*
-  * If we are currently executing a test, skip the context (allow previous
-  * contexts to close out their post-test statements)
-  */
-  if (test_in_progress) {
-    return FALSE;
+static FILE* trace_file = NULL;
+static csSize trace_start = 0;
+static int trace_track = 1;
+static csBool trace_first = TRUE;
+
+static void trace_event(char phase, const char* name, const char* category) {
+  FILE* file = trace_file;
+  csSize ns = report_clock_ns() - trace_start;
+
+  fputs(trace_first ? "\n" : ",\n", file);
+  trace_first = FALSE;
+  fprintf(file, "{\"ph\":\"%c\",\"pid\":1,\"tid\":%d,\"ts\":%llu.%03u",
+    phase, trace_track, (unsigned long long)(ns / 1000), (unsigned)(ns % 1000)
+  );
+  if (name) {
+    fputs(",\"name\":\"", file);
+    for (const char* s = name; *s; ++s) {
+      if (*s == '"' || *s == '\\') fputc('\\', file);
+      fputc((unsigned char)*s < 0x20 ? ' ' : *s, file);
+    }
+    fprintf(file, "\",\"cat\":\"%s\"", category);
   }
+  fputc('}', file);
+}
 
-  /*
-  * On each pass of the test function, we have to walk up the stack. If our
-  * context is already there, don't create a duplicate of it.
-  */
-  if (ctx_stack_index < ctx_stack_top
-  && ctx_stack[ctx_stack_index + 1].desc == desc
-  ) {
-    ++ctx_stack_index;
-    return TRUE;
+static void trace_begin(const char* name, const char* category) {
+  if (trace_file) trace_event('B', name, category);
+}
+
+static void trace_end(void) {
+  if (trace_file) trace_event('E', NULL, NULL);
+}
+
+static csBool trace_open(const char* path) {
+  if (trace_file) return FALSE;
+  trace_file = fopen(path, "w");
+  if (!trace_file) return FALSE;
+
+  trace_start = report_clock_ns();
+  trace_first = TRUE;
+  fputc('[', trace_file);
+  trace_first = FALSE;
+  fprintf(trace_file, "\n{\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+    "\"name\":\"thread_name\",\"args\":{\"name\":\"tests\"}}", trace_track
+  );
+  return TRUE;
+}
+
+static void trace_close(void) {
+  if (!trace_file) return;
+  fputs("\n]\n", trace_file);
+  fclose(trace_file);
+  trace_file = NULL;
+}
+
+static void trace_detach(void) {
+  trace_file = NULL;
+}
+
+#else
+
+static void trace_begin(const char* name, const char* category) {
+  (void)name; (void)category;
+}
+static void trace_end(void) { }
+static csBool trace_open(const char* path) { (void)path; return FALSE; }
+static void trace_close(void) { }
+static void trace_detach(void) { }
+
+#endif
+
+/*----------------------------------------------------------------------------*\
+  Progress
+\*----------------------------------------------------------------------------*\
+* When stdout is a terminal, a status line under the output shows how far the
+* run has gotten: test groups done out of the total, tests run and failed, the
+* time so far with an estimate of what's left, and the test that's running.
+* Tests are only found by running their group, so the total and the estimate
+* go by groups. The line is redrawn as tests begin and end, at most
+* progress_rate times a second, so a slow test shows up while it runs. It's
+* cleared before anything else is written so it stays at the bottom, and only
+* comes back once it's due to be redrawn, so tests printing a lot don't spend
+* their time redrawing it. Nothing redraws it during a test, so the time on it
+* stands still while one long test runs. It's
+* left off when stdout is a pipe, or with --no-progress.
+*/
+
+#if !defined(__WASM__) && (defined(__unix__) || defined(__APPLE__))
+
+extern int isatty(int fd);
+
+#define progress_rate 10
+#define progress_width 79
+
+static csBool progress_shown = FALSE;
+static int progress_groups = 0;
+static int progress_groups_done = 0;
+static int progress_tests = 0;
+static int progress_failed = 0;
+static csSize progress_start = 0;
+static csSize progress_drawn_at = 0;
+static char progress_current[progress_width + 1];
+
+static void progress_clear(void) {
+  if (!progress_shown) return;
+  fputs("\r\033[K", stdout);
+  progress_shown = FALSE;
+}
+
+static void progress_draw(csSize now) {
+  unsigned elapsed = (unsigned)((now - progress_start) / 1000000000);
+  char left[32] = "";
+  if (progress_groups_done) {
+    unsigned remaining = elapsed
+      * (unsigned)(progress_groups - progress_groups_done)
+      / (unsigned)progress_groups_done;
+    snprintf(left, sizeof(left), ", ~%u:%02u left",
+      remaining / 60, remaining % 60
+    );
   }
 
-  /*
-  * If we're completing execution of the context, we expect it to be at the
-  * top of the stack
-  */
-  if (ctx_stack[ctx_stack_index].desc == desc) {
-    return TRUE;
+  /* room for every field, then cut down to the terminal's usual width */
+  char line[progress_width + 128];
+  snprintf(line, sizeof(line), "[%d/%d] %d tests, %d failed, %u:%02u%s: %s",
+    progress_groups_done, progress_groups, progress_tests, progress_failed,
+    elapsed / 60, elapsed % 60, left, progress_current
+  );
+  line[progress_width] = '\0';
+  fputs("\r", stdout);
+  fputs(line, stdout);
+  fputs("\033[K", stdout);
+  fflush(stdout);
+  progress_shown = TRUE;
+  progress_drawn_at = now;
+}
+
+static void progress_update(void) {
+  csSize now = report_clock_ns();
+  if (now - progress_drawn_at >= 1000000000 / progress_rate) {
+    progress_draw(now);
   }
+}
 
-  /*
-  * If we're not on the stack anymore, and the current test line is past our
-  * context, we've completed the tests in it and can skip it.
-  */
-  if (test_current_line > line) {
-    return FALSE;
+static void progress_test_begin(void* data, const ReportEvent* event) {
+  (void)data;
+  const char* name = event->depth ? event->path[event->depth - 1] : "";
+  csUint i = 0;
+  for (; name[i] && i < progress_width; ++i) {
+    progress_current[i] = name[i] < ' ' ? ' ' : name[i];
   }
+  progress_current[i] = '\0';
+  progress_update();
+}
 
-  /*
-  * Any other context on the stack should still be open (and thus already
-  * passed by the stack ptr), or have already closed out and be gone.
-  */
-  assert(ctx_stack_index == ctx_stack_top);
+static void progress_test_end(void* data, const ReportEvent* event) {
+  (void)data;
+  if (event->outcome == report_skipped) return;
+  ++progress_tests;
+  if (event->outcome == report_failed) ++progress_failed;
+  progress_update();
+}
 
-  /*
-  * If this context's line was specified in the input params, run all the
-  * tests in this context, and end the tests as soon as it's popped.
-  */
-  csBool is_requested = FALSE;
-  if (line == param_line) {
-    is_requested = TRUE;
-    param_line = 0;
+static void progress_group_end(void* data, const ReportEvent* event) {
+  (void)data; (void)event;
+  ++progress_groups_done;
+}
+
+static void progress_summary(void* data, const ReportEvent* event) {
+  (void)data; (void)event;
+  progress_clear();
+}
+
+static const Reporter progress_reporter = {
+  .test_begin = progress_test_begin,
+  .test_end = progress_test_end,
+  .group_end = progress_group_end,
+  .summary = progress_summary,
+};
+
+/* Only shown on a terminal, and not when stdout has other output in its place */
+static void progress_begin(int count, TestSuite* suites[], csBool enabled) {
+  if (!enabled || output_muted || !isatty(1)) return;
+
+  progress_groups = 0;
+  int group = 0;
+  for (int i = 0; i < count; ++i) {
+    if (!cspec_strrstr(suites[i]->filename, param_file)) continue;
+    for (const TestGroup* t = *suites[i]->test_groups; t->line; ++t) {
+      if (!param_shard_count
+      ||  group++ % param_shard_count == param_shard_index
+      ) {
+        ++progress_groups;
+      }
+    }
   }
 
-  /*
-  * When this is added to the stack, we can set it as the current line.
-  * (not strictly necessary, but good for bookkeeping?)
-  */
-  test_current_line = line;
+  progress_groups_done = 0;
+  progress_tests = 0;
+  progress_failed = 0;
+  progress_current[0] = '\0';
+  progress_start = report_clock_ns();
+  progress_drawn_at = 0;
+  cspec_add_reporter(&progress_reporter);
+}
 
-  /* Make sure we won't overflow the stack if we add another context */
-  if (ctx_stack_top + 1 >= cspec_ctx_stack_size_max) {
-    _cspec_warn_fn(line,
-      "context error:%c Too many nested contexts - maximum depth allowed: "
-      STR(cspec_ctx_stack_size_max)
-    );
-    _cspec_warn_fn(line,
-      "%cStack limit can be increased by defining cspec_ctx_stack_size_max"
-    );
-    return FALSE;
+static void progress_end(void) {
+  progress_clear();
+  cspec_remove_reporter(&progress_reporter);
+}
+
+/* Drops the outer run's line without clearing it, as it's not on this output */
+static void progress_detach(void) {
+  progress_shown = FALSE;
+  progress_end();
+}
+
+#else
+
+static void progress_clear(void) { }
+static void progress_begin(int count, TestSuite* suites[], csBool enabled) {
+  (void)count; (void)suites; (void)enabled;
+}
+static void progress_end(void) { }
+static void progress_detach(void) { }
+
+#endif
+
+/*----------------------------------------------------------------------------*\
+  Crashes
+\*----------------------------------------------------------------------------*\
+* Lines waiting in the output buffer would be lost when a test crashes, which
+* is when they matter most. For the length of a run, the signals a crash raises
+* are caught just long enough to write them out, then raised again to end the
+* process as they would have. The handler has a stack of its own, so a test
+* that overflows its stack is covered too.
+*/
+
+#if !defined(__WASM__) && (defined(__unix__) || defined(__APPLE__))
+
+#include <signal.h>
+
+#define crash_stack_size 65536
+
+static const int crash_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+#define crash_signal_count (sizeof(crash_signals) / sizeof(*crash_signals))
+
+static struct sigaction crash_previous[crash_signal_count];
+static stack_t crash_previous_stack;
+static char crash_stack[crash_stack_size];
+static csBool crash_caught = FALSE;
+
+static void crash_handler(int sig) {
+  /* a thread started by the test has its own buffer, and nothing to write */
+  if (output_buffer == output_main || output_buffer == output_heap) {
+    progress_clear();
+    fwrite(output_buffer, 1, output_line, stdout);
   }
+  fflush(stdout);
 
-  /* If we get here, we are entering a context for the first time. */
-  ctx_stack_index = ++ctx_stack_top;
-  ctx_stack[ctx_stack_index] = (Context) {
-    .desc = desc,
-    .printed = FALSE,
-    .requested_context = is_requested
+  /* the handler was reset, so this ends the process once it returns */
+  raise(sig);
+}
+
+static void crash_begin(void) {
+  stack_t stack = { .ss_sp = crash_stack, .ss_size = crash_stack_size };
+  struct sigaction action = {
+    .sa_handler = crash_handler,
+    .sa_flags = SA_ONSTACK | SA_RESETHAND,
   };
+  sigemptyset(&action.sa_mask);
+  sigaltstack(&stack, &crash_previous_stack);
+  for (csUint i = 0; i < crash_signal_count; ++i) {
+    sigaction(crash_signals[i], &action, &crash_previous[i]);
+  }
+  crash_caught = TRUE;
+}
 
-  return TRUE;
+static void crash_end(void) {
+  if (!crash_caught) return;
+  for (csUint i = 0; i < crash_signal_count; ++i) {
+    sigaction(crash_signals[i], &crash_previous[i], NULL);
+  }
+  sigaltstack(&crash_previous_stack, NULL);
+  crash_caught = FALSE;
 }
 
-/* Called at the end of a context block in "context_end" */
-csBool _cspec_context_end(int line) {
+#else
 
-  /*
-  * If we're at the end of a context, we want to pop it off the stack if we
-  * didn't actually run any tests in this pass. Otherwise, return false to
-  * keep executing within this context.
-  */
-  if (test_in_progress) {
-    return FALSE;
+static void crash_begin(void) { }
+static void crash_end(void) { }
+
+#endif
+
+/*----------------------------------------------------------------------------*\
+  Threads
+\*----------------------------------------------------------------------------*\
+* Tests of concurrent code can expect, log and warn from the threads they
+* start. Those threads don't touch the console or the test's state: each one
+* gets a spool with its own output buffer (the output state above is thread
+* local), formats the message into it, and publishes the finished record by
+* bumping a count. The thread running the test takes the records whenever it
+* reports something itself and when the test ends, in the order they were
+* made across all threads, and reports them as its own, so they land under
+* the test's headers and fail it like any other expectation.
+*
+* Nothing here takes a lock: a spool has one writer, records are ordered by a
+* shared atomic counter, and a new spool is pushed onto the list with a CAS.
+* When a spool fills up, further logs are dropped and further failures are
+* only counted. Threads should be joined before their test ends; a record one
+* is still writing when the test ends is thrown away, and its spool is only
+* reused once the write is done. At the end of the run, spools are only freed
+* if no thread is writing to one. Diffs aren't made for values from other
+* threads.
+*/
+
+static csBool resolve_param(const char* typ_N, TypeId id, const void* N);
+static void log_print(
+  int line, const char* message, const char* const* values, int count
+);
+static void warn_print(int line, const char* message);
+
+#ifdef _CSPEC_USE_THREADS_
+
+#define thread_records_max 32
+#define thread_text_size 1024
+
+typedef enum ThreadRecordKind {
+  thread_log,
+  thread_log_typed,
+  thread_warning,
+  thread_failure,
+  thread_failure_typed
+} ThreadRecordKind;
+
+typedef struct ThreadRecord {
+  csUint seq;
+  ThreadRecordKind kind;
+  int line;
+  const char* pre;  /* from the expect macros, so they're always literals */
+  const char* fmt;
+  const char* types[report_values_max];
+  int value_count;
+  char text[thread_text_size]; /* the message, or each value ending in \0 */
+} ThreadRecord;
+
+typedef struct ThreadSpool {
+  struct ThreadSpool* next;
+  char in_use;
+  char writing;     /* set while the owner fills in a record */
+  csUint generation;
+  csUint count;     /* published by the thread that owns the spool */
+  csUint read;      /* only used by the thread running the test */
+  csUint dropped;   /* failures that didn't fit */
+  ThreadRecord records[thread_records_max];
+  char output[output_size + 2];
+} ThreadSpool;
+
+static ThreadSpool* thread_spools = NULL;
+static csUint thread_sequence = 0;
+static csUint thread_generation = 0;
+static csUint thread_writers = 0; /* threads between thread_record and done */
+static csBool thread_draining = FALSE;
+static cspec_thread_local csBool thread_runs_tests = FALSE;
+static cspec_thread_local ThreadSpool* thread_spool_own = NULL;
+static cspec_thread_local csUint thread_spool_generation = 0;
+
+/* Finds this thread's spool for the current test, claiming one if needed */
+static ThreadSpool* thread_spool(void) {
+  csUint generation = __atomic_load_n(&thread_generation, __ATOMIC_SEQ_CST);
+  ThreadSpool* spool = thread_spool_own;
+  if (spool && thread_spool_generation == generation) return spool;
+
+  spool = __atomic_load_n(&thread_spools, __ATOMIC_ACQUIRE);
+  for (; spool; spool = spool->next) {
+    if (!__atomic_test_and_set(&spool->in_use, __ATOMIC_ACQUIRE)) break;
   }
 
-  /*
-  * Sanity check - this generally shouldn't be possible to hit?
-  */
-  /*
-  assert(test_current_line < line);
-  if (test_current_line >= line) {
-    return FALSE;
+  if (!spool) {
+    spool = malloc(sizeof(ThreadSpool));
+    if (!spool) return NULL;
+    cspec_memset(spool, 0, sizeof(ThreadSpool));
+    spool->in_use = 1;
+    spool->next = __atomic_load_n(&thread_spools, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&thread_spools, &spool->next, spool,
+      TRUE, __ATOMIC_RELEASE, __ATOMIC_RELAXED
+    )) { }
   }
-  */
 
-  /*
-  * Update to the next line, because the context begin and end statements
-  * should actually be on the same line.
-  *
-  * This will usually make the line value go down (unless the context is
-  * empty), which is ok because as long as it's above the context line
-  * the entire block will be skipped.
-  */
-  test_current_line = line + 1;
+  spool->generation = generation;
+  thread_spool_own = spool;
+  thread_spool_generation = generation;
+  output_buffer = spool->output;
+  output_index = 0;
+  output_line = 0;
+  output_indent = 0;
+  output_fmt = NULL;
+  return spool;
+}
+
+/* Gets the next free record, or NULL if this thread's spool is full */
+static ThreadRecord* thread_record(ThreadRecordKind kind, int line) {
+  /* counted before the spool is looked up, see thread_free_all */
+  __atomic_fetch_add(&thread_writers, 1, __ATOMIC_SEQ_CST);
+  ThreadSpool* spool = thread_spool();
+  if (!spool) {
+    __atomic_fetch_sub(&thread_writers, 1, __ATOMIC_RELEASE);
+    return NULL;
+  }
 
   /*
-  * Once we pop a specifically requested context, end the tests.
-  * If we're in verbose mode, we want to still go thorugh them all to print
-  * the descriptions of un-run tests.
+  * Either thread_release sees the flag and leaves the spool for later, or
+  * this sees the test has ended, and drops the record
   */
-  if (ctx_stack[ctx_stack_top].requested_context) {
-    param_line = -1;
+  __atomic_store_n(&spool->writing, 1, __ATOMIC_SEQ_CST);
+  csUint generation = __atomic_load_n(&thread_generation, __ATOMIC_SEQ_CST);
+  csUint count = __atomic_load_n(&spool->count, __ATOMIC_RELAXED);
+  if (generation != thread_spool_generation || count >= thread_records_max) {
+    if (generation == thread_spool_generation && kind >= thread_failure) {
+      __atomic_fetch_add(&spool->dropped, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&spool->writing, 0, __ATOMIC_RELEASE);
+    __atomic_fetch_sub(&thread_writers, 1, __ATOMIC_RELEASE);
+    return NULL;
   }
 
-  /* Make sure we're not trying to pop the stack root */
-  assert(ctx_stack_top != 0);
+  ThreadRecord* record = &spool->records[count];
+  record->seq = __atomic_fetch_add(&thread_sequence, 1, __ATOMIC_RELAXED);
+  record->kind = kind;
+  record->line = line;
+  record->pre = NULL;
+  record->fmt = NULL;
+  record->value_count = 0;
+  record->text[0] = '\0';
+  return record;
+}
 
-  /* Pop the context from the stack */
-  ctx_stack_index = --ctx_stack_top;
+static void thread_publish(void) {
+  ThreadSpool* spool = thread_spool_own;
+  __atomic_fetch_add(&spool->count, 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&spool->writing, 0, __ATOMIC_RELEASE);
+  __atomic_fetch_sub(&thread_writers, 1, __ATOMIC_RELEASE);
+}
+
+/* Copies text into the record after what's there, returning where it went */
+static csUint thread_text(ThreadRecord* record, csUint at, const char* s) {
+  while (s && *s && at + 1 < thread_text_size) {
+    record->text[at++] = *s++;
+  }
+  record->text[at] = '\0';
+  return at + 1 < thread_text_size ? at + 1 : at;
+}
+
+/* Returns FALSE on the thread running the test, which reports it as usual */
+static csBool thread_message(ThreadRecordKind kind, int line, const char* s) {
+  if (thread_runs_tests) return FALSE;
+  ThreadRecord* record = thread_record(kind, line);
+  if (record) {
+    thread_text(record, 0, s);
+    thread_publish();
+  }
+  return TRUE;
+}
 
+static csBool thread_values(ThreadRecordKind kind, int line, const char* pre,
+  const char* fmt,
+  const char* const* types, const TypeId* ids, const void* const* args
+) {
+  if (thread_runs_tests) return FALSE;
+  ThreadRecord* record = thread_record(kind, line);
+  if (!record) return TRUE;
+  record->pre = pre;
+  record->fmt = fmt;
+
+  csUint at = 0;
+  for (int i = 0; fmt && i < report_values_max; ++i) {
+    if (!types[i]) continue;
+    csUint mark = output_index;
+    resolve_param(types[i], ids[i], args[i]);
+    output_buffer[output_index] = '\0';
+    at = thread_text(record, at, output_buffer + mark);
+    output_index = mark;
+    record->types[record->value_count++] = types[i];
+  }
+
+  thread_publish();
   return TRUE;
 }
 
-/* Called between each test group, after all passes on a function are completed */
-static void context_clear_stack(void) {
-  ctx_stack_top = 0;
-  ctx_stack_index = 0;
-}
+static const char* thread_text_raw(const char* s) {
+  const char* start = report_text + report_text_index;
+  while (*s) report_text_char(*s++);
+  return report_text_finish(start);
+}
+
+static void thread_replay(const ThreadRecord* record) {
+  const char* values[report_values_max];
+  const char* value = record->text;
+  for (int i = 0; i < record->value_count; ++i) {
+    values[i] = value;
+    value += cspec_strlen(value) + 1;
+  }
+
+  switch (record->kind) {
+    case thread_log: log_print(record->line, record->text, NULL, 0); return;
+    case thread_log_typed:
+      log_print(record->line, record->fmt, values, record->value_count);
+      return;
+    case thread_warning: warn_print(record->line, record->text); return;
+    case thread_failure: _cspec_error_fn(record->text); return;
+    case thread_failure_typed: break;
+  }
+
+  test_failed = TRUE;
+  if (test_expect_fail) return;
+
+  ReportEvent event = report_event(record->line);
+  for (int i = 0; i < record->value_count; ++i) {
+    report_types[i] = record->types[i];
+    report_values[i] = thread_text_raw(values[i]);
+  }
+
+  event.expectation = record->pre ? record->pre : "";
+  event.format = record->fmt;
+  event.values = report_values;
+  event.types = report_types;
+  event.value_count = record->value_count;
+  event.message = report_compose(record->pre, record->fmt,
+    report_values, record->value_count
+  );
+  report(failure, &event);
+}
+
+/* Reports what other threads have published so far, oldest first */
+static void thread_drain(void) {
+  if (thread_draining || !__atomic_load_n(&thread_spools, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+  thread_draining = TRUE;
+
+  for (;;) {
+    ThreadSpool* next = NULL;
+    for (ThreadSpool* s = thread_spools; s; s = s->next) {
+      csUint count = __atomic_load_n(&s->count, __ATOMIC_ACQUIRE);
+      if (s->read >= count || s->generation != thread_generation) continue;
+      if (!next
+      ||  (int)(s->records[s->read].seq - next->records[next->read].seq) < 0
+      ) {
+        next = s;
+      }
+    }
+    if (!next) break;
+    thread_replay(&next->records[next->read++]);
+  }
+
+  csUint dropped = 0;
+  for (ThreadSpool* s = thread_spools; s; s = s->next) {
+    csUint count = __atomic_exchange_n(&s->dropped, 0, __ATOMIC_RELAXED);
+    if (s->generation == thread_generation) dropped += count;
+  }
+  if (dropped) {
+    char message[64];
+    snprintf(message, sizeof(message),
+      "%u more failures from other threads were dropped", dropped
+    );
+    _cspec_error_fn(message);
+  }
+
+  thread_draining = FALSE;
+}
+
+/* Spools from this test go back to the free list for the next one */
+static void thread_release(void) {
+  thread_drain();
+  __atomic_fetch_add(&thread_generation, 1, __ATOMIC_SEQ_CST);
+  for (ThreadSpool* s = thread_spools; s; s = s->next) {
+    /* a thread that wasn't joined is still writing, try again next time */
+    if (__atomic_load_n(&s->writing, __ATOMIC_SEQ_CST)) continue;
+    s->read = 0;
+    __atomic_store_n(&s->count, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->dropped, 0, __ATOMIC_RELAXED);
+    __atomic_clear(&s->in_use, __ATOMIC_RELEASE);
+  }
+}
+
+static void thread_begin(void) {
+  thread_runs_tests = TRUE;
+}
+
+/* Threads a test started can log from anywhere, not just below the test */
+static csBool thread_is_helper(void) {
+  return !thread_runs_tests;
+}
+
+/*
+* A thread that wasn't joined can still be writing to its spool, or about to:
+* it's counted in thread_writers before it looks its spool up. Once the
+* generation moves on, threads that start writing after this see it and take
+* a new spool instead, so with nobody counted every spool can go. Otherwise
+* there's no telling which ones are in use, so they're all leaked rather than
+* freed out from under a thread still writing to one
+*/
+static void thread_free_all(void) {
+  __atomic_fetch_add(&thread_generation, 1, __ATOMIC_SEQ_CST);
+  ThreadSpool* spool = __atomic_exchange_n(&thread_spools, NULL,
+    __ATOMIC_ACQUIRE
+  );
+  if (__atomic_load_n(&thread_writers, __ATOMIC_SEQ_CST)) return;
+  while (spool) {
+    ThreadSpool* next = spool->next;
+    free(spool);
+    spool = next;
+  }
+}
+
+#else
+
+static csBool thread_message(int kind, int line, const char* s) {
+  (void)kind; (void)line; (void)s;
+  return FALSE;
+}
+static csBool thread_values(int kind, int line, const char* pre,
+  const char* fmt,
+  const char* const* types, const TypeId* ids, const void* const* args
+) {
+  (void)kind; (void)line; (void)pre; (void)fmt;
+  (void)types; (void)ids; (void)args;
+  return FALSE;
+}
+static void thread_drain(void) { }
+static void thread_release(void) { }
+static void thread_begin(void) { }
+static csBool thread_is_helper(void) { return FALSE; }
+static void thread_free_all(void) { }
+
+#define thread_log 0
+#define thread_log_typed 1
+#define thread_warning 2
+#define thread_failure 3
+#define thread_failure_typed 4
+
+#endif
 
 /*----------------------------------------------------------------------------*\
   Output Printing/Formatting
@@ -1127,52 +5403,57 @@ static int print_headers(
   return level + 1;
 }
 
-void _cspec_log_fn(int line, const char* message) {
-  if ((test_current_line && test_current_line >= line)
-  || param_verbose < V_NOTES
-  ) {
-    return;
-  }
+/* Values are printed as-is in place of each {} in the message */
+static void log_print(
+  int line, const char* message, const char* const* values, int count
+) {
   int level = print_headers(CONCOL_bWhite, LOGGED, NULL);
   output_pad(param_tabsize * level, ' ');
   output_str("line {}: ");
   output_sint(line);
   output_str(message);
+  for (int i = 0; i < count; ++i) {
+    output_raw(values[i]);
+  }
   output_print();
 }
 
-void _cspec_warn_fn(int line, const char* message) {
-  if (test_current_line && test_current_line > line) {
-    return;
-  }
-  int level = print_headers(CONCOL_Yellow, LOGGED, NULL);
-  output_pad(param_tabsize * level, ' ');
-  output_str("line {}:%c ");
-  output_sint(line);
-  output_str(message);
-  if (test_warned) {
-    output_print_color(CONCOL_Yellow);
-  } else {
-    output_print_color(CONCOL_bYellow);
-    if (!test_warned) ++test_warnings_count;
-  }
+csBool _cspec_log_active(int line) {
+  return (thread_is_helper() || !(test_current_line && test_current_line >= line))
+    && param_verbose >= V_NOTES;
+}
+
+void _cspec_log_fn(int line, const char* message) {
+  if (!_cspec_log_active(line)) return;
+  if (thread_message(thread_log, line, message)) return;
+  thread_drain();
+  log_print(line, message, NULL, 0);
+}
+
+static void warn_print(int line, const char* message) {
+  ReportEvent event = report_event(line);
+  event.format = message;
+  event.message = report_text_copy(message);
+  report(warning, &event);
+  if (!test_warned) ++test_warnings_count;
   test_warned = TRUE;
 }
 
-static int test_error_no_fail(const char* message, csBool is_mem_err) {
-  int level = print_headers(CONCOL_Red, PRINTED, NULL);
-  output_pad(param_tabsize * level, ' ');
-  if (is_mem_err) output_str("memory error: ");
-  output_str(message);
-  output_print();
-  if (param_padding) output_print();
-  return level;
+void _cspec_warn_fn(int line, const char* message) {
+  if (!thread_is_helper() && test_current_line && test_current_line > line) {
+    return;
+  }
+  if (thread_message(thread_warning, line, message)) return;
+  thread_drain();
+  warn_print(line, message);
 }
 
 void _cspec_error_fn(const char* message) {
   if (test_in_progress) {
+    if (thread_message(thread_failure, test_current_line, message)) return;
+    thread_drain();
     if (!test_expect_fail) {
-      test_error_no_fail(message, FALSE);
+      report_error(NULL, message);
     }
     test_failed = TRUE;
   }
@@ -1184,7 +5465,18 @@ static int _cspec_error_mem(const char* message, const MemoryRecord* record) {
   int level = 0;
   if (test_in_progress) {
     if (!memory_expect_error) {
-      level = test_error_no_fail(message, TRUE);
+      ReportEvent event = report_error_event("memory error: ", message);
+      event.memory_error = TRUE;
+      /* placeholder records for invalid pointers aren't real blocks */
+      if (record >= memory_records
+      &&  record < memory_records + memory_records_size
+      ) {
+        event.block = record->block + memory_size_fence;
+        event.block_size = record->size;
+        event.block_freed = record->is_free;
+      }
+      report(failure, &event);
+      level = print_headers(CONCOL_Red, PRINTED, NULL);
       if (record) {
         memory_print_record(record, level + 1);
       }
@@ -1197,213 +5489,987 @@ static int _cspec_error_mem(const char* message, const MemoryRecord* record) {
 #endif
 
 /*----------------------------------------------------------------------------*\
-  Printing fo typed values
-\*----------------------------------------------------------------------------*/
+  Diffs
+\*----------------------------------------------------------------------------*
+* When the values behind a failure are long strings, buffers compared with
+* match_bytes, or containers compared with all_be( == ), the failure also shows
+* a diff of them. Differences are found with Myers' linear space algorithm
+* (bisecting on the middle snake, as in diff-match-patch), using static tables
+* only. Searches give up past diff_d_max edits, showing the rest of that range
+* as replaced with a note saying so. The output stops after diff_hunks_max runs
+* of changes, diff_hunk_lines_max lines or diff_hunk_size_max bytes of a hunk,
+* or diff_text_max bytes in all, ending with "(diff truncated)" when it does.
+*
+* Strings containing newlines are compared line by line, as a unified diff.
+* Everything else is compared element by element, with each change shown in
+* place as [-removed-]{+added+} between a little of the context around it.
+*/
 
-resolve_user_types_fn resolve_user_types = NULL;
+#ifndef cspec_diff_size
+# define cspec_diff_size 65536 /* bytes of container elements kept to diff */
+#endif
+#define diff_d_max 1024
+#define diff_depth_max 32
+#define diff_runs_max 1024
+#define diff_lines_max 8192
+#define diff_hunks_max 8
+#define diff_hunk_lines_max 32
+#define diff_hunk_size_max 1024
+#define diff_text_max 8192
+#define diff_span_max 64
+#define diff_line_width 120
+#define diff_inline_max 64 /* shorter single line strings aren't diffed */
+#define diff_notes_size 160 /* room for the notes at the end of a diff */
+
+/* Room kept after the values of a failure, so the diff always fits */
+#define diff_text_room (diff_text_max + diff_notes_size * 2                   \
+  < cspec_report_text_size / 2                                                 \
+  ? diff_text_max + diff_notes_size * 2 : cspec_report_text_size / 2)
+
+static TypeId resolve_type_id(const char* typ_N, TypeId id);
+
+typedef enum DiffMode {
+  diff_chars,
+  diff_lines,
+  diff_bytes,
+  diff_items
+} DiffMode;
+
+typedef struct DiffRun {
+  char op; /* '=' kept, '-' only in the actual value, '+' only in expected */
+  csUint a;
+  csUint b;
+  csUint count;
+} DiffRun;
+
+static DiffMode diff_mode = diff_chars;
+static const csByte* diff_a = NULL;
+static const csByte* diff_b = NULL;
+static csUint diff_a_count = 0;
+static csUint diff_b_count = 0;
+static csSize diff_size = 1;   /* bytes per element */
+static csSize diff_stride = 1; /* bytes between elements */
+static const char* diff_type = NULL;
+static TypeId diff_id = type_id_named;
+static csUint diff_first = 0; /* index of the first element an all_be kept */
+static int diff_pending_line = 0; /* line of the expect a diff is saved for */
+static csBool diff_truncated = FALSE; /* only the start of the values kept */
+static csBool diff_runs_full = FALSE;
+static csBool diff_gave_up = FALSE;
+static csBool diff_cut = FALSE;       /* the text stopped before the end */
+static csBool diff_hunk_cut = FALSE;
+static csBool diff_line_start = TRUE;
+static csUint diff_text_limit = 0;
+static csUint diff_hunk_start = 0;
+static csUint diff_hunk_lines = 0;
+
+static csByte diff_scratch[cspec_diff_size];
+static csUint diff_line_a[diff_lines_max + 1];
+static csUint diff_line_b[diff_lines_max + 1];
+static int diff_v1[diff_d_max * 2 + 2];
+static int diff_v2[diff_d_max * 2 + 2];
+static DiffRun diff_runs[diff_runs_max];
+static int diff_run_count = 0;
+
+static csBool diff_bytes_same(const csByte* a, const csByte* b, csSize size) {
+  while (size--) {
+    if (*a++ != *b++) return FALSE;
+  }
+  return TRUE;
+}
 
-static csBool resolve_param(const char* typ_N, const void* N) {
+static csBool diff_same(csUint i, csUint j) {
+  if (diff_mode == diff_lines) {
+    csUint len = diff_line_a[i + 1] - diff_line_a[i];
+    if (len != diff_line_b[j + 1] - diff_line_b[j]) return FALSE;
+    return diff_bytes_same(
+      diff_a + diff_line_a[i], diff_b + diff_line_b[j], len
+    );
+  }
+  return diff_bytes_same(
+    diff_a + i * diff_stride, diff_b + j * diff_stride, diff_size
+  );
+}
 
-  if (!N) {
-    output_str("<NULL>");
-    return FALSE;
+/* Once the runs are full nothing more is added, so they stay a true prefix */
+static void diff_add(char op, csUint a, csUint b, csUint count) {
+  if (!count || diff_runs_full) return;
+  if (diff_run_count && diff_runs[diff_run_count - 1].op == op) {
+    diff_runs[diff_run_count - 1].count += count;
+    return;
+  }
+  if (diff_run_count == diff_runs_max) {
+    diff_runs_full = TRUE;
+    return;
   }
+  diff_runs[diff_run_count++] = (DiffRun) { op, a, b, count };
+}
 
-  if (resolve_user_types) {
-    csUint written = resolve_user_types(&typ_N, N,
-      output_buffer + output_index, output_size - output_index
-    );
+/* Finds where the forward and reverse paths meet, to split the ranges at */
+static csBool diff_bisect(
+  csUint a0, csUint a1, csUint b0, csUint b1, csUint* a_split, csUint* b_split
+) {
+  int n = (int)(a1 - a0);
+  int m = (int)(b1 - b0);
+  int max_d = (n + m + 1) / 2;
+  if (max_d > diff_d_max) max_d = diff_d_max;
+  int offset = max_d;
+  int length = max_d * 2;
+  for (int i = 0; i < length + 2; ++i) {
+    diff_v1[i] = -1;
+    diff_v2[i] = -1;
+  }
+  diff_v1[offset + 1] = 0;
+  diff_v2[offset + 1] = 0;
+
+  int delta = n - m;
+  csBool front = delta % 2 != 0;
+  int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+
+  for (int d = 0; d < max_d; ++d) {
+
+    for (int k1 = -d + k1start; k1 <= d - k1end; k1 += 2) {
+      int k1o = offset + k1;
+      int x1 = (k1 == -d || (k1 != d && diff_v1[k1o - 1] < diff_v1[k1o + 1]))
+        ? diff_v1[k1o + 1] : diff_v1[k1o - 1] + 1;
+      int y1 = x1 - k1;
+      while (x1 < n && y1 < m && diff_same(a0 + x1, b0 + y1)) {
+        ++x1;
+        ++y1;
+      }
+      diff_v1[k1o] = x1;
+      if (x1 > n) {
+        k1end += 2;
+      } else if (y1 > m) {
+        k1start += 2;
+      } else if (front) {
+        int k2o = offset + delta - k1;
+        if (k2o >= 0 && k2o < length && diff_v2[k2o] != -1
+        &&  x1 >= n - diff_v2[k2o]
+        ) {
+          *a_split = a0 + x1;
+          *b_split = b0 + y1;
+          return TRUE;
+        }
+      }
+    }
 
-    if (written) {
-      output_index += written;
-      output_continue_format();
-      return TRUE;
+    for (int k2 = -d + k2start; k2 <= d - k2end; k2 += 2) {
+      int k2o = offset + k2;
+      int x2 = (k2 == -d || (k2 != d && diff_v2[k2o - 1] < diff_v2[k2o + 1]))
+        ? diff_v2[k2o + 1] : diff_v2[k2o - 1] + 1;
+      int y2 = x2 - k2;
+      while (x2 < n && y2 < m
+      && diff_same(a0 + n - x2 - 1, b0 + m - y2 - 1)
+      ) {
+        ++x2;
+        ++y2;
+      }
+      diff_v2[k2o] = x2;
+      if (x2 > n) {
+        k2end += 2;
+      } else if (y2 > m) {
+        k2start += 2;
+      } else if (!front) {
+        int k1o = offset + delta - k2;
+        if (k1o >= 0 && k1o < length && diff_v1[k1o] != -1
+        &&  diff_v1[k1o] >= n - x2
+        ) {
+          *a_split = a0 + diff_v1[k1o];
+          *b_split = b0 + offset + diff_v1[k1o] - k1o;
+          return TRUE;
+        }
+      }
     }
   }
 
-  csBool is_size_t = cspec_strcmp(typ_N, "size_t");
+  /* no split found also means there's nothing in common, unless it gave up */
+  diff_gave_up |= (n + m + 1) / 2 > diff_d_max;
+  return FALSE;
+}
 
-  if (cspec_strrstr(typ_N, "char*")
-  ||  cspec_strrstr(typ_N, "byte*")
-  ||  cspec_strrstr(typ_N, "csByte*")
-  ||  cspec_strrstr(typ_N, "unsigned char*")
-  ||  cspec_strrstr(typ_N, "char[]")
+static void diff_range(csUint a0, csUint a1, csUint b0, csUint b1, int depth) {
+  if (diff_runs_full) return;
+  csUint prefix = 0;
+  while (a0 + prefix < a1 && b0 + prefix < b1
+  && diff_same(a0 + prefix, b0 + prefix)
   ) {
-    if (cspec_strrstr(typ_N, "[]")) {
-      output_str_quotes((const char*)N, '"');
-    } else {
-      output_str_quotes(*(const char**)N, '"');
-    }
+    ++prefix;
   }
-  else if (cspec_strrstr(typ_N, "*")
-  ||  cspec_strrstr(typ_N, "_ptr")
+  diff_add('=', a0, b0, prefix);
+  a0 += prefix;
+  b0 += prefix;
+
+  csUint suffix = 0;
+  while (a1 - suffix > a0 && b1 - suffix > b0
+  && diff_same(a1 - suffix - 1, b1 - suffix - 1)
   ) {
-    output_ptr(*(const void**)N);
+    ++suffix;
   }
-  else if (cspec_strrstr(typ_N, "[]")) {
-    output_ptr(N);
+  a1 -= suffix;
+  b1 -= suffix;
 
-  } else if
-  (  cspec_strcmp(typ_N, "char")
-  || cspec_strcmp(typ_N, "unsigned char")
+  csUint a_split, b_split;
+  if (a0 == a1 || b0 == b1 || depth >= diff_depth_max
+  || !diff_bisect(a0, a1, b0, b1, &a_split, &b_split)
   ) {
-    const char* tmp = output_fmt;
-    output_fmt = NULL;
-    output_char('\'');
-    output_char(*(const char*)N);
-    output_char('\'');
-    output_fmt = tmp;
-    output_continue_format();
+    diff_gave_up |= a0 != a1 && b0 != b1 && depth >= diff_depth_max;
+    diff_add('-', a0, b0, a1 - a0);
+    diff_add('+', a1, b0, b1 - b0);
+  } else {
+    diff_range(a0, a_split, b0, b_split, depth + 1);
+    diff_range(a_split, a1, b_split, b1, depth + 1);
   }
-  else if
-  (  cspec_strcmp(typ_N, "byte")
-  || cspec_strcmp(typ_N, "csByte")
-  ) {
-    output_hex(*(const char*)N);
+
+  diff_add('=', a1, b1, suffix);
+}
+
+/* Takes whatever was printed to the output buffer after mark */
+static void diff_text_take(csUint mark) {
+  for (csUint i = mark; i < output_index; ++i) {
+    report_text_char(output_buffer[i]);
   }
-  else if
-  (  cspec_strcmp(typ_N, "short")
-  || cspec_strcmp(typ_N, "short int")
-  ) {
-    output_sint(*(const short int*)N);
+  output_index = mark;
+  output_buffer[output_index] = '\0';
+}
+
+static void diff_text_uint(csUint n) {
+  csUint mark = output_index;
+  _output_uint_ignore_format(n);
+  diff_text_take(mark);
+}
+
+static void diff_text_char(char c) {
+  const char* hex = "0123456789ABCDEF";
+  if (c == '\n') report_text_str("\\n");
+  else if (c == '\t') report_text_str("\\t");
+  else if (c == '\r') report_text_str("\\r");
+  else if (c == '\\') report_text_str("\\\\");
+  else if (c < ' ' || c == 0x7F) {
+    report_text_str("\\x");
+    report_text_char(hex[(csByte)c / 16]);
+    report_text_char(hex[(csByte)c % 16]);
   }
-  else if (cspec_strcmp(typ_N, "int")) {
-    output_sint(*(const int*)N);
+  else report_text_char(c);
+}
+
+static void diff_text_sep(void) {
+  if (!diff_line_start) {
+    if (diff_mode == diff_bytes) report_text_char(' ');
+    if (diff_mode == diff_items) report_text_str(", ");
   }
-  else if
-  (  cspec_strcmp(typ_N, "long")
-  || cspec_strcmp(typ_N, "long int")
-  || (sizeof(void*) == 4 && is_size_t)
-  ) {
-    output_sint(*(const long int*)N);
+  diff_line_start = FALSE;
+}
+
+static void diff_text_element(const csByte* base, csUint i) {
+  const csByte* element = base + i * diff_stride;
+  if (diff_mode == diff_chars) {
+    diff_text_char((char)*element);
+  } else if (diff_mode == diff_bytes) {
+    csUint mark = output_index;
+    output_hex((char)*element);
+    diff_text_take(mark);
+  } else {
+    csUint mark = output_index;
+    resolve_param(diff_type, diff_id, element);
+    diff_text_take(mark);
   }
-  else if
-  (  cspec_strcmp(typ_N, "llong")
-  || cspec_strcmp(typ_N, "long long")
-  || cspec_strcmp(typ_N, "long long int")
-  || (sizeof(void*) == 8 && is_size_t)
+}
+
+/* Ends the hunk with "..." once it's printed as much as it can */
+static csBool diff_hunk_full(void) {
+  if (diff_hunk_cut) return TRUE;
+  if (report_text_index < diff_text_limit
+  &&  report_text_index - diff_hunk_start < diff_hunk_size_max
+  &&  diff_hunk_lines < diff_hunk_lines_max
   ) {
-    output_sint(*(const long long int*)N);
+    return FALSE;
+  }
+  if (diff_mode == diff_lines) report_text_char('\n');
+  else diff_text_sep();
+  report_text_str("...");
+  diff_hunk_cut = diff_cut = TRUE;
+  return TRUE;
+}
+
+/* Prints count elements, as a change if op isn't '=' */
+static void diff_text_span(char op, csUint from, csUint count) {
+  const csByte* base = op == '+' ? diff_b : diff_a;
+  csUint shown = count < diff_span_max ? count : diff_span_max;
+  if (diff_hunk_full()) return;
+  if (op != '=') {
+    diff_text_sep();
+    report_text_str(op == '-' ? "[-" : "{+");
+    diff_line_start = TRUE;
+  }
+  for (csUint i = 0; i < shown && !diff_hunk_full(); ++i) {
+    diff_text_sep();
+    diff_text_element(base, from + i);
+  }
+  if (diff_hunk_cut) {
+    if (op != '=') report_text_str(op == '-' ? "-]" : "+}");
+    return;
+  }
+  if (shown < count) {
+    diff_text_sep();
+    report_text_str("...");
+  }
+  if (op != '=') {
+    report_text_str(op == '-' ? "-]" : "+}");
+  }
+}
+
+/* The run after the last change in the hunk starting at run r */
+static int diff_hunk_end(int r, csUint context) {
+  for (;;) {
+    while (r < diff_run_count && diff_runs[r].op != '=') ++r;
+    if (r + 1 >= diff_run_count || diff_runs[r].count > context * 2) {
+      return r;
+    }
+    ++r;
+  }
+}
+
+static void diff_text_line(char prefix, const csByte* text, const csUint* lines,
+  csUint line
+) {
+  csUint len = lines[line + 1] - lines[line] - 1;
+  const char* s = (const char*)text + lines[line];
+  if (diff_hunk_full()) return;
+  ++diff_hunk_lines;
+  report_text_char('\n');
+  report_text_char(prefix);
+  for (csUint i = 0; i < len && i < diff_line_width; ++i) {
+    diff_text_char(s[i]);
+  }
+  if (len > diff_line_width) report_text_str("...");
+}
+
+static void diff_text_lines(int r, int end, csUint context) {
+  const DiffRun* lead = r ? &diff_runs[r - 1] : NULL;
+  const DiffRun* trail = end < diff_run_count ? &diff_runs[end] : NULL;
+  csUint lead_n = lead && lead->count < context ? lead->count : context;
+  csUint trail_n = trail && trail->count < context ? trail->count : context;
+  if (!lead) lead_n = 0;
+  if (!trail) trail_n = 0;
+  csUint a_n = lead_n + trail_n, b_n = lead_n + trail_n;
+  for (int k = r; k < end; ++k) {
+    if (diff_runs[k].op != '+') a_n += diff_runs[k].count;
+    if (diff_runs[k].op != '-') b_n += diff_runs[k].count;
+  }
+
+  report_text_str("@@ -");
+  diff_text_uint(diff_runs[r].a - lead_n + 1);
+  report_text_char(',');
+  diff_text_uint(a_n);
+  report_text_str(" +");
+  diff_text_uint(diff_runs[r].b - lead_n + 1);
+  report_text_char(',');
+  diff_text_uint(b_n);
+  report_text_str(" @@");
+
+  for (csUint i = diff_runs[r].a - lead_n; i < diff_runs[r].a; ++i) {
+    diff_text_line(' ', diff_a, diff_line_a, i);
+  }
+  for (int k = r; k < end; ++k) {
+    const DiffRun* run = &diff_runs[k];
+    for (csUint i = 0; i < run->count; ++i) {
+      if (run->op == '+') diff_text_line('+', diff_b, diff_line_b, run->b + i);
+      else diff_text_line(run->op == '-' ? '-' : ' ', diff_a, diff_line_a,
+        run->a + i
+      );
+    }
+  }
+  for (csUint i = 0; i < trail_n; ++i) {
+    diff_text_line(' ', diff_a, diff_line_a, trail->a + i);
+  }
+}
+
+static void diff_text_inline(int r, int end, csUint context) {
+  const DiffRun* lead = r ? &diff_runs[r - 1] : NULL;
+  const DiffRun* trail = end < diff_run_count ? &diff_runs[end] : NULL;
+  csUint lead_n = lead ? (lead->count < context ? lead->count : context) : 0;
+  csUint first = diff_mode == diff_items ? diff_first : 0;
+
+  if (diff_mode == diff_items) report_text_str("at [");
+  else if (diff_mode == diff_bytes) report_text_str("at byte ");
+  else report_text_str("at ");
+  diff_text_uint(diff_runs[r].a - lead_n + first);
+  report_text_str(diff_mode == diff_items ? "]: " : ": ");
+
+  /* elements before the ones kept matched, so they're left out the same way */
+  diff_line_start = TRUE;
+  if ((lead && lead->count > lead_n) || first + diff_runs[r].a > lead_n) {
+    diff_text_sep();
+    report_text_str("...");
+  }
+  if (lead) diff_text_span('=', lead->a + lead->count - lead_n, lead_n);
+  for (int k = r; k < end; ++k) {
+    diff_text_span(diff_runs[k].op,
+      diff_runs[k].op == '+' ? diff_runs[k].b : diff_runs[k].a,
+      diff_runs[k].count
+    );
+  }
+  if (trail) {
+    diff_text_span('=', trail->a, trail->count < context
+      ? trail->count : context
+    );
+    if (trail->count > context && !diff_hunk_cut) {
+      diff_text_sep();
+      report_text_str("...");
+    }
+  }
+}
+
+/* Joins changes next to each other into one removal followed by one addition */
+static void diff_compact(void) {
+  int count = 0;
+  for (int r = 0; r < diff_run_count; ) {
+    if (diff_runs[r].op == '=') {
+      diff_runs[count++] = diff_runs[r++];
+      continue;
+    }
+    DiffRun removed = { '-', diff_runs[r].a, diff_runs[r].b, 0 };
+    DiffRun added = removed;
+    added.op = '+';
+    for (; r < diff_run_count && diff_runs[r].op != '='; ++r) {
+      if (diff_runs[r].op == '-') removed.count += diff_runs[r].count;
+      else added.count += diff_runs[r].count;
+    }
+    if (removed.count) diff_runs[count++] = removed;
+    if (added.count) diff_runs[count++] = added;
+  }
+  diff_run_count = count;
+}
+
+/* Diffs the values set up in diff_a and diff_b, NULL if they're the same */
+static const char* diff_text(void) {
+  diff_run_count = 0;
+  diff_runs_full = diff_gave_up = diff_cut = FALSE;
+  diff_range(0, diff_a_count, 0, diff_b_count, 0);
+  diff_compact();
+  if (diff_run_count == 1 && diff_runs[0].op == '=' && !diff_truncated) {
+    return NULL;
+  }
+
+  csUint context = diff_mode == diff_chars ? 16
+    : diff_mode == diff_bytes ? 8 : 3;
+  const char* start = report_text + report_text_index;
+  int hunks = 0;
+
+  /* leaves room at the end of the report text for the notes below */
+  report_text_end = cspec_report_text_size - diff_notes_size;
+  diff_text_limit = report_text_index + diff_text_max;
+  if (diff_text_limit > report_text_end) diff_text_limit = report_text_end;
+
+  for (int r = 0; r < diff_run_count; ++r) {
+    if (diff_runs[r].op == '=') continue;
+    if (hunks) report_text_char('\n');
+    if (hunks++ == diff_hunks_max || report_text_index >= diff_text_limit) {
+      report_text_str("...");
+      diff_cut = TRUE;
+      break;
+    }
+    diff_hunk_start = report_text_index;
+    diff_hunk_lines = 0;
+    diff_hunk_cut = FALSE;
+    int end = diff_hunk_end(r, context);
+    if (diff_mode == diff_lines) {
+      diff_text_lines(r, end, context);
+    } else {
+      diff_text_inline(r, end, context);
+    }
+    r = end;
+  }
+  if (report_text_index + 1 >= report_text_end) diff_cut = TRUE;
+  report_text_end = cspec_report_text_size;
+
+  if (diff_gave_up) {
+    report_text_str(hunks ? "\n" : "");
+    report_text_str("(too many changes to compare, the rest is shown replaced)");
+    hunks = 1;
+  }
+  if (diff_cut || diff_runs_full) {
+    report_text_str(hunks ? "\n" : "");
+    report_text_str("(diff truncated)");
+    hunks = 1;
+  }
+  if (diff_truncated) {
+    report_text_str(hunks ? "\n" : "");
+    report_text_str("(diff limited to the start of the values)");
+  }
+  return report_text_finish(start);
+}
+
+/* Offsets of each line, with the end of the last one after them */
+static csUint diff_split_lines(const char* s, csUint* lines) {
+  csUint count = 0;
+  csUint i = 0;
+  lines[0] = 0;
+  for (; s[i] && count < diff_lines_max; ++i) {
+    if (s[i] == '\n') lines[++count] = i + 1;
+  }
+  if (count == diff_lines_max) {
+    diff_truncated = TRUE;
+    return count;
+  }
+  /* a newline at the end finishes the last line rather than starting one */
+  if (i && s[i - 1] == '\n') return count;
+  lines[count + 1] = i + 1;
+  return count + 1;
+}
+
+static const char* diff_strings(const char* a, const char* b) {
+  if (cspec_strcmp(a, b)) return NULL;
+  csUint len_a = cspec_strlen(a);
+  csUint len_b = cspec_strlen(b);
+  csBool multiline = FALSE;
+  for (const char* s = a; *s && !multiline; ++s) multiline = *s == '\n';
+  for (const char* s = b; *s && !multiline; ++s) multiline = *s == '\n';
+  if (!multiline && len_a <= diff_inline_max && len_b <= diff_inline_max) {
+    return NULL;
+  }
+
+  diff_truncated = FALSE;
+  diff_a = (const csByte*)a;
+  diff_b = (const csByte*)b;
+  diff_size = diff_stride = 1;
+  if (multiline) {
+    diff_mode = diff_lines;
+    diff_a_count = diff_split_lines(a, diff_line_a);
+    diff_b_count = diff_split_lines(b, diff_line_b);
+  } else {
+    diff_mode = diff_chars;
+    diff_a_count = len_a;
+    diff_b_count = len_b;
+  }
+  return diff_text();
+}
+
+/* Diffs the values of a failure if a diff was saved for it or has strings */
+static const char* diff_values(int line,
+  const char* const* types, const TypeId* ids, const void* const* args
+) {
+  if (diff_pending_line == line) {
+    diff_pending_line = 0;
+    if (diff_mode == diff_items) {
+      diff_type = types[0];
+      diff_id = resolve_type_id(types[0], ids[0]);
+    }
+    return diff_text();
+  }
+
+  const char* strings[2];
+  int found = 0;
+  for (int i = 0; i < report_values_max && found < 2; ++i) {
+    if (!types[i] || !args[i]) continue;
+    TypeId id = resolve_type_id(types[i], ids[i]);
+    if (id == type_id_string) {
+      strings[found++] = *(const char* const*)args[i];
+    } else if (id == type_id_char_array) {
+      strings[found++] = (const char*)args[i];
+    }
+  }
+
+  if (found < 2 || !strings[0] || !strings[1]) return NULL;
+  return diff_strings(strings[0], strings[1]);
+}
+
+csBool _cspec_diff_bytes(int line, const void* a, const void* b, csSize size) {
+  if (!a || !b) return a == b;
+  if (diff_bytes_same(a, b, size)) return TRUE;
+  diff_mode = diff_bytes;
+  diff_a = a;
+  diff_b = b;
+  diff_a_count = diff_b_count = (csUint)size;
+  diff_size = diff_stride = 1;
+  diff_truncated = FALSE;
+  diff_pending_line = line;
+  return FALSE;
+}
+
+/* Starts keeping the pairs of an all_be( == ) that failed, from index first */
+void _cspec_diff_items(long long first) {
+  diff_mode = diff_items;
+  diff_first = (csUint)first;
+  diff_a = diff_scratch;
+  diff_a_count = diff_b_count = 0;
+  diff_truncated = FALSE;
+  diff_pending_line = 0;
+}
+
+/* Saves the pairs for the failure, putting back the expected value at index */
+void _cspec_diff_failed(int line, long long index, void* expected, csSize size) {
+  if (diff_mode != diff_items) return;
+  index -= diff_first;
+  if (index >= 0 && (csSize)index < diff_a_count) {
+    cspec_memcpy(expected, diff_b + (csSize)index * diff_stride, size);
+  }
+  diff_pending_line = line;
+}
+
+/* Keeps elements side by side, so diff_b is diff_a offset by one element */
+csBool _cspec_diff_push(const void* actual, const void* expected, csSize size) {
+  if (!diff_a_count) {
+    diff_size = size;
+    diff_stride = size * 2;
+    diff_b = diff_scratch + size;
   }
-  else if
-  (  cspec_strcmp(typ_N, "ushort")
-  || cspec_strcmp(typ_N, "unsigned short")
-  || cspec_strcmp(typ_N, "unsigned short int")
+  if ((diff_a_count + 1) * diff_stride > cspec_diff_size) {
+    diff_truncated = TRUE;
+    return FALSE;
+  }
+  csByte* out = diff_scratch + diff_a_count * diff_stride;
+  cspec_memcpy(out, actual, size);
+  cspec_memcpy(out + size, expected, size);
+  diff_b_count = ++diff_a_count;
+  return TRUE;
+}
+
+/*----------------------------------------------------------------------------*\
+  Printing fo typed values
+\*----------------------------------------------------------------------------*/
+
+resolve_user_types_fn resolve_user_types = NULL;
+
+static void resolve_pointer(const void* N) {
+  output_ptr(*(const void**)N);
+}
+
+static void resolve_array(const void* N) {
+  output_ptr(N);
+}
+
+static void resolve_string(const void* N) {
+  output_str_quotes(*(const char**)N, '"');
+}
+
+static void resolve_char_array(const void* N) {
+  output_str_quotes((const char*)N, '"');
+}
+
+static void resolve_char(const void* N) {
+  const char* tmp = output_fmt;
+  output_fmt = NULL;
+  output_char('\'');
+  output_char(*(const char*)N);
+  output_char('\'');
+  output_fmt = tmp;
+  output_continue_format();
+}
+
+static void resolve_byte(const void* N) {
+  output_hex(*(const char*)N);
+}
+
+static void resolve_short(const void* N) {
+  output_sint(*(const short int*)N);
+}
+
+static void resolve_int(const void* N) {
+  output_sint(*(const int*)N);
+}
+
+static void resolve_long(const void* N) {
+  output_sint(*(const long int*)N);
+}
+
+static void resolve_llong(const void* N) {
+  output_sint(*(const long long int*)N);
+}
+
+static void resolve_ushort(const void* N) {
+  output_uint(*(const unsigned short*)N);
+}
+
+static void resolve_uint(const void* N) {
+  output_uint(*(const unsigned int*)N);
+}
+
+static void resolve_ulong(const void* N) {
+  output_uint(*(const unsigned long int*)N);
+}
+
+static void resolve_ullong(const void* N) {
+  output_uint(*(const unsigned long long int*)N);
+}
+
+static void resolve_float(const void* N) {
+  output_float(*(const float*)N);
+}
+
+static void resolve_double(const void* N) {
+  output_double(*(const double*)N);
+}
+
+static void resolve_bool(const void* N) {
+  output_bool(*(csBool*)N);
+}
+
+static void (*const resolve_printers[type_id_count])(const void* N) = {
+  [type_id_named]       = NULL,
+  [type_id_pointer]     = resolve_pointer,
+  [type_id_array]       = resolve_array,
+  [type_id_string]      = resolve_string,
+  [type_id_char_array]  = resolve_char_array,
+  [type_id_char]        = resolve_char,
+  [type_id_byte]        = resolve_byte,
+  [type_id_short]       = resolve_short,
+  [type_id_int]         = resolve_int,
+  [type_id_long]        = resolve_long,
+  [type_id_llong]       = resolve_llong,
+  [type_id_ushort]      = resolve_ushort,
+  [type_id_uint]        = resolve_uint,
+  [type_id_ulong]       = resolve_ulong,
+  [type_id_ullong]      = resolve_ullong,
+  [type_id_float]       = resolve_float,
+  [type_id_double]      = resolve_double,
+  [type_id_bool]        = resolve_bool,
+};
+
+static const struct {
+  const char* name;
+  TypeId id;
+} resolve_names[] = {
+  { "char",                   type_id_char    },
+  { "unsigned char",          type_id_char    },
+  { "byte",                   type_id_byte    },
+  { "csByte",                 type_id_byte    },
+  { "short",                  type_id_short   },
+  { "short int",              type_id_short   },
+  { "int",                    type_id_int     },
+  { "long",                   type_id_long    },
+  { "long int",               type_id_long    },
+  { "llong",                  type_id_llong   },
+  { "long long",              type_id_llong   },
+  { "long long int",          type_id_llong   },
+  { "size_t",                 sizeof(void*) == 4 ? type_id_long : type_id_llong },
+  { "ushort",                 type_id_ushort  },
+  { "unsigned short",         type_id_ushort  },
+  { "unsigned short int",     type_id_ushort  },
+  { "uint",                   type_id_uint    },
+  { "csUint",                 type_id_uint    },
+  { "unsigned",               type_id_uint    },
+  { "unsigned int",           type_id_uint    },
+  { "ulong",                  type_id_ulong   },
+  { "unsigned long",          type_id_ulong   },
+  { "unsigned long int",      type_id_ulong   },
+  { "ullong",                 type_id_ullong  },
+  { "unsigned long long",     type_id_ullong  },
+  { "unsigned long long int", type_id_ullong  },
+  { "float",                  type_id_float   },
+  { "double",                 type_id_double  },
+  { "bool",                   type_id_bool    },
+  { "_Bool",                  type_id_bool    },
+  { "csBool",                 type_id_bool    },
+};
+
+/* Only needed for types given by name, deduced types come with their id */
+static TypeId resolve_type_name(const char* typ_N) {
+
+  if (cspec_strrstr(typ_N, "char*")
+  ||  cspec_strrstr(typ_N, "byte*")
+  ||  cspec_strrstr(typ_N, "csByte*")
+  ||  cspec_strrstr(typ_N, "unsigned char*")
   ) {
-    output_uint(*(const unsigned short*)N);
+    return type_id_string;
   }
-  else if
-  (  cspec_strcmp(typ_N, "uint")
-  || cspec_strcmp(typ_N, "csUint")
-  || cspec_strcmp(typ_N, "unsigned")
-  || cspec_strcmp(typ_N, "unsigned int")
-  ) {
-    output_uint(*(const unsigned int*)N);
+  else if (cspec_strrstr(typ_N, "char[]")) {
+    return type_id_char_array;
   }
-  else if
-  (  cspec_strcmp(typ_N, "ulong")
-  || cspec_strcmp(typ_N, "unsigned long")
-  || cspec_strcmp(typ_N, "unsigned long int")
+  else if (cspec_strrstr(typ_N, "*")
+  ||  cspec_strrstr(typ_N, "_ptr")
   ) {
-    output_uint(*(const unsigned long int*)N);
+    return type_id_pointer;
   }
-  else if
-  (  cspec_strcmp(typ_N, "ullong")
-  || cspec_strcmp(typ_N, "unsigned long long")
-  || cspec_strcmp(typ_N, "unsigned long long int")
-  ) {
-    output_uint(*(const unsigned long long int*)N);
+  else if (cspec_strrstr(typ_N, "[]")) {
+    return type_id_array;
   }
-  else if (cspec_strcmp(typ_N, "float")) {
-    output_float(*(const float*)N);
+
+  for (csUint i = 0; i < ARRAY_COUNT(resolve_names); ++i) {
+    if (cspec_strcmp(typ_N, resolve_names[i].name)) {
+      return resolve_names[i].id;
+    }
   }
-  else if (cspec_strcmp(typ_N, "double")) {
-    output_float(*(const double*)N);
+
+  return type_id_named;
+}
+
+/*
+* Deduced ids are used as they are, except where the caller named the type as
+* a byte: _Generic only sees an unsigned char, but bytes are printed in hex.
+*/
+static TypeId resolve_type_id(const char* typ_N, TypeId id) {
+  if (id == type_id_named) {
+    return resolve_type_name(typ_N);
   }
-  else if
-  (  cspec_strcmp(typ_N, "bool")
-  || cspec_strcmp(typ_N, "_Bool")
-  || cspec_strcmp(typ_N, "csBool")
+  if (id == type_id_char
+  &&  (cspec_strcmp(typ_N, "byte") || cspec_strcmp(typ_N, "csByte"))
   ) {
-    output_bool(*(csBool*)N);
+    return type_id_byte;
   }
-  else {
+  return id;
+}
+
+static csBool resolve_param(const char* typ_N, TypeId id, const void* N) {
+
+  if (!N) {
+    output_str("<NULL>");
+    return FALSE;
+  }
+
+  if (resolve_user_types) {
+    const char* typ_user = typ_N;
+    csUint written = resolve_user_types(&typ_user, N,
+      output_buffer + output_index, output_capacity - output_index
+    );
+
+    if (written) {
+      output_index += written;
+      output_continue_format();
+      return TRUE;
+    }
+
+    /* the type was aliased to another one, so its name decides */
+    if (typ_user != typ_N) {
+      typ_N = typ_user;
+      id = type_id_named;
+    }
+  }
+
+  id = resolve_type_id(typ_N, id);
+
+  if (id == type_id_named || id >= type_id_count) {
     output_str("<unknown_type>");
     return FALSE;
   }
 
+  resolve_printers[id](N);
   return TRUE;
 }
 
 void _cspec_error_typed(
   int line, const char* pre, const char* fmt,
-  const char* t_arg0, const void* arg0,
-  const char* t_arg1, const void* arg1,
-  const char* t_arg2, const void* arg2,
-  const char* t_arg3, const void* arg3,
-  const char* t_arg4, const void* arg4,
-  const char* t_arg5, const void* arg5,
-  const char* t_arg6, const void* arg6,
-  const char* t_arg7, const void* arg7,
-  const char* t_arg8, const void* arg8,
-  const char* t_arg9, const void* arg9
+  const char* t_arg0, TypeId i_arg0, const void* arg0,
+  const char* t_arg1, TypeId i_arg1, const void* arg1,
+  const char* t_arg2, TypeId i_arg2, const void* arg2,
+  const char* t_arg3, TypeId i_arg3, const void* arg3,
+  const char* t_arg4, TypeId i_arg4, const void* arg4,
+  const char* t_arg5, TypeId i_arg5, const void* arg5,
+  const char* t_arg6, TypeId i_arg6, const void* arg6,
+  const char* t_arg7, TypeId i_arg7, const void* arg7,
+  const char* t_arg8, TypeId i_arg8, const void* arg8,
+  const char* t_arg9, TypeId i_arg9, const void* arg9
 ) {
   if (!test_in_progress) return;
-  test_failed = TRUE;
-  if (test_expect_fail) return;
-
-  int level = print_headers(CONCOL_Red, PRINTED, NULL);
-  if (output_indent) {
-    output_pad(output_indent, ' ');
-  }
-  else {
-    output_pad(param_tabsize * level, ' ');
-    output_str("line {}: ");
-    output_sint(line);
-    output_indent = output_index;
-  }
-  output_str("{}");
-  output_str(pre);
 
-  if (!fmt) goto finish;
-
-  output_str(fmt);
+  const char* types[report_values_max] = {
+    t_arg0, t_arg1, t_arg2, t_arg3, t_arg4,
+    t_arg5, t_arg6, t_arg7, t_arg8, t_arg9
+  };
+  const TypeId ids[report_values_max] = {
+    i_arg0, i_arg1, i_arg2, i_arg3, i_arg4,
+    i_arg5, i_arg6, i_arg7, i_arg8, i_arg9
+  };
+  const void* args[report_values_max] = {
+    arg0, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8, arg9
+  };
 
-  if (t_arg0) resolve_param(t_arg0, arg0);
-  if (t_arg1) resolve_param(t_arg1, arg1);
-  if (t_arg2) resolve_param(t_arg2, arg2);
-  if (t_arg3) resolve_param(t_arg3, arg3);
-  if (t_arg4) resolve_param(t_arg4, arg4);
-  if (t_arg5) resolve_param(t_arg5, arg5);
-  if (t_arg6) resolve_param(t_arg6, arg6);
-  if (t_arg7) resolve_param(t_arg7, arg7);
-  if (t_arg8) resolve_param(t_arg8, arg8);
-  if (t_arg9) resolve_param(t_arg9, arg9);
+  if (thread_values(thread_failure_typed, line, pre, fmt, types, ids, args)) {
+    return;
+  }
+  thread_drain();
+  test_failed = TRUE;
+  if (test_expect_fail) return;
 
-  if (!param_show_types) goto finish;
+  ReportEvent event = report_event(line);
+  int count = 0;
 
-  /* Follows the line printing the given types for debugging, ie. : (int, int) */
-  output_str(" : ( ");
+  /*
+  * Print each value on its own so reporters can get them separately. Each
+  * one is kept twice, on its own and in the message, so long values get an
+  * even share of the text before the room kept for the diff, with one more
+  * share left for the rest of the message
+  */
+  csUint values = 0;
+  for (int i = 0; fmt && i < report_values_max; ++i) values += !!types[i];
+  report_text_end = cspec_report_text_size - diff_text_room;
+  csUint share = report_text_end / (values * 2 + 1);
+  for (int i = 0; fmt && i < report_values_max; ++i) {
+    if (!types[i]) continue;
+    csUint mark = output_index;
+    resolve_param(types[i], ids[i], args[i]);
+    report_types[count] = types[i];
+    report_values[count++] = report_capture_max(mark, share);
+  }
 
-  if (t_arg0) output_str(t_arg0);
-  if (t_arg1) { output_str(", "); output_str(t_arg1); }
-  if (t_arg2) { output_str(", "); output_str(t_arg2); }
-  if (t_arg3) { output_str(", "); output_str(t_arg3); }
-  if (t_arg4) { output_str(", "); output_str(t_arg4); }
-  if (t_arg5) { output_str(", "); output_str(t_arg5); }
-  if (t_arg6) { output_str(", "); output_str(t_arg6); }
-  if (t_arg7) { output_str(", "); output_str(t_arg7); }
-  if (t_arg8) { output_str(", "); output_str(t_arg8); }
-  if (t_arg9) { output_str(", "); output_str(t_arg9); }
+  event.expectation = pre ? pre : "";
+  event.format = fmt;
+  event.values = report_values;
+  event.types = report_types;
+  event.value_count = count;
 
-  output_str(" )");
+  /*
+  * The diff is written at the end of the message, so it's only kept once.
+  * The values and message stop diff_text_room short of the end, so the diff
+  * still fits after values too long to keep whole
+  */
+  const char* message = report_text + report_text_index;
+  report_compose_text(pre, fmt, report_values, count);
+  report_text_end = cspec_report_text_size;
+  csUint mark = report_text_index;
+  report_text_char('\n');
+  event.diff = fmt ? diff_values(line, types, ids, args) : NULL;
+  if (!event.diff) {
+    report_text_index = mark;
+    report_text_finish(message);
+  }
+  event.message = message;
+  report(failure, &event);
+}
 
-finish:
+/* test_logf only calls this once _cspec_log_active says the line is logged */
+void _cspec_log_typed(
+  int line, const char* fmt,
+  const char* t_arg0, TypeId i_arg0, const void* arg0,
+  const char* t_arg1, TypeId i_arg1, const void* arg1,
+  const char* t_arg2, TypeId i_arg2, const void* arg2,
+  const char* t_arg3, TypeId i_arg3, const void* arg3,
+  const char* t_arg4, TypeId i_arg4, const void* arg4,
+  const char* t_arg5, TypeId i_arg5, const void* arg5,
+  const char* t_arg6, TypeId i_arg6, const void* arg6,
+  const char* t_arg7, TypeId i_arg7, const void* arg7,
+  const char* t_arg8, TypeId i_arg8, const void* arg8,
+  const char* t_arg9, TypeId i_arg9, const void* arg9
+) {
+  const char* types[report_values_max] = {
+    t_arg0, t_arg1, t_arg2, t_arg3, t_arg4,
+    t_arg5, t_arg6, t_arg7, t_arg8, t_arg9
+  };
+  const TypeId ids[report_values_max] = {
+    i_arg0, i_arg1, i_arg2, i_arg3, i_arg4,
+    i_arg5, i_arg6, i_arg7, i_arg8, i_arg9
+  };
+  const void* args[report_values_max] = {
+    arg0, arg1, arg2, arg3, arg4, arg5, arg6, arg7, arg8, arg9
+  };
 
-  output_print();
+  if (thread_values(thread_log_typed, line, NULL, fmt, types, ids, args)) {
+    return;
+  }
+  thread_drain();
+
+  /* values are printed first, so the line can be built around them */
+  report_text_index = 0;
+  int count = 0;
+  for (int i = 0; i < report_values_max; ++i) {
+    if (!types[i]) continue;
+    csUint mark = output_index;
+    resolve_param(types[i], ids[i], args[i]);
+    report_values[count++] = report_capture(mark);
+  }
 
-  /* print empty line for padding */
-  if (param_padding) output_print();
+  log_print(line, fmt, report_values, count);
 }
 
 /*----------------------------------------------------------------------------*\
@@ -1432,11 +6498,23 @@ csBool _cspec_begin(int line, const char* desc) {
   */
   if ((param_line == 0 || param_line == line) && !test_skip) {
     test_in_progress = TRUE;
+    report_test_begin(line);
+    trace_end();
+    trace_begin(report_name(desc), "test");
+    report_test_start = report_clock_ns();
+    memory_ledger_begin();
+    stack_begin();
 
   } else {
 
-    if (param_verbose == V_VERY || test_skip) {
-      /* Set test in progress temporarily just so it prints the title in blue */
+    /* Set test in progress temporarily so the title is part of the events */
+    if (test_skip) {
+      test_in_progress = TRUE;
+      report_test_begin(line);
+      report_test_skipped(line);
+
+    } else if (param_verbose == V_VERY) {
+      /* prints the title in blue */
       test_in_progress = TRUE;
       print_headers(CONCOL_Blue, LOGGED, NULL);
     }
@@ -1452,28 +6530,40 @@ csBool _cspec_end(void) {
     return FALSE;
   }
 
-  if (!test_failed && param_memory_test) {
+  /* takes what the test's threads reported, and nothing after */
+  thread_release();
+  memory_ledger_keep();
+
+  if (!test_failed) {
+    trace_begin("memory_final_checks", "memory");
     memory_final_checks();
+    trace_end();
+    resource_final_checks();
   }
 
+  memory_sample_report();
+  resource_lock_report();
+  memory_ledger_end();
+  stack_report();
+
   ++test_count;
 
+  ReportEvent event = report_event(test_current_line);
+  event.duration_ns = report_clock_ns() - report_test_start;
+
   if (!test_failed ^ test_expect_fail
 #ifdef _CSPEC_USE_MEMORY_TESTING_
   && !memory_error ^ memory_expect_error
 #endif
   ) {
     ++test_passed_count;
-
-    if (param_verbose >= V_RUN || param_line) {
-      csBool failed = test_expect_fail;
+    event.outcome = report_passed;
+    event.expected_fail = test_expect_fail;
 #ifdef _CSPEC_USE_MEMORY_TESTING_
-      failed |= memory_expect_error;
+    event.expected_fail |= memory_expect_error;
 #endif
-      const char* failnote = failed ? " (failed successfully)" : NULL;
-      print_headers(CONCOL_Green, LOGGED, failnote);
-    }
   } else {
+    event.outcome = report_failed;
     if (test_expect_fail) {
       test_expect_fail = FALSE; /* clear this so it prints the error */
       _cspec_error_fn("expected to fail, but succeeded instead");
@@ -1485,6 +6575,7 @@ csBool _cspec_end(void) {
 #endif
   }
 
+  report(test_end, &event);
   test_in_progress = FALSE;
 
   return TRUE;
@@ -1505,21 +6596,28 @@ csBool _cspec_expect_to_fail(void) {
 }
 
 #ifdef _CSPEC_USE_MEMORY_TESTING_
-static csBool memory_directive_warning(void) {
-  if (!param_memory_test) {
+static csBool memory_directive_warning(MemoryLevel required) {
+  if (memory_active_level == memory_level_off) {
     _cspec_warn_fn(0xFFFFFFFF,
       "warning: expecting memory errors, but memory testing is disabled"
     );
     test_expect_fail = TRUE;
     return TRUE;
   }
+  if (memory_active_level < required) {
+    _cspec_warn_fn(0xFFFFFFFF,
+      "warning: memory level is too low to track this"
+    );
+    test_expect_fail = TRUE;
+    return TRUE;
+  }
   return FALSE;
 }
 #endif
 
 csBool _cspec_memory_expect_to_fail(void) {
 #ifdef _CSPEC_USE_MEMORY_TESTING_
-  if (memory_directive_warning()) {
+  if (memory_directive_warning(memory_level_count)) {
     test_skip = TRUE;
     return !test_in_progress;
   } else if(!param_no_expect_fail)
@@ -1533,7 +6631,7 @@ csBool _cspec_memory_expect_to_fail(void) {
 
 csBool _cspec_memory_malloc_null(csBool only_once) {
 #ifdef _CSPEC_USE_MEMORY_TESTING_
-  if (memory_directive_warning()) {
+  if (memory_directive_warning(memory_level_count)) {
     test_skip = TRUE;
     return !test_in_progress;
   } else
@@ -1546,9 +6644,76 @@ csBool _cspec_memory_malloc_null(csBool only_once) {
 #endif
 }
 
+csBool _cspec_memory_set_level(MemoryLevel level) {
+#ifdef _CSPEC_USE_MEMORY_TESTING_
+  /* memory testing being turned off for the whole run takes priority */
+  if (param_memory_level == memory_level_off) {
+    return TRUE;
+  }
+
+  if (memory_count_mallocs || memory_count_frees || memory_records_size) {
+    _cspec_error_fn("memory level must be set before anything is allocated");
+    return TRUE;
+  }
+
+  memory_active_level = memory_level_supported(level);
+
+  if (level != memory_level_off) {
+    memory_records_reserve();
+  }
+
+  /* the arena isn't patterned below the fence level, so do that now */
+  if (memory_active_level == memory_level_fence) {
+    memory_arena_pattern();
+  }
+  return TRUE;
+#else
+  (void)level;
+  return TRUE;
+#endif
+}
+
+csBool _cspec_memory_use_heap(csBool use_heap) {
+#ifdef _CSPEC_USE_MEMORY_TESTING_
+  if (memory_count_mallocs || memory_count_frees || memory_records_size) {
+    _cspec_error_fn("memory source must be set before anything is allocated");
+    return TRUE;
+  }
+
+  memory_heap_active = use_heap;
+  return TRUE;
+#else
+  (void)use_heap;
+  return TRUE;
+#endif
+}
+
+csBool _cspec_memory_sample(csSize bytes) {
+#ifdef _CSPEC_USE_MEMORY_TESTING_
+  memory_sample_set(bytes);
+  return TRUE;
+#else
+  (void)bytes;
+  return TRUE;
+#endif
+}
+
+csSize _cspec_memory_sampled_bytes(void) {
+#ifdef _CSPEC_USE_MEMORY_TESTING_
+  double bytes = 0;
+  for (int i = 0; i < memory_sample_site_count; ++i) {
+    bytes += memory_sample_sites[i].bytes;
+  }
+  return (csSize)(bytes + 0.5);
+#else
+  _cspec_error_fn("Reading allocation samples, but memory testing is disabled");
+  return 0;
+#endif
+}
+
 int _cspec_memory_malloc_count(void) {
 #ifdef _CSPEC_USE_MEMORY_TESTING_
-  if (memory_directive_warning()) {
+  if (memory_directive_warning(memory_level_count)) {
     test_skip = TRUE;
     return -1;
   }
@@ -1561,7 +6726,7 @@ int _cspec_memory_malloc_count(void) {
 
 int _cspec_memory_free_count(void) {
 #ifdef _CSPEC_USE_MEMORY_TESTING_
-  if (memory_directive_warning()) {
+  if (memory_directive_warning(memory_level_count)) {
     test_skip = TRUE;
     return -1;
   }
@@ -1572,6 +6737,85 @@ int _cspec_memory_free_count(void) {
 #endif
 }
 
+csSize _cspec_stack_usage(void) {
+#ifdef _CSPEC_USE_STACK_TESTING_
+  if (stack_in_use) {
+    return stack_high_water();
+  }
+#endif
+  /* 0 rather than -1, so adding to it doesn't wrap around into a pass */
+  _cspec_warn_fn(0xFFFFFFFF,
+    "warning: expecting stack usage, but stack testing is disabled"
+  );
+  test_expect_fail = TRUE;
+  test_skip = TRUE;
+  return 0;
+}
+
+int _cspec_resources_open(ResourceKind kind) {
+#ifdef _CSPEC_USE_RESOURCE_TESTING_
+  return resource_count(kind);
+#else
+  (void)kind;
+  _cspec_error_fn("Reading open resources, but resource testing is disabled");
+  return -1;
+#endif
+}
+
+int _cspec_syscall_count(SyscallKind kind) {
+#ifdef _CSPEC_USE_RESOURCE_TESTING_
+  return __atomic_load_n(&resource_syscalls[kind], __ATOMIC_RELAXED);
+#else
+  (void)kind;
+  _cspec_error_fn("Reading syscall counts, but resource testing is disabled");
+  return -1;
+#endif
+}
+
+int _cspec_lock_acquisitions(void) {
+#ifdef _CSPEC_USE_RESOURCE_TESTING_
+  return __atomic_load_n(&resource_lock_acquired, __ATOMIC_RELAXED);
+#else
+  _cspec_error_fn("Reading lock stats, but resource testing is disabled");
+  return -1;
+#endif
+}
+
+int _cspec_lock_contentions(void) {
+#ifdef _CSPEC_USE_RESOURCE_TESTING_
+  return __atomic_load_n(&resource_lock_contended, __ATOMIC_RELAXED);
+#else
+  _cspec_error_fn("Reading lock stats, but resource testing is disabled");
+  return -1;
+#endif
+}
+
+csSize _cspec_memory_realloc_copied(void) {
+#ifdef _CSPEC_USE_MEMORY_TESTING_
+  if (memory_directive_warning(memory_level_track)) {
+    test_skip = TRUE;
+    return (csSize)-1;
+  }
+  return memory_realloc_copied;
+#else
+  _cspec_error_fn("Reading realloc stats, but memory testing is disabled");
+  return 0;
+#endif
+}
+
+csSize _cspec_memory_realloc_grown(void) {
+#ifdef _CSPEC_USE_MEMORY_TESTING_
+  if (memory_directive_warning(memory_level_track)) {
+    test_skip = TRUE;
+    return (csSize)-1;
+  }
+  return memory_realloc_grown;
+#else
+  _cspec_error_fn("Reading realloc stats, but memory testing is disabled");
+  return 0;
+#endif
+}
+
 /*----------------------------------------------------------------------------*\
   Test Runners
 \*----------------------------------------------------------------------------*/
@@ -1580,10 +6824,16 @@ void test_set_line(int line) {
   param_line = line;
 }
 
+/* Groups are numbered across every suite run, for splitting them into shards */
+static int shard_group = 0;
+
 static void before_run(void) {
+  report_run_start = report_clock_ns();
+  test_in_function = FALSE;
   test_count = 0;
   test_passed_count = 0;
   test_warnings_count = 0;
+  shard_group = 0;
 }
 
 static void before_suite(const TestSuite* suite) {
@@ -1602,7 +6852,9 @@ static void before_pass(void) {
   ctx_stack_index = 0;
   test_expect_fail = FALSE;
   test_skip = FALSE;
-  memory_test_reset(param_memory_test);
+  memory_test_reset(param_memory_level);
+  resource_test_reset();
+  fixture_reset();
   test_failed = FALSE;
   test_warned = FALSE;
   output_indent = 0;
@@ -1612,20 +6864,39 @@ static void process_function(const TestGroup* t) {
   before_fn(t);
   int prev_line;
 
+  ReportEvent event = report_event(*t->line);
+  report(group_begin, &event);
+  report_group_start = report_clock_ns();
+  trace_begin(t->header, "group");
+
   for (;;) {
+    trace_begin("pass", "runner");
     before_pass();
     prev_line = test_current_line;
 
+    /* the setup span is swapped for the test's once one begins */
+    trace_begin("setup", "context");
     test_in_function = TRUE;
-    t->group_fn();
+    stack_run(t->group_fn);
     test_in_function = FALSE;
+    trace_end();
 
-    if (!test_in_progress && prev_line == test_current_line) break;
+    if (!test_in_progress && prev_line == test_current_line) {
+      trace_end();
+      break;
+    }
 
     _cspec_end();
+    trace_end();
   }
 
   context_clear_stack();
+
+  event = report_event(*t->line);
+  event.duration_ns = report_clock_ns() - report_group_start;
+  report(group_end, &event);
+  trace_end();
+  test_function = NULL;
 }
 
 void cspec_run_suite(const TestSuite* suite) {
@@ -1640,14 +6911,30 @@ void cspec_run_suite(const TestSuite* suite) {
     return;
   }
 
+  ReportEvent event = report_event(0);
+  report(suite_begin, &event);
+  report_suite_start = report_clock_ns();
+  trace_begin(suite->filename, "suite");
+
   const TestGroup* t = &(*suite->test_groups)[0];
   while (t->line) {
+    if (param_shard_count
+    &&  shard_group++ % param_shard_count != param_shard_index
+    ) {
+      ++t;
+      continue;
+    }
     int tmp_line = param_line;
     if (*t->line == param_line) param_line = 0;
     process_function(t++);
     param_line = tmp_line;
   }
 
+  event = report_event(0);
+  event.duration_ns = report_clock_ns() - report_suite_start;
+  report(suite_end, &event);
+  trace_end();
+
   current_suite = NULL;
 }
 
@@ -1658,13 +6945,37 @@ static csBool process_param_basic(char c) {
     case 'n': handled = TRUE; param_verbose = V_NOTES; break;
     case 'V': handled = TRUE; param_verbose = V_VERY; break;
     case 'f': handled = TRUE; param_no_expect_fail = TRUE; break;
-    case 'm': handled = TRUE; param_memory_test = FALSE; break;
+    case 'm': handled = TRUE; param_memory_level = memory_level_off; break;
     case 's': handled = TRUE; param_show_types = TRUE; break;
     case 'p': handled = TRUE; param_padding = TRUE; break;
   }
   return handled;
 }
 
+static csBool memory_level_parse(const char* level) {
+  static const char* level_names[] = { "off", "count", "track", "fence", "guard" };
+
+  for (int i = 0; i < (int)(sizeof(level_names) / sizeof(level_names[0])); ++i) {
+    if (cspec_strcmp(level, level_names[i])) {
+      param_memory_level = (MemoryLevel)i;
+      return TRUE;
+    }
+  }
+  return FALSE;
+}
+
+/* Takes "i/n" for the i-th of n shards, counting from 1 */
+static csBool shard_parse(const char* shard) {
+  int index = cspec_atoi(shard);
+  while (*shard && *shard != '/') ++shard;
+  if (!*shard) return FALSE;
+  int count = cspec_atoi(shard + 1);
+  if (index < 1 || count < index) return FALSE;
+  param_shard_index = index - 1;
+  param_shard_count = count;
+  return TRUE;
+}
+
 static csBool process_args(int argc, char* argv[]) {
   for (int i = 1; i < argc; ++i) {
     char* arg = argv[i];
@@ -1698,6 +7009,17 @@ static csBool process_args(int argc, char* argv[]) {
           "\n: t tab-size         n (default 2)  : spaces per indent in test output"
           "\n: f force-fails                     : disables 'expect(to_fail)', printing failure output"
           "\n: m ignore-memory                   : disables memory testing"
+          "\n:   memory-level       level         : off, count, track, fence (default), guard"
+          "\n:   heap-memory                      : tracks allocations on the real heap instead of the test arena"
+          "\n:   sample-allocs      n             : samples one allocation per ~n bytes, logs a heap profile per test"
+          "\n:   global-memory                    : tracks untested allocations for the whole run, reports leaks at exit"
+          "\n:   stack-size         n (KB)        : runs tests on a stack of n KB and measures usage (0 disables)"
+          "\n:   line-buffered                    : writes each line as it's printed instead of in batches"
+          "\n:   no-progress                      : doesn't show the status line at the bottom of a terminal"
+          "\n:   shard              i/n           : runs every n-th test group, starting with the i-th"
+          "\n:   trace              file          : writes a trace of the run for Perfetto or chrome://tracing"
+          "\n:   reporter           fmt[:file]    : also reports to junit:file, tap:file, or tap (in place of the console)"
+          "\n:   events             ndjson[:file] : streams events as JSON lines to a file, fd:N, or in place of the console"
           "\n: s show-types                      : prints deduced types in error output"
         );
         return TRUE;
@@ -1715,6 +7037,96 @@ static csBool process_args(int argc, char* argv[]) {
       ) {
         process_param_basic('m');
 
+      } else if
+      ( cspec_strcmp(arg, "--heap-memory")
+      ) {
+        param_memory_heap = TRUE;
+
+      } else if
+      ( cspec_strcmp(arg, "--stack-size")
+      ) {
+        if (i + 1 < argc && cspec_atoi(argv[i + 1]) >= 0) {
+          param_stack_size = (csSize)cspec_atoi(argv[++i]) * 1024;
+        } else {
+          output("--stack-size requires a size in KB as an argument");
+          return TRUE;
+        }
+
+      } else if
+      ( cspec_strcmp(arg, "--global-memory")
+      ) {
+        param_memory_global = TRUE;
+
+      } else if
+      ( cspec_strcmp(arg, "--line-buffered")
+      ) {
+        param_line_buffered = TRUE;
+
+      } else if
+      ( cspec_strcmp(arg, "--no-progress")
+      ) {
+        param_progress = FALSE;
+
+      } else if
+      ( cspec_strcmp(arg, "--shard")
+      ) {
+        if (i + 1 < argc && shard_parse(argv[i + 1])) {
+          ++i;
+        } else {
+          output("--shard requires i/n, with i from 1 to n");
+          return TRUE;
+        }
+
+      } else if
+      ( cspec_strcmp(arg, "--reporter")
+      ) {
+        if (i + 1 < argc && format_add(argv[i + 1])) {
+          ++i;
+        } else {
+          output("--reporter requires one of: junit:file, tap, tap:file");
+          return TRUE;
+        }
+
+      } else if
+      ( cspec_strcmp(arg, "--trace")
+      ) {
+        if (i + 1 < argc && trace_open(argv[i + 1])) {
+          ++i;
+        } else {
+          output("--trace requires a file that can be written to");
+          return TRUE;
+        }
+
+      } else if
+      ( cspec_strcmp(arg, "--events")
+      ) {
+        if (i + 1 < argc && format_add_events(argv[i + 1])) {
+          ++i;
+        } else {
+          output("--events requires one of: ndjson, ndjson:file, ndjson:fd:N");
+          return TRUE;
+        }
+
+      } else if
+      ( cspec_strcmp(arg, "--sample-allocs")
+      ) {
+        if (i + 1 < argc && cspec_atoi(argv[i + 1]) > 0) {
+          param_sample_bytes = (csSize)cspec_atoi(argv[++i]);
+        } else {
+          output("--sample-allocs requires a number of bytes as an argument");
+          return TRUE;
+        }
+
+      } else if
+      ( cspec_strcmp(arg, "--memory-level")
+      ) {
+        if (i + 1 < argc && memory_level_parse(argv[i + 1])) {
+          ++i;
+        } else {
+          output("--memory-level requires one of: off, count, track, fence, guard");
+          return TRUE;
+        }
+
       } else if
       (  cspec_strcmp(arg, "-t")
       || cspec_strcmp(arg, "--tab-size")
@@ -1762,35 +7174,59 @@ int _cspec_run_all(int count, TestSuite* suites[], int argc, char* argv[]) {
   param_verbose = V_NONE;
   param_padding = FALSE;
   param_no_expect_fail = FALSE;
-  param_memory_test = TRUE;
+  param_memory_level = memory_level_fence;
+  param_memory_heap = FALSE;
+  param_sample_bytes = 0;
+  param_memory_global = FALSE;
+  param_stack_size = stack_size_default;
+  param_line_buffered = FALSE;
   param_show_types = FALSE;
+  param_progress = TRUE;
+  param_shard_index = 0;
+  param_shard_count = 0;
+
+  /*
+  * A run started from inside a test leaves the outer run's files alone, and
+  * starts outside of its contexts
+  */
+  if (test_in_function) {
+    format_detach();
+    trace_detach();
+    progress_detach();
+    ctx_stack_top = ctx_stack_index = 0;
+    test_in_progress = FALSE;
+  }
 
   if (process_args(argc, argv)) {
+    format_remove_all();
+    trace_close();
     return 0;
   }
 
+  memory_ledger_baseline();
   before_run();
+  thread_begin();
+  crash_begin();
+  progress_begin(count, suites, param_progress);
 
   for (int i = 0; i < count; ++i) {
     cspec_run_suite(suites[i]);
   }
 
-  if (test_count) {
-    ConsoleColor color = (test_count == test_passed_count) ? CONCOL_bGreen : CONCOL_bRed;
-    output_str("Tests passed:%c {} out of {}, or {}%");
-    output_sint(test_passed_count);
-    output_sint(test_count);
-    output_sint((int)(100.f * (float)test_passed_count / (float)test_count));
-    if (test_warnings_count) {
-      output_str(" - warnings: ");
-      output_sint(test_warnings_count);
-      if (color == CONCOL_bGreen) color = CONCOL_bYellow;
-    }
-    output_print_color(color);
-  } else {
-    output_str("Tests passed:%c 0 out of 0");
-    output_print_color(CONCOL_bYellow);
-  }
+  memory_ledger_report();
+
+  ReportEvent event = report_event(0);
+  event.duration_ns = report_clock_ns() - report_run_start;
+  event.tests = test_count;
+  event.passed = test_passed_count;
+  event.warnings = test_warnings_count;
+  report(summary, &event);
+  progress_end();
+  crash_end();
+  thread_free_all();
+  format_remove_all();
+  trace_close();
+  output_release();
 
   /* return the number of failed tests */
   return test_count - test_passed_count;
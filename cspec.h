@@ -105,6 +105,54 @@ typedef struct TestSuite {
   TestGroup (*test_groups)[];
 } TestSuite;
 
+typedef enum MemoryLevel {
+  memory_level_off,
+  memory_level_count,
+  memory_level_track,
+  memory_level_fence,
+  memory_level_guard
+} MemoryLevel;
+
+typedef enum ResourceKind {
+  resource_fd,
+  resource_file,
+  resource_map,
+  resource_thread
+} ResourceKind;
+
+typedef enum SyscallKind {
+  syscall_read,
+  syscall_write,
+  syscall_readv,
+  syscall_writev,
+  syscall_fsync,
+  syscall_mmap,
+  syscall_munmap,
+  syscall_epoll_wait
+} SyscallKind;
+
+typedef enum TypeId {
+  type_id_named,
+  type_id_pointer,
+  type_id_array,
+  type_id_string,
+  type_id_char_array,
+  type_id_char,
+  type_id_byte,
+  type_id_short,
+  type_id_int,
+  type_id_long,
+  type_id_llong,
+  type_id_ushort,
+  type_id_uint,
+  type_id_ulong,
+  type_id_ullong,
+  type_id_float,
+  type_id_double,
+  type_id_bool,
+  type_id_count
+} TypeId;
+
 #ifndef memory_size_max
 /*
 * \brief Test scratch-size for memory testing with malloc.
@@ -115,6 +163,15 @@ typedef struct TestSuite {
 #define memory_size_max 4096
 #endif
 
+#ifndef memory_heap_quarantine
+/*
+* \brief Bytes of freed blocks held back from the real heap in heap memory
+*   mode, so writes after free can still be caught. Once the limit is passed,
+*   the oldest freed blocks are released.
+*/
+#define memory_heap_quarantine (16 * 1024 * 1024)
+#endif
+
 /*----------------------------------------------------------------------------*\
   Test setup
 \*----------------------------------------------------------------------------*/
@@ -150,6 +207,29 @@ typedef struct TestSuite {
 // \brief
 #define after                     _after
 
+/*
+* \brief Setup in a fixture block only runs for the first test in its
+*   context. At the end of the block, anything registered with fixture_data
+*   (and the memory testing arena) is saved, and later tests in the context
+*   get that state copied back instead of running the block again.
+*
+* \brief Memory the setup allocates is only put back when it came from the
+*   memory testing arena. With heap_memory, or at the off, count, or guard
+*   levels, the block runs for every test as usual. Without memory testing
+*   built in, memory the setup allocates must outlive the context.
+*
+* \param - `fixture_data(asset); fixture { asset = load_asset(path); }`
+*/
+#define fixture                   _fixture
+
+/*
+* \brief Registers a variable to be saved and restored by the next fixture
+*   block. Call it before the fixture, on every pass through the context.
+*
+* \param var - An lvalue (usually a variable local to the context).
+*/
+#define fixture_data(var)         _cspec_fixture_data(__LINE__, &(var), sizeof(var))
+
 /*----------------------------------------------------------------------------*\
   Composing test suites
 \*----------------------------------------------------------------------------*/
@@ -240,6 +320,24 @@ typedef struct TestSuite {
 /* \brief An alias for `test_log` */
 #define test_note(message)        _test_log(message)
 
+/*
+* \brief Logs a message with values filled in, like the ones printed for failed
+*   expectations. Printed under the same conditions as `test_log`, and when it
+*   won't be printed, the values aren't evaluated at all, so it costs next to
+*   nothing in a hot loop.
+*
+* \param format - String Literal: The message, with a {} for each value.
+*
+* \param ... - Up to 9 values, printed according to their deduced types, or
+*   none. Needs C11; otherwise only the format is logged.
+*
+* \param - `test_logf("ratio {} after {} iterations", ratio, n);`
+*/
+#define test_logf(...)            _test_logf_any(__VA_ARGS__)
+
+/* \brief An alias for `test_logf` */
+#define test_notef(...)           _test_logf_any(__VA_ARGS__)
+
 /*
 * \brief Logs a warning message in the console output. The message is of higher
 *   importance than a basic log, and will appear even if the verbose level is
@@ -373,6 +471,64 @@ typedef struct TestSuite {
 */
 #define null_mallocs              _cspec_memory_malloc_null(FALSE)
 
+/*
+* \brief Sets how thoroughly memory is checked for this test, trading overhead
+*   for coverage. Must be given before anything is allocated in the test, and
+*   has no effect if memory testing was disabled with -m. The level for the
+*   whole run can be set with `--memory-level <level>` (default is fence).
+*
+* \brief `off`   - allocations go straight to the real malloc, unchecked.
+* \brief `count` - real malloc, but calls are counted and must balance out.
+* \brief `track` - test memory is tracked to find leaks and double frees.
+* \brief `fence` - as above, plus memory is patterned and fenced to find
+*   overruns and writes after free.
+* \brief `guard` - each allocation is placed against a protected page, so an
+*   overrun or access after free crashes right at the faulting instruction.
+*   Falls back to `fence` where page protection isn't available.
+*
+* \param expect(memory_level(track));
+*/
+#define memory_level(level)       _cspec_memory_set_level(memory_level_##level)
+
+/*
+* \brief Takes the blocks for this test from the real heap, with a small fence
+*   on either side, instead of the fixed test arena. Use this for tests that
+*   allocate more than memory_size_max. Must be given before anything is
+*   allocated. Applies to the track and fence levels, and can be set for the
+*   whole run with `--heap-memory`.
+*
+* \param expect(heap_memory);
+*/
+#define heap_memory               _cspec_memory_use_heap(TRUE)
+
+/*
+* \brief Takes the blocks for this test from the fixed test arena, even when
+*   the run was started with `--heap-memory`. Use this for tests that depend on
+*   how blocks are laid out, such as realloc growing the last block in place.
+*
+* \param expect(arena_memory);
+*/
+#define arena_memory              _cspec_memory_use_heap(FALSE)
+
+/*
+* \brief Samples about one allocation per `bytes` allocated for the rest of the
+*   test, and logs an estimated heap profile per call site when it ends (shown
+*   with -n or higher). The overhead is low enough to leave on for timed tests,
+*   and it works at every memory level. Can be set for the whole run with
+*   `--sample-allocs <bytes>`.
+*
+* \param expect(sample_allocs(64 * 1024));
+*/
+#define sample_allocs(bytes)      _cspec_memory_sample(bytes)
+
+/*
+* \brief The estimated number of bytes allocated so far in the test, scaled up
+*   from the allocations picked by `sample_allocs`.
+*
+* \param expect(sampled_bytes to be_within(4096 of 65536));
+*/
+#define sampled_bytes             _cspec_memory_sampled_bytes()
+
 /*----------------------------------------------------------------------------*\
   Matchers
 \*----------------------------------------------------------------------------*/
@@ -480,6 +636,18 @@ typedef struct TestSuite {
 */
 #define match(B, fn)              _fn_comp(fn, B)
 
+/*
+* \brief Checks that a buffer holds the same bytes as another one. If it
+*   doesn't, the failure shows a diff of the bytes around each difference.
+*
+* \brief Example: `expect(output to match_bytes(expected, sizeof(expected)));`
+*
+* \param B - A pointer to the bytes expected
+*
+* \param N - The number of bytes to compare
+*/
+#define match_bytes(B, N)         _match_bytes(B, N)
+
 /*
 * \brief Can be used after a function or macro and a matcher or expression to
 *   call and test the function in a way that will be able to print out the
@@ -704,6 +872,106 @@ typedef struct TestSuite {
 */
 #define free_count _cspec_memory_free_count()
 
+/*
+* \brief Gets the number of bytes realloc has had to copy into a new block so
+*   far in the test. A buffer that grows geometrically copies at most about
+*   twice its final size in total, while one growing by a constant amount
+*   copies quadratically more.
+*
+* \brief Call sites that keep growing the same buffer by a constant amount
+*   are also flagged with a warning at the end of the test.
+*
+* \param - `expect(realloc_copied_bytes, <= , 2 * final_size);`
+*/
+#define realloc_copied_bytes _cspec_memory_realloc_copied()
+
+/*
+* \brief Gets the number of bytes realloc has grown blocks by without needing
+*   to move them so far in the test.
+*
+* \param - `expect(realloc_grown_bytes, == , 0);`
+*/
+#define realloc_grown_bytes _cspec_memory_realloc_grown()
+
+/*
+* \brief Gets the deepest the stack has been used so far in the test, in bytes,
+*   measured from where the test began. Needs stack testing, enabled by
+*   building with CSPEC_STACK_SIZE defined (CSPEC_STACKTEST in CMake) or by
+*   running with `--stack-size <KB>`. Each test group then runs on its own
+*   stack of that size, so an overflow crashes rather than going unnoticed.
+*
+* \param - `expect(stack_usage, < , cspec_kb(16));`
+*/
+#define stack_usage _cspec_stack_usage()
+
+/*
+* \brief A little syntactic sugar for sizes, ie: `cspec_kb(16)` or `cspec_mb(2)`.
+*/
+#define cspec_kb(N) ((N) * 1024)
+#define cspec_mb(N) ((N) * 1024 * 1024)
+
+/*----------------------------------------------------------------------------*\
+  Resource tracking
+\*----------------------------------------------------------------------------*/
+
+/*
+* \brief Gets the number of file descriptors (from open or socket) the test
+*   has opened and not yet closed. Needs resource testing, enabled by building
+*   with -Dopen=cspec_open etc. (CSPEC_RESOURCETEST in CMake). Anything still
+*   open when the test ends fails the test.
+*
+* \param - `expect(fds_open == 0);`
+*/
+#define fds_open _cspec_resources_open(resource_fd)
+
+/*
+* \brief Gets the number of FILE streams opened by fopen and not yet closed.
+*
+* \param - `expect(files_open == 1);`
+*/
+#define files_open _cspec_resources_open(resource_file)
+
+/*
+* \brief Gets the number of memory mappings from mmap not yet unmapped.
+*
+* \param - `expect(maps_open == 0);`
+*/
+#define maps_open _cspec_resources_open(resource_map)
+
+/*
+* \brief Gets the number of threads created and not yet joined or detached.
+*
+* \param - `expect(threads_open == 0);`
+*/
+#define threads_open _cspec_resources_open(resource_thread)
+
+/*
+* \brief Gets the number of calls made so far in the test to one of the
+*   wrapped system calls: read, write, readv, writev, fsync, mmap, munmap, or
+*   epoll_wait. Needs resource testing, with -Dread=cspec_read etc. for the
+*   calls being counted.
+*
+* \param - `expect(syscall_count(write), <= , 1);`
+*/
+#define syscall_count(name) _cspec_syscall_count(syscall_##name)
+
+/*
+* \brief Gets the number of mutex and rwlock acquisitions made so far in the
+*   test. Needs resource testing, with -Dpthread_mutex_lock=cspec_... etc.
+*   Counts per call site, along with time spent blocked, are printed with -v.
+*
+* \param - `expect(lock_acquisitions, == , 2);`
+*/
+#define lock_acquisitions _cspec_lock_acquisitions()
+
+/*
+* \brief Gets the number of lock acquisitions so far in the test that found
+*   the lock already held, including failed trylocks.
+*
+* \param - `expect(lock_contentions, == , 0);`
+*/
+#define lock_contentions _cspec_lock_contentions()
+
 /*----------------------------------------------------------------------------*\
   Extras
 \*----------------------------------------------------------------------------*/
@@ -736,6 +1004,100 @@ typedef csUint (*resolve_user_types_fn)
 */
 extern resolve_user_types_fn resolve_user_types;
 
+/*----------------------------------------------------------------------------*\
+  Reporters
+\*----------------------------------------------------------------------------*/
+
+typedef enum ReportOutcome {
+  report_passed,
+  report_failed,
+  report_skipped
+} ReportOutcome;
+
+/*
+* \brief Describes something that happened during the run. Every event carries
+*   its location, other fields are only filled in by the events noted, and are
+*   NULL or 0 otherwise. Strings are only valid until the callback returns.
+*/
+typedef struct ReportEvent {
+  const char* file;           /* filename of the running suite */
+  const char* group;          /* name of the running test group */
+  const char* const* path;    /* contexts and test, outermost first */
+  int depth;                  /* number of entries in path */
+  int line;                   /* line of the group, context, test or expect */
+
+  /* test_end, group_end, suite_end and summary (0 where there's no clock) */
+  csSize duration_ns;
+
+  /* test_end */
+  ReportOutcome outcome;
+  csBool expected_fail;       /* passed because it failed as it was told to */
+
+  /* failure and warning */
+  const char* message;        /* full text, with the values filled in */
+  const char* expectation;    /* the expectation that failed, NULL if none */
+  const char* format;         /* text with a {} for each value, as printed */
+  const char* const* values;  /* each value printed as text */
+  const char* const* types;   /* the deduced type of each value */
+  int value_count;
+  const char* diff;           /* how the values compared differ, if shown */
+
+  /* failure, for memory errors */
+  csBool memory_error;
+  const void* block;          /* the allocation involved, NULL if none */
+  csSize block_size;
+  csBool block_freed;
+
+  /* summary */
+  int tests;
+  int passed;
+  int warnings;
+} ReportEvent;
+
+typedef void (*report_fn)(void* data, const ReportEvent* event);
+
+/*
+* \brief A set of callbacks that receive the events of a test run as they
+*   happen. Any callback can be left NULL. Several reporters can be active at
+*   once, and are called in the order they were added.
+*/
+typedef struct Reporter {
+  report_fn suite_begin;
+  report_fn suite_end;
+  report_fn group_begin;
+  report_fn group_end;
+  report_fn context_begin;
+  report_fn context_end;
+  report_fn test_begin;
+  report_fn test_end;
+  report_fn failure;
+  report_fn warning;
+  report_fn summary;
+  void* data;                 /* passed back as the first callback parameter */
+} Reporter;
+
+/*
+* \brief The reporter that prints results to the console. It's added by
+*   default, removing it silences all console output from the run.
+*/
+extern const Reporter cspec_console_reporter;
+
+/*
+* \brief Adds a reporter to the run. The reporter is not copied, and must stay
+*   valid until it's removed or the run ends.
+*
+* \returns FALSE if the reporter was already added, or if there's no room left
+*   (see cspec_reporters_max).
+*/
+csBool  cspec_add_reporter(const Reporter* reporter);
+
+/*
+* \brief Removes a reporter added with cspec_add_reporter.
+*
+* \returns FALSE if the reporter wasn't active.
+*/
+csBool  cspec_remove_reporter(const Reporter* reporter);
+
 /*
 * A few internal functions that can be used if convenient in an environment
 *   that doesn't have access to the standard library.
@@ -799,22 +1161,58 @@ csBool  _cspec_end(void);
 csBool  _cspec_active(void);
 csBool  _cspec_context_begin(int line, const char* desc);
 csBool  _cspec_context_end(int line);
+csBool  _cspec_fixture_begin(int line);
+csBool  _cspec_fixture_end(int line);
+void    _cspec_fixture_data(int line, void* data, csSize size);
 void    _cspec_log_fn(int line, const char* messgae);
+csBool  _cspec_log_active(int line);
 void    _cspec_warn_fn(int line, const char* message);
 void    _cspec_error_fn(const char* message);
+csBool  _cspec_diff_bytes(int line, const void* a, const void* b, csSize size);
+void    _cspec_diff_items(long long first);
+void    _cspec_diff_failed(int line, long long index, void* expected, csSize size);
+csBool  _cspec_diff_push(const void* actual, const void* expected, csSize size);
 csBool  _cspec_expect_to_fail(void);
 csBool  _cspec_memory_expect_to_fail(void);
 csBool  _cspec_memory_malloc_null(csBool only_next);
+csBool  _cspec_memory_set_level(MemoryLevel level);
+csBool  _cspec_memory_use_heap(csBool use_heap);
+csBool  _cspec_memory_sample(csSize bytes);
+csSize  _cspec_memory_sampled_bytes(void);
 int     _cspec_memory_malloc_count(void);
 int     _cspec_memory_free_count(void);
+csSize  _cspec_memory_realloc_copied(void);
+csSize  _cspec_memory_realloc_grown(void);
+csSize  _cspec_stack_usage(void);
+int     _cspec_resources_open(ResourceKind kind);
+int     _cspec_syscall_count(SyscallKind kind);
+int     _cspec_lock_acquisitions(void);
+int     _cspec_lock_contentions(void);
 void    _cspec_memory_log_block(int line, const void* ptr);
 int     _cspec_run_all(int count, TestSuite* suites[], int argc, char* argv[]);
 void    _cspec_error_typed(int line, const char* pfix, const char* fmt,
-  const char* t_a0, const void* a0, const char* t_a1, const void* a1,
-  const char* t_a2, const void* a2, const char* t_a3, const void* a3,
-  const char* t_a4, const void* a4, const char* t_a5, const void* a5,
-  const char* t_a6, const void* a6, const char* t_a7, const void* a7,
-  const char* t_a8, const void* a8, const char* t_a9, const void* a9
+  const char* t_a0, TypeId i_a0, const void* a0,
+  const char* t_a1, TypeId i_a1, const void* a1,
+  const char* t_a2, TypeId i_a2, const void* a2,
+  const char* t_a3, TypeId i_a3, const void* a3,
+  const char* t_a4, TypeId i_a4, const void* a4,
+  const char* t_a5, TypeId i_a5, const void* a5,
+  const char* t_a6, TypeId i_a6, const void* a6,
+  const char* t_a7, TypeId i_a7, const void* a7,
+  const char* t_a8, TypeId i_a8, const void* a8,
+  const char* t_a9, TypeId i_a9, const void* a9
+);
+void    _cspec_log_typed(int line, const char* fmt,
+  const char* t_a0, TypeId i_a0, const void* a0,
+  const char* t_a1, TypeId i_a1, const void* a1,
+  const char* t_a2, TypeId i_a2, const void* a2,
+  const char* t_a3, TypeId i_a3, const void* a3,
+  const char* t_a4, TypeId i_a4, const void* a4,
+  const char* t_a5, TypeId i_a5, const void* a5,
+  const char* t_a6, TypeId i_a6, const void* a6,
+  const char* t_a7, TypeId i_a7, const void* a7,
+  const char* t_a8, TypeId i_a8, const void* a8,
+  const char* t_a9, TypeId i_a9, const void* a9
 );
 
 /*----------------------------------------------------------------------------*\
@@ -860,6 +1258,25 @@ void    _cspec_error_typed(int line, const char* pfix, const char* fmt,
 # endif
 //*/
 
+// Types not listed here (including CSPEC_CUSTOM_TYPES) are found by name
+# define _type_id_lit(X, T, P, A) _Generic((&X), T**: P, default: A)
+# define _type_id_h(X, T, ID) T: ID, T*: _type_id_lit(X, T, type_id_pointer, type_id_array),   \
+  const T*: _type_id_lit(X, const T, type_id_pointer, type_id_array)                          //
+# define _type_id_c(X, T, ID) T: ID, T*: _type_id_lit(X, T, type_id_string, type_id_char_array), \
+  const T*: _type_id_lit(X, const T, type_id_string, type_id_char_array)                      //
+
+# define _type_id(X) _Generic((X), void*: type_id_pointer, const void*: type_id_pointer,                                 \
+  _type_id_h(X, _Bool, type_id_bool),                     _type_id_c(X, char, type_id_char),                             \
+  _type_id_h(X, short, type_id_short),                    _type_id_h(X, int, type_id_int),                               \
+  _type_id_h(X, long, type_id_long),                      _type_id_h(X, long long, type_id_llong),                       \
+  _type_id_c(X, unsigned char, type_id_char),             _type_id_h(X, unsigned short, type_id_ushort),                 \
+  _type_id_h(X, unsigned int, type_id_uint),              _type_id_h(X, unsigned long, type_id_ulong),                   \
+  _type_id_h(X, unsigned long long, type_id_ullong),      _type_id_h(X, float, type_id_float),                           \
+  _type_id_h(X, double, type_id_double),                  default: type_id_named                                         \
+)                                                                                                                         //
+
+# define _type_arg(X) _type_s(X), _type_id(X)
+
 # define _csva_exp_1(F,G,a,...) F(1,a) G(1,a)
 # define _csva_exp_2(F,G,a,...) F(2,a) _csva_exp_1(F,G,__VA_ARGS__) G(2,a)
 # define _csva_exp_3(F,G,a,...) F(3,a) _csva_exp_2(F,G,__VA_ARGS__) G(3,a)
@@ -874,17 +1291,25 @@ void    _cspec_error_typed(int line, const char* pfix, const char* fmt,
 
 # define _param_mty(N, P, ...)
 # define _param_def(N, P, ...) typeof(P) MACRO_CONCAT(_P, N) = P;
-# define _param_arg(N, P, ...) _type_s(P), (void*)&MACRO_CONCAT(_P, N),
+# define _param_arg(N, P, ...) _type_arg(P), (void*)&MACRO_CONCAT(_P, N),
 # define _param_str(N, P, ...) "\nparam "#N": {}"
 
 # define _param_fn_def(...) _csva_exp(_param_def, _param_mty, __VA_ARGS__)
 # define _param_fn_arg(...) _csva_exp(_param_arg, _param_mty, __VA_ARGS__)
 # define _param_fn_str(...) _csva_exp(_param_mty, _param_str, __VA_ARGS__)
 
-# define _test_fail_comp(S) { _test_fail_args("expected "S, "%n\nreceived {}", _type_s(_Aout), (void*)&_Aout); return; }
-# define _test_fail_fn_expr(F, x, B, P) { _test_fail_args("expected X "#x" "#B" where X == "#F#P, "%n\nreceived {} "#x" {}" _param_fn_str P, _type_s(_R), (void*)&_R, _type_s(_B), (void*)&_B, _param_fn_arg P 0); return; }
-# define _test_fail_fn_comp(S, P) { _test_fail_args("expected "S, "%n\nreceived {}" _param_fn_str P, _type_s(_R), (void*)&_R, _param_fn_arg P 0); return; }
-# define _test_fail_fn_true(F, A, B) { _test_fail_args("expected to pass "#F"("#A", "#B")", "%n\nparam 1: {}\nparam 2: {}", _type_s(_A), (void*)&_A, _type_s(_B), (void*)&_B); return; }
+# define _logf_arg(N, P, ...) _type_arg(MACRO_CONCAT(_P, N)), (void*)&MACRO_CONCAT(_P, N),
+# define _logf_fn_arg(...) _csva_exp(_logf_arg, _param_mty, __VA_ARGS__)
+
+# define _test_fail_comp(S) { _test_fail_args("expected "S, "%n\nreceived {}", _type_arg(_Aout), (void*)&_Aout); return; }
+# define _test_fail_fn_expr(F, x, B, P) { _test_fail_args("expected X "#x" "#B" where X == "#F#P, "%n\nreceived {} "#x" {}" _param_fn_str P, _type_arg(_R), (void*)&_R, _type_arg(_B), (void*)&_B, _param_fn_arg P 0); return; }
+# define _test_fail_fn_comp(S, P) { _test_fail_args("expected "S, "%n\nreceived {}" _param_fn_str P, _type_arg(_R), (void*)&_R, _param_fn_arg P 0); return; }
+// The values are only evaluated once the line is known to be logged
+# define _test_logf_args(fmt,A,Ai,a,B,Bi,b,C,Ci,c,D,Di,d,E,Ei,e,F,Fi,f,G,Gi,g,H,Hi,h,I,Ii,i,J,Ji,j,...) _cspec_log_typed(__LINE__,fmt,A,Ai,a,B,Bi,b,C,Ci,c,D,Di,d,E,Ei,e,F,Fi,f,G,Gi,g,H,Hi,h,I,Ii,i,J,Ji,j)
+# define _test_logf_pad(fmt, ...) _test_logf_args(fmt,__VA_ARGS__,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0)
+# define _test_logf(fmt, ...) do { if (_cspec_log_active(__LINE__)) { _param_fn_def(__VA_ARGS__) _test_logf_pad(fmt, _logf_fn_arg(__VA_ARGS__) 0); } } while(0)
+# define _test_logf_none(fmt) do { if (_cspec_log_active(__LINE__)) { _test_logf_pad(fmt, 0); } } while(0)
+# define _test_fail_fn_true(F, A, B) { _test_fail_args("expected to pass "#F"("#A", "#B")", "%n\nparam 1: {}\nparam 2: {}", _type_arg(_A), (void*)&_A, _type_arg(_B), (void*)&_B); return; }
 
 #endif
 
@@ -897,34 +1322,47 @@ void    _cspec_error_typed(int line, const char* pfix, const char* fmt,
 #define _context(DESC) for (int _loop_ctx = 0; (_loop_ctx++ < 2) && _cspec_context_begin(__LINE__, "context: %c["LINESTR"] "DESC);) if (_loop_ctx == 2) { if (_cspec_context_end(__LINE__)) return; } else
 #define _test(DESC) for (int _loop_tst = 0; _loop_tst++ < 1 && _cspec_begin(__LINE__, "test %c["LINESTR"] "DESC);)
 #define _after for (int _loop_ctx = 0; _loop_ctx++ < 1 && _cspec_active();)
+#define _fixture for (int _loop_fix = _cspec_fixture_begin(__LINE__); _loop_fix; _loop_fix = _cspec_fixture_end(__LINE__))
 
 #define _test_suite(NAME) TestSuite NAME = { .header="in file: %c"__FILE__, .filename=__FILE__, .test_groups = (TestGroup(*)[])(&(TestGroup[])
 #define _test_group(TEST_FN) { .line = &_fn_line_##TEST_FN, .header=#TEST_FN, .group_fn = test_##TEST_FN }
 #define _test_suite_end { .line = NULL, .group_fn = NULL } })
 
 #define _test_log(message) _cspec_log_fn(__LINE__, message)
+#ifndef _USE_DEDUCTION
+# define _test_logf(fmt, ...) _cspec_log_fn(__LINE__, fmt)
+# define _test_logf_none(fmt) _cspec_log_fn(__LINE__, fmt)
+#endif
+#define _test_logf_va(_0,_1,_2,_3,_4,_5,_6,_7,_8,_9, F, ...) F
+#define _test_logf_any(...) _test_logf_va(__VA_ARGS__, _test_logf, _test_logf, _test_logf, _test_logf, _test_logf, _test_logf, _test_logf, _test_logf, _test_logf, _test_logf_none, 0)(__VA_ARGS__)
 #define _test_warn(message) _cspec_warn_fn(__LINE__, message)
 #define _test_fail(issue) do { _cspec_error_fn(issue); return; } while(0)
 
-#define _test_fail_args_va(S,fmt,A,a,B,b,C,c,D,d,E,e,F,f,G,g,H,h,I,i,J,j,...) _cspec_error_typed(__LINE__,S,fmt,A,a,B,b,C,c,D,d,E,e,F,f,G,g,H,h,I,i,J,j)
-#define _test_fail_args(S, /* fmt, */ ...) _test_fail_args_va(S,__VA_ARGS__,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0)
+#define _test_fail_args_va(S,fmt,A,Ai,a,B,Bi,b,C,Ci,c,D,Di,d,E,Ei,e,F,Fi,f,G,Gi,g,H,Hi,h,I,Ii,i,J,Ji,j,...) _cspec_error_typed(__LINE__,S,fmt,A,Ai,a,B,Bi,b,C,Ci,c,D,Di,d,E,Ei,e,F,Fi,f,G,Gi,g,H,Hi,h,I,Ii,i,J,Ji,j)
+#define _test_fail_args(S, /* fmt, */ ...) _test_fail_args_va(S,__VA_ARGS__,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0)
 
+#define _type_named(T) #T, type_id_named
+#ifdef _USE_DEDUCTION
+# define _type_all(T, X) #T, _type_id(X)
+#else
+# define _type_all(T, X) _type_named(T)
+#endif
 #define _test_fail_t(A, x, B, sTa, sTb) { _test_fail_args("expected "#A" "#x" "#B, "%n\nreceived {} "#x" {}", sTa, (void*)&_A, sTb, (void*)&_B); return; }
-#define _test_fail_all(S, T) {                                                                                                                          \
-  _test_fail_args("expected "S, NULL);                                                                                                                  \
-    if (_pvalue) {                                                                                                                                      \
-    if (_print_expected_value) _test_fail_args("", "but found {} on iteration {}\nexpecting {}", #T, (void*)_pvalue, "uint", &_index, #T, &_expected);  \
-    else                       _test_fail_args("", "but found {} on iteration {}",               #T, (void*)_pvalue, "uint", &_index);                  \
-    return;                                                                                                                                             \
-  } }                                                                                                                                                   //
+#define _test_fail_all(S, T) {                                                                                                                                                                \
+  _test_fail_args("expected "S, NULL);                                                                                                                                                        \
+    if (_pvalue) {                                                                                                                                                                            \
+    if (_print_expected_value) _test_fail_args("", "but found {} on iteration {}\nexpecting {}", _type_all(T, *(T*)_pvalue), (void*)_pvalue, "uint", type_id_uint, &_index, _type_all(T, _expected), &_expected);  \
+    else                       _test_fail_args("", "but found {} on iteration {}",               _type_all(T, *(T*)_pvalue), (void*)_pvalue, "uint", type_id_uint, &_index);                                               \
+    return;                                                                                                                                                                                   \
+  } }                                                                                                                                                                                         //
 
 #define _expect_fn_expr(S, F, x, B, P, ...)         typeof(F P) _R = (F P);   typeof(B) _B = (B);       _param_fn_def P if (!(_R x _B))   _test_fail_fn_expr(F, x, B, P)
 #define _expect_fn_comp(S, F, M, P, ...)            typeof(F P) _R = (F P);   csBool    _test = M(_R);  _param_fn_def P if (!_test)       _test_fail_fn_comp(S, P)
 #define _expect_fn_true(S, A, F, B, ...)            typeof(A)   _A = A;       typeof(B) _B = B;                         if (!(F(_A, _B))) _test_fail_fn_true(F, A, B)
 #define _expect_comp_all(S, A, E, B, x, T, F, ...)                            csBool    _test = F(A, B, E, x);          if (!_test)       _test_fail_all(S, T)
-#define _expect_type2(S, A, x, B, T, t, ...)        T           _A=(A);       t         _B=(B);                         if (!(_A x _B))   _test_fail_t(A, x, B, #T, #t)
-#define _expect_type1(S, A, x, B, T, ...)           T           _A=(A);       T         _B=(B);                         if (!(_A x _B))   _test_fail_t(A, x, B, #T, #T)
-#define _expect_expr(S, A, x, B, ...)               typeof(A)   _A=(A);       typeof(B) _B=(B);                         if (!(_A x _B))   _test_fail_t(A, x, B, _type_s(_A), _type_s(_B))
+#define _expect_type2(S, A, x, B, T, t, ...)        T           _A=(A);       t         _B=(B);                         if (!(_A x _B))   _test_fail_t(A, x, B, _type_named(T), _type_named(t))
+#define _expect_type1(S, A, x, B, T, ...)           T           _A=(A);       T         _B=(B);                         if (!(_A x _B))   _test_fail_t(A, x, B, _type_named(T), _type_named(T))
+#define _expect_expr(S, A, x, B, ...)               typeof(A)   _A=(A);       typeof(B) _B=(B);                         if (!(_A x _B))   _test_fail_t(A, x, B, _type_arg(_A), _type_arg(_B))
 #define _expect_comp(S, A, F, ...)                  typeof(A)   _Aout = (A);  csBool    _test = F(_Aout);               if (!_test)       _test_fail_comp(S)
 #define _expect_true(S, A, ...)                                                                                         if (!(A))         _test_fail("line "STR(__LINE__)": expected "S)
 #define _expect_va(S, U, V, W, X, Y, Z,_0,_1,_2, F, ...) do { _expect##F(S, U, V, W, X, Y, Z); } while(0)
@@ -951,14 +1389,28 @@ void    _cspec_error_typed(int line, const char* pfix, const char* fmt,
 #define _be_within_va(B_EXT, C_MID, MODE, T, T_RES, ...) _matcher_setup(B_EXT, C_MID, _be_type_##T_RES(T, T_RES)) _be_within_##MODE
 #define _be_within(B, ...) _be_within_va(B, __VA_ARGS__, inclusive, typeof(B), typeof(B))
 
+#define _match_bytes_cmp(A) (A); _test ^= _cspec_diff_bytes(__LINE__, _A, _B, _C)
+#define _match_bytes(B, N) FALSE; const void* _B = (B); csSize _C = (N); const void* _A = _match_bytes_cmp
+
 #define _all_comp_part(A, FOREACH, MATCHER, EXPECTED) FOREACH(_iter_all, _loop_all, A) { _test = MATCHER; if (!_test) { _index = _loop_all; _pvalue = _iter_all; EXPECTED break; } } _test ^= _tmp
 #define _all_comp(A, B, FOREACH, M)       _all_comp_part(A, FOREACH, M(*_iter_all), )
-#define _all_be_comp(A, B, FOREACH, x)    _all_comp_part(A, FOREACH, ((*_iter_all) x (B)),  _expected = (B);)
+#define _all_be_comp(A, B, FOREACH, x)    _all_be_part(A, B, FOREACH, x, _all_be_eq(x))
+
+// Comparing with == keeps the pairs from the first failure on for a diff, along with the last few elements that matched before it
+#define _all_be_eq(x) (#x[0] == '=' && #x[1] == '=' && !#x[2])
+#define _all_be_lead_max 3
+#define _all_be_part(A, B, FOREACH, x, EQ) FOREACH(_iter_all, _loop_all, A) { _expected = (B); _test = ((*_iter_all) x _expected);           \
+    if (!_test && !_pvalue) { _index = _loop_all; _pvalue = _iter_all; if (_tmp || !EQ) break; _all_be_lead(sizeof(_expected)) }           \
+    if (!_pvalue) { if (EQ) _lead[_loop_all % _all_be_lead_max] = _iter_all; }                                                             \
+    else if (!_cspec_diff_push(_iter_all, &_expected, sizeof(_expected))) break; }                                                         \
+  if (_pvalue) { _test = FALSE; if (!_tmp && EQ) _cspec_diff_failed(__LINE__, _index, &_expected, sizeof(_expected)); } _test ^= _tmp    //
+#define _all_be_lead(N) long long _first = _index < _all_be_lead_max ? 0 : _index - _all_be_lead_max; _cspec_diff_items(_first);            \
+    for (long long _k = _first; _k < _index; ++_k) _cspec_diff_push(_lead[_k % _all_be_lead_max], _lead[_k % _all_be_lead_max], N);      //
 #define _all_match_comp(A, B, FOREACH, F) _all_comp_part(A, FOREACH, F(*_iter_all, B),      _expected = B;)
 
 #define _all_setup(T) FALSE; csBool _tmp = _test; long long _index = 0; void* _pvalue = NULL; T _expected; csBool _print_expected_value = FALSE
 #define _all(M, T_el, T_con, ...)                   _all_setup(T_el);                                 T_el* T_con##_foreach_index, 0, M, T_el, _all_comp
-#define _all_be(x, B, T_el, T_con)                  _all_setup(T_el);   _print_expected_value = TRUE; T_el* T_con##_foreach_index, B, x, T_el, _all_be_comp
+#define _all_be(x, B, T_el, T_con)                  _all_setup(T_el);   _print_expected_value = TRUE; T_el* _lead[_all_be_lead_max]; T_el* T_con##_foreach_index, B, x, T_el, _all_be_comp
 #define _all_match(F, B, T_el, T_con, ...)          _all_setup(T_el);   _print_expected_value = TRUE; T_el* T_con##_foreach_index, B, F, T_el, _all_match_comp
 #define _all_match2(F, B, T_el, T_arg, T_con, ...)  _all_setup(T_arg);  _print_expected_value = TRUE; T_el* T_con##_foreach_index, B, F, T_el, _all_match_comp
 
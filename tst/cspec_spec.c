@@ -28,6 +28,17 @@
 # include <stdlib.h>
 #endif
 
+#ifdef open
+# include <errno.h>
+# include <fcntl.h>
+# include <pthread.h>
+# include <stdio.h>
+# include <sys/mman.h>
+# include <sys/socket.h>
+# include <sys/uio.h>
+# include <unistd.h>
+#endif
+
 describe(deduction) {
 
   // ignore these tests if not >= C11
@@ -72,6 +83,29 @@ describe(deduction) {
     expected = "char[]";
   }
 
+  it("resolves a type id") {
+    expect(_type_id(x) == type_id_int);
+  }
+
+  it("resolves type ids for pointers and arrays") {
+    int* px = &x; (void)px;
+    int arr[] = { 1, 2 }; (void)arr;
+    expect(_type_id(px) == type_id_pointer);
+    expect(_type_id(arr) == type_id_array);
+  }
+
+  it("resolves type ids for strings") {
+    char* str = "str"; (void)str;
+    typeof("str") lit = "str"; (void)lit;
+    expect(_type_id(str) == type_id_string);
+    expect(_type_id(lit) == type_id_char_array);
+  }
+
+  it("leaves other types to be resolved by name") {
+    struct { int a; } s = { 0 }; (void)s;
+    expect(_type_id(s) == type_id_named);
+  }
+
   /*
   it("checks size_t") {
     size_t s = sizeof(size_t);
@@ -133,6 +167,25 @@ describe(tests) {
     //*/
   }
 
+  context("logging values") {
+    static int evaluated = 0;
+    test_logf("set up {} times before this", evaluated++);
+
+    it("logs values with test_logf (only visible with -vn or higher)") {
+      double ratio = 0.25;
+      test_logf("ratio {} after {} iterations of {}", ratio, 12, "search");
+    }
+
+    it("logs a format with no values") {
+      test_logf("plain text, with no values");
+      test_notef("and another");
+    }
+
+    it("doesn't evaluate values for a line that won't be logged again") {
+      expect(evaluated <= 1);
+    }
+  }
+
 }
 #ifdef _MSC_VER
 #pragma warning ( pop )
@@ -213,6 +266,16 @@ describe(memory) {
       free(buffer);
     }
 
+    it("patterns new allocations at the fence level") {
+      expect(memory_level(fence));
+      unsigned char* buffer = malloc(8);
+      expect(buffer != NULL);
+      for (int i = 0; i < 8; ++i) {
+        expect(buffer[i] != 0);
+      }
+      free(buffer);
+    }
+
     it("ensures calloc returns zero-initialized memory") {
       int* buffer = calloc(5, sizeof(int));
       for (int i = 0; i < 5; ++i) {
@@ -221,6 +284,113 @@ describe(memory) {
       free(buffer);
     }
 
+    it("grows the most recent allocation in place without copying") {
+      expect(arena_memory);
+      char* buffer = malloc(4);
+      buffer = realloc(buffer, 12);
+      expect(buffer != NULL);
+      expect(realloc_copied_bytes, == , 0, csSize);
+      expect(realloc_grown_bytes, == , 8, csSize);
+      free(buffer);
+    }
+
+    it("copies the contents when reallocating an older block") {
+      expect(arena_memory);
+      char* buffer = malloc(4);
+      char* other = malloc(4);
+      cspec_memcpy(buffer, "abc", 4);
+      buffer = realloc(buffer, 8);
+      expect(buffer to match("abc", cspec_strcmp));
+      expect(realloc_copied_bytes, == , 4, csSize);
+      free(buffer);
+      free(other);
+    }
+
+    it("copies a linear amount of memory when growing geometrically") {
+      csSize final_size = 256;
+      char* buffer = NULL;
+      for (csSize capacity = 1; capacity <= final_size; capacity *= 2) {
+        buffer = realloc(buffer, capacity);
+        free(malloc(1)); /* keeps the buffer from being the last block */
+      }
+      expect(realloc_copied_bytes, <= , 2 * final_size);
+      free(buffer);
+    }
+
+    it("tracks large allocations on the heap") {
+      expect(heap_memory);
+      expect(memory_level(track));
+      csSize size = 1024 * 1024;
+      char* buffer = malloc(size);
+      expect(buffer != NULL);
+      buffer[0] = '!';
+      buffer[size - 1] = '!';
+      buffer = realloc(buffer, size * 4);
+      expect(buffer[size - 1], == , '!', char);
+      free(buffer);
+      expect(malloc_count == 1);
+      expect(free_count == 1);
+    }
+
+    it("estimates allocated bytes from a sample of allocations") {
+      expect(sample_allocs(256));
+      for (int i = 0; i < 64; ++i) {
+        free(malloc(32));
+      }
+      expect(sampled_bytes to be_within(1024 of 2048));
+    }
+
+    it("only counts allocations at the count level") {
+      expect(memory_level(count));
+      char* buffer = malloc(5);
+      expect(buffer != NULL);
+      expect(malloc_count == 1);
+      free(buffer);
+      expect(free_count == 1);
+    }
+
+    it("counts resizing a block to nothing as a free at the count level") {
+      expect(memory_level(count));
+      char* buffer = malloc(5);
+      expect(buffer != NULL);
+      buffer = realloc(buffer, 0);
+      expect(buffer == NULL);
+      expect(malloc_count == 1);
+      expect(free_count == 1);
+    }
+
+    it("counts a block once wherever realloc moves it at the count level") {
+      expect(memory_level(count));
+      char* buffer = malloc(5);
+      buffer = realloc(buffer, 4096);
+      expect(buffer != NULL);
+      buffer = realloc(buffer, 8192);
+      free(buffer);
+      expect(malloc_count == 1);
+      expect(free_count == 1);
+    }
+
+    it("tracks allocations without patterning them") {
+      expect(memory_level(track));
+      char* buffer = malloc(5);
+      expect(buffer != NULL);
+      buffer = realloc(buffer, 10);
+      expect(realloc_grown_bytes, == , 5, csSize);
+      free(buffer);
+    }
+
+    it("allocates against a guard page") {
+      expect(memory_level(guard));
+      char* buffer = malloc(5);
+      expect(buffer != NULL);
+      expect((csSize)buffer % 16, == , 0, csSize);
+      for (int i = 0; i < 5; ++i) {
+        buffer[i] = '!';
+      }
+      expect(buffer[0], == , '!', char);
+      free(buffer);
+    }
+
   }
 
   context("tests fail due to memory errors") {
@@ -233,6 +403,40 @@ describe(memory) {
       const char* c_array_foreach_index(pc, i, copystr) test_mem[i] = *pc;
     }
 
+    it("overruns a block on the heap") {
+      expect(heap_memory);
+      expect(memory_level(fence));
+      char* buffer = malloc(5000);
+      expect(buffer != NULL);
+      buffer[5000] = '!';
+      free(buffer);
+    }
+
+    it("double-frees a block on the heap") {
+      expect(heap_memory);
+      expect(memory_level(track));
+      char* buffer = malloc(5000);
+      free(buffer);
+      free(buffer);
+    }
+
+    it("double-frees while only counting, leaving another block leaked") {
+      expect(memory_level(count));
+      char* buffer = malloc(5);
+      char* leaked = malloc(5);
+      expect(leaked != NULL);
+      free(buffer);
+      free(buffer);
+      expect(malloc_count == 2);
+      expect(free_count == 1);
+    }
+
+    it("leaks memory while only tracking allocations") {
+      expect(memory_level(track));
+      char* buffer = malloc(5);
+      expect(buffer != NULL);
+    }
+
 #ifdef malloc
     it("passes a bad pointer to realloc") {
       char* buffer = realloc((void*)1, 5);
@@ -306,175 +510,1679 @@ describe(memory) {
 #pragma warning ( pop )
 #endif
 
-describe(contexts) {
-
+#ifdef CSPEC_STACK_SIZE
+/* Uses a fixed-size frame per call, so deeper recursion uses more stack */
+static int stack_recurse(int depth) {
+  volatile char frame[256];
+  frame[0] = (char)depth;
+  return depth ? stack_recurse(depth - 1) + frame[0] : 0;
 }
-
-#ifndef PI
-#define PI 3.1415926535897932384626f
 #endif
 
-describe(expect_basic) {
+describe(stack) {
 
-  const char* str = "Test string";
+#ifndef CSPEC_STACK_SIZE
 
-  context("using the basic format without commas") {
+  it("does not run stack tests when CSPEC_STACK_SIZE is not defined") {
+    test_log("Not doing any stack tests because CSPEC_STACK_SIZE is not");
+    test_log("defined. Build with -DCSPEC_STACKTEST=ON, or run the tests");
+    test_log("with --stack-size <KB> to measure stack usage.");
+  }
 
-    context("tests succeed") {
+#else
 
-      test("most basic equality check") {
-        expect(2 == 2);
-      }
+  it("measures the stack used by the test") {
+    stack_recurse(8);
+    expect(stack_usage, >=, 8u * 256);
+    expect(stack_usage, <, cspec_kb(16u));
+  }
 
-      test("boolean (aka, macroed) values") {
-        expect(TRUE != FALSE);
-      }
+  it("measures deeper calls as using more stack") {
+    stack_recurse(4);
+    csSize shallow = stack_usage;
+    stack_recurse(32);
+    expect(stack_usage, >=, shallow + 28u * 256);
+  }
 
-      test("float macro value") {
-        expect(PI > 1);
-      }
+  context("after setup that used a lot of stack") {
+    stack_recurse(32);
 
-      test("using other operator") {
-        expect(2 < 3);
-      }
+    it("only counts stack used after the test began") {
+      stack_recurse(1);
+      expect(stack_usage, >=, 256u);
+      expect(stack_usage, <, 8u * 256);
+    }
+  }
 
-      test("string compare") {
-        expect(cspec_strcmp(str, "Test string"));
-      }
+#endif
 
-      test("more string funcs") {
-        expect(cspec_strrstr(str, "string"));
-      }
+}
 
-    }
+#ifdef open
+static void* resource_thread_fn(void* arg) {
+  return arg;
+}
 
-    context("tests fail") {
+static void* resource_trylock_fn(void* mutex) {
+  if (!pthread_mutex_trylock(mutex)) {
+    pthread_mutex_unlock(mutex);
+  }
+  return NULL;
+}
 
-      expect(to_fail);
+typedef struct ResourceLockWait {
+  pthread_mutex_t mutex;
+  int started;
+} ResourceLockWait;
+
+/* Says it's about to lock, so the test knows it's waiting on the lock */
+static void* resource_lock_fn(void* arg) {
+  ResourceLockWait* wait = arg;
+  __atomic_store_n(&wait->started, 1, __ATOMIC_RELEASE);
+  pthread_mutex_lock(&wait->mutex);
+  pthread_mutex_unlock(&wait->mutex);
+  return NULL;
+}
 
-      test("most basic equality check") {
-        expect(2 == 3);
-      }
+/* Ends while holding the lock */
+static void* resource_lock_abandon_fn(void* mutex) {
+  pthread_mutex_lock(mutex);
+  return NULL;
+}
+#endif
 
-      test("boolean (aka, macroed) values") {
-        expect(TRUE == FALSE);
-      }
+describe(resources) {
 
-      test("float macro value") {
-        expect(PI < 1);
-      }
+#ifndef open
 
-      test("using other operator") {
-        expect(2 > 3);
-      }
+  it("does not run resource tests when open is not defined") {
+    test_log("Not doing any resource tests because open has not been defined");
+    test_log("To track descriptors, mappings and threads left open by a test,");
+    test_log("use -Dopen=cspec_open and the same for close, socket, fopen,");
+    test_log("fclose, mmap, munmap, pthread_create, pthread_join, and");
+    test_log("pthread_detach.");
+  }
 
-      test("string compare") {
-        expect(cspec_strcmp(str, "Something"));
-      }
+#else
 
-      test("more string funcs") {
-        expect(cspec_strrstr(str, "strin"));
-      }
+  context("tests succeed") {
+
+    it("tracks a file descriptor until it's closed") {
+      int fd = open("/dev/null", O_RDONLY);
+      expect(fd >= 0);
+      expect(fds_open == 1);
+      close(fd);
+      expect(fds_open == 0);
+    }
+
+    it("tracks sockets as file descriptors") {
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      expect(fds_open == 1);
+      close(fd);
+    }
+
+    it("tracks FILE streams until they're closed") {
+      FILE* file = fopen("/dev/null", "r");
+      expect(files_open == 1);
+      fclose(file);
+      expect(files_open == 0);
+    }
+
+    it("tracks a mapping through partial unmaps") {
+      size_t page = (size_t)sysconf(_SC_PAGESIZE);
+      char* map = mmap(NULL, page * 3, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0
+      );
+      expect(maps_open == 1);
+      munmap(map + page, page);
+      expect(maps_open == 2);
+      munmap(map, page);
+      munmap(map + page * 2, page);
+      expect(maps_open == 0);
+    }
+
+    it("tracks threads until they're joined") {
+      pthread_t thread;
+      pthread_create(&thread, NULL, resource_thread_fn, NULL);
+      expect(threads_open == 1);
+      pthread_join(thread, NULL);
+      expect(threads_open == 0);
+    }
+
+    it("counts system calls made by the test") {
+      int fd = open("/dev/null", O_WRONLY);
+      expect(write(fd, "a", 1) == 1);
+      expect(write(fd, "b", 1) == 1);
+      expect(syscall_count(write) == 2);
+      expect(syscall_count(read) == 0);
+      close(fd);
+    }
+
+    it("counts a gathered write as a single call") {
+      int fd = open("/dev/null", O_WRONLY);
+      struct iovec parts[] = { { "a", 1 }, { "b", 1 } };
+      expect(writev(fd, parts, 2) == 2);
+      expect(syscall_count(writev), ==, 1);
+      expect(syscall_count(write), ==, 0);
+      close(fd);
+    }
+
+    it("counts lock acquisitions") {
+      pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+      pthread_mutex_lock(&mutex);
+      pthread_mutex_unlock(&mutex);
+      pthread_mutex_lock(&mutex);
+      pthread_mutex_unlock(&mutex);
+      expect(lock_acquisitions, ==, 2);
+      expect(lock_contentions, ==, 0);
+    }
+
+    it("counts a lock found already held as contended") {
+      pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+      pthread_t thread;
+      pthread_mutex_lock(&mutex);
+      pthread_create(&thread, NULL, resource_trylock_fn, &mutex);
+      pthread_join(thread, NULL);
+      pthread_mutex_unlock(&mutex);
+      expect(lock_acquisitions, ==, 1);
+      expect(lock_contentions, ==, 1);
+    }
+
+    it("waits for a lock that's held, and counts it as contended") {
+      ResourceLockWait wait = { PTHREAD_MUTEX_INITIALIZER, 0 };
+      pthread_t thread;
+      pthread_mutex_lock(&wait.mutex);
+      pthread_create(&thread, NULL, resource_lock_fn, &wait);
+      while (!__atomic_load_n(&wait.started, __ATOMIC_ACQUIRE));
+      usleep(20000);
+      pthread_mutex_unlock(&wait.mutex);
+      pthread_join(thread, NULL);
+      expect(lock_acquisitions, ==, 2);
+      expect(lock_contentions, ==, 1);
+    }
+
+#ifdef __linux__
+    it("takes a robust lock its owner ended with, without waiting on it") {
+      pthread_mutexattr_t attr;
+      pthread_mutexattr_init(&attr);
+      pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+      pthread_mutex_t mutex;
+      pthread_mutex_init(&mutex, &attr);
+      pthread_mutexattr_destroy(&attr);
+
+      pthread_t thread;
+      pthread_create(&thread, NULL, resource_lock_abandon_fn, &mutex);
+      pthread_join(thread, NULL);
+      expect(pthread_mutex_lock(&mutex), ==, EOWNERDEAD);
+      pthread_mutex_consistent(&mutex);
+      pthread_mutex_unlock(&mutex);
+      pthread_mutex_destroy(&mutex);
+      expect(lock_acquisitions, ==, 2);
+      expect(lock_contentions, ==, 0);
+    }
+#endif
+  }
 
+  context("tests fail") {
+
+    it("leaves a file descriptor open") {
+      expect(to_fail);
+      int fd = open("/dev/null", O_RDONLY);
+      expect(fd >= 0);
     }
 
+    it("leaves a FILE stream and a mapping open") {
+      expect(to_fail);
+      FILE* file = fopen("/dev/null", "r");
+      void* map = mmap(NULL, 100, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      expect(file != NULL);
+      expect(map != MAP_FAILED);
+    }
   }
 
+#endif
+
 }
 
-describe(expect_deduced_triplet) {
+#ifdef open
+static void thread_expect_one(int value) {
+  expect(value, ==, 1);
+}
 
-  float pi = PI;
+static void* thread_expect_fn(void* value) {
+  thread_expect_one(*(int*)value);
+  return NULL;
+}
 
-  context("using the basic format but with commas") {
+static void* thread_expect_many_fn(void* value) {
+  for (int i = 0; i < 1000; ++i) {
+    thread_expect_one(*(int*)value);
+  }
+  return NULL;
+}
 
-    context("tests succeed") {
+static void thread_fail(void) {
+  test_fail("failed from another thread");
+}
 
-      test("most basic equality check") {
-        expect(2, == , 2);
-      }
+static void* thread_fail_fn(void* arg) {
+  thread_fail();
+  return arg;
+}
+#endif
 
-      test("boolean (aka, macroed) values") {
-        expect(TRUE, != , FALSE);
-      }
+describe(threads) {
 
-      test("float macro value") {
-        expect(PI, > , 1);
-      }
+#ifndef open
 
-      test("float variable value") {
-        expect(pi, > , 1);
-      }
+  it("does not run thread tests when open is not defined") {
+    test_log("Threads need pthread, which is only linked for resource tests");
+  }
 
-      test("using other operator") {
-        expect(2, < , 3);
-      }
+#else
 
-      /* Might fail, might not, depends on how your compiler feels that day :P
-      test("comparing strings by address") {
-        const char* a = "indeterminate";
-        const char* b = "indeterminate";
-        expect(a, == , b);
-      } //*/
+  context("tests succeed") {
 
+    it("passes expectations made in another thread") {
+      int value = 1;
+      pthread_t thread;
+      pthread_create(&thread, NULL, thread_expect_fn, &value);
+      pthread_join(thread, NULL);
     }
 
-    context("tests fail") {
+  }
 
+  context("tests fail") {
+
+    it("fails from an expectation in another thread") {
       expect(to_fail);
+      int value = 2;
+      pthread_t thread;
+      pthread_create(&thread, NULL, thread_expect_fn, &value);
+      pthread_join(thread, NULL);
+    }
 
-      test("most basic equality check") {
-        expect(2, == , 3);
-      }
+    it("fails from test_fail in another thread") {
+      expect(to_fail);
+      pthread_t thread;
+      pthread_create(&thread, NULL, thread_fail_fn, NULL);
+      pthread_join(thread, NULL);
+    }
 
-      test("most basic equality check (with vars)") {
-        int A = 2, B = 3;
-        expect(A, == , B);
+    it("fails from many threads expecting at once") {
+      expect(to_fail);
+      int value = 2;
+      pthread_t threads[4];
+      for (int i = 0; i < 4; ++i) {
+        pthread_create(&threads[i], NULL, thread_expect_many_fn, &value);
       }
-
-      test("float macro value (compare with output in expect_basic)") {
-        expect(PI, < , 1);
+      for (int i = 0; i < 4; ++i) {
+        pthread_join(threads[i], NULL);
       }
+    }
+  }
 
-      test("float variable value (compare with output in expect_basic)") {
-        expect(pi, < , 1);
-      }
+#endif
 
-      test("boolean (aka, macroed) values (compare with output in expect_basic)") {
-        expect(TRUE, == , FALSE);
-      }
+}
 
-      test("using other operator") {
-        expect(2, > , 3);
-      }
+describe(fixtures) {
+  static int setup_runs = 0;
 
-      test("using other operator (with var)") {
-        double first = 2.0, second = 3.0;
-        expect(first, > , second);
-      }
+  context("with a fixture") {
+    int value = 0;
+    fixture_data(value);
 
-      test("comparing strings by address") {
-        const char* a = "this is";
-        const char* b = "not this";
-        expect(a, == , b);
-      }
+    fixture {
+      ++setup_runs;
+      value = 42;
+    }
+
+    it("runs the fixture for the first test") {
+      expect(value == 42);
+      expect(setup_runs == 1);
+    }
 
+    it("restores the fixture for later tests instead of running it") {
+      expect(value == 42);
+      value = 7;
+      expect(setup_runs == 1);
     }
 
+    it("isn't affected by changes made in earlier tests") {
+      expect(value == 42);
+    }
   }
 
-}
+#ifdef malloc
 
-describe(expect_basic_var_output) {
+  context("with a fixture that allocates") {
+    char* text = NULL;
+    fixture_data(text);
 
-  int incrementor = 1;
-  float pi = PI;
+    fixture {
+      text = malloc(6);
+      cspec_memcpy(text, "hello", 6);
+    }
 
-  context("basic comparison expectations with value output") {
-    float x = 0.5;
+    it("can read what the fixture allocated") {
+      expect(text to match("hello", cspec_strcmp));
+      free(text);
+    }
 
-    context("tests succeed") {
-      x = 10;
+    it("gets the allocation back after an earlier test freed it") {
+      expect(text to match("hello", cspec_strcmp));
+      free(text);
+    }
+  }
+
+#endif
+}
+
+/* Counts the events it gets, to see what reaches a reporter added mid-run */
+typedef struct ReportCounts {
+  int contexts;
+  int tests_begun;
+  int tests_ended;
+  int depth;
+  int line;
+  csBool named;
+} ReportCounts;
+
+static ReportCounts report_counts;
+
+static void count_context(void* data, const ReportEvent* event) {
+  (void)event;
+  ++((ReportCounts*)data)->contexts;
+}
+
+static void count_test_begin(void* data, const ReportEvent* event) {
+  ReportCounts* counts = data;
+  ++counts->tests_begun;
+  counts->depth = event->depth;
+  counts->line = event->line;
+  counts->named = cspec_strcmp(event->group, "reporters") && cspec_strcmp(
+    event->path[event->depth - 1], "it receives the events that follow"
+  );
+}
+
+static void count_test_end(void* data, const ReportEvent* event) {
+  (void)event;
+  ++((ReportCounts*)data)->tests_ended;
+}
+
+static const Reporter counting_reporter = {
+  .context_begin = count_context,
+  .test_begin = count_test_begin,
+  .test_end = count_test_end,
+  .data = &report_counts,
+};
+
+describe(reporters) {
+
+  it("adds a reporter to the run") {
+    expect(cspec_add_reporter(&counting_reporter));
+    expect(cspec_add_reporter(&counting_reporter), == , FALSE);
+  }
+
+  context("after a reporter is added") {
+
+    it("receives the events that follow") {
+      expect(report_counts.tests_ended, == , 1);
+      expect(report_counts.contexts, == , 1);
+      expect(report_counts.tests_begun, == , 1);
+      expect(report_counts.depth, == , 2);
+      expect(report_counts.line, == , __LINE__ - 5);
+      expect(report_counts.named);
+    }
+
+    it("can be removed again") {
+      expect(cspec_remove_reporter(&counting_reporter));
+      expect(cspec_remove_reporter(&counting_reporter), == , FALSE);
+    }
+
+  }
+
+  it("doesn't get events once removed") {
+    expect(report_counts.tests_begun, == , 2);
+    expect(report_counts.tests_ended, == , 2);
+  }
+
+}
+
+/*
+* A test can run a small suite of its own as if it were a separate test program
+* started with the given arguments, to check what a whole run does. It runs in
+* a child process so this run is left alone, and its console output is kept.
+*/
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(__WASM__)
+# define SPEC_NESTED_RUNS
+# include <signal.h>
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <sys/wait.h>
+# include <unistd.h>
+#endif
+
+#ifdef SPEC_NESTED_RUNS
+
+typedef struct NestedRun {
+  int tests;          /* -1 if the run never got to its summary */
+  int passed;
+  int failed;         /* the exit status, as the test program would return */
+  int warnings;
+  const char* output; /* everything it printed to the console */
+} NestedRun;
+
+static char nested_output[1 << 18];
+static NestedRun nested = { .output = nested_output };
+static int nested_pipe = -1;
+
+static void nested_summary(void* data, const ReportEvent* event) {
+  int counts[3] = { event->tests, event->passed, event->warnings };
+  (void)!write(*(int*)data, counts, sizeof(counts));
+}
+
+static const Reporter nested_reporter = {
+  .summary = nested_summary,
+  .data = &nested_pipe,
+};
+
+/* argv is NULL-terminated, and starts with the program name */
+static void nested_run(TestSuite* suite, char* argv[]) {
+  int argc = 0;
+  while (argv[argc]) ++argc;
+
+  nested.tests = -1;
+  nested.passed = nested.failed = nested.warnings = 0;
+  nested_output[0] = '\0';
+
+  int fds[2];
+  FILE* out = tmpfile();
+  if (!out) return;
+  if (pipe(fds)) {
+    fclose(out);
+    return;
+  }
+
+  /* so the child doesn't write out what this run had waiting again */
+  fflush(NULL);
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    dup2(fileno(out), STDOUT_FILENO);
+    nested_pipe = fds[1];
+    cspec_add_reporter(&nested_reporter);
+    TestSuite* suites[] = { suite };
+    int failed = _cspec_run_all(1, suites, argc, argv);
+    fflush(stdout);
+    _exit(failed);
+  }
+
+  close(fds[1]);
+  int counts[3];
+  if (pid > 0 && read(fds[0], counts, sizeof(counts)) == sizeof(counts)) {
+    nested.tests = counts[0];
+    nested.passed = counts[1];
+    nested.warnings = counts[2];
+  }
+  close(fds[0]);
+
+  int status = 0;
+  if (pid > 0) waitpid(pid, &status, 0);
+  nested.failed = pid > 0 && WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+
+  rewind(out);
+  size_t size = fread(nested_output, 1, sizeof(nested_output) - 1, out);
+  nested_output[size] = '\0';
+  fclose(out);
+}
+
+static csBool text_has(const char* text, const char* part) {
+  return strstr(text, part) != NULL;
+}
+
+static int text_count(const char* text, const char* part) {
+  int count = 0;
+  csSize length = strlen(part);
+  while ((text = strstr(text, part))) {
+    ++count;
+    text += length;
+  }
+  return count;
+}
+
+/* Checks that the lines are printed one after another, at the same indent */
+static csBool text_has_lines(const char* text, const char* lines) {
+  char first[128];
+  csSize length = strcspn(lines, "\n");
+  if (length >= sizeof(first)) return FALSE;
+  cspec_memcpy(first, lines, length);
+  first[length] = '\0';
+
+  for (const char* at = strstr(text, first); at; at = strstr(at + 1, first)) {
+    const char* start = at;
+    while (start > text && start[-1] != '\n') --start;
+    csSize indent = (csSize)(at - start);
+    const char* want = lines;
+    const char* got = at;
+    for (;;) {
+      length = strcspn(want, "\n");
+      if (strncmp(got, want, length) || (got[length] && got[length] != '\n')) {
+        break;
+      }
+      if (!want[length]) return TRUE;
+      want += length + 1;
+      got += length + 1;
+      if (strspn(got, " ") < indent) break;
+      got += indent;
+    }
+  }
+  return FALSE;
+}
+
+/* Checks that every span in a trace ends, and none ends before it begins */
+static csBool spans_nest(const char* json) {
+  int depth = 0;
+  for (; (json = strstr(json, "\"ph\":\"")); json += 6) {
+    if (json[6] == 'B') ++depth;
+    if (json[6] == 'E' && --depth < 0) return FALSE;
+  }
+  return depth == 0;
+}
+
+/* Creates a file for a nested run to write to, path ends in XXXXXX */
+static void nested_temp(char* path) {
+  int fd = mkstemp(path);
+  if (fd >= 0) close(fd);
+}
+
+static char nested_file[1 << 16];
+
+/* Reads back a file the nested run wrote, and removes it */
+static const char* nested_read(const char* path) {
+  nested_file[0] = '\0';
+  FILE* file = fopen(path, "r");
+  if (file) {
+    size_t size = fread(nested_file, 1, sizeof(nested_file) - 1, file);
+    nested_file[size] = '\0';
+    fclose(file);
+  }
+  unlink(path);
+  return nested_file;
+}
+
+/* A few groups of 1, 2 and 3 tests, with one failure, to run in nested runs */
+describe(sample_one) {
+
+  it("passes") {
+    expect(1 == 1);
+  }
+
+}
+
+describe(sample_two) {
+
+  it("passes") {
+    expect(2 == 2);
+  }
+
+  it("fails") {
+    expect(2, == , 3);
+  }
+
+}
+
+describe(sample_three) {
+
+  context("in a context") {
+
+    it("passes first") {
+      expect(3 == 3);
+    }
+
+    it("passes second") {
+      expect(3 > 2);
+    }
+
+  }
+
+  it("passes outside the context") {
+    expect(3 < 4);
+  }
+
+}
+
+test_suite(tests_sample) {
+  test_group(sample_one),
+  test_group(sample_two),
+  test_group(sample_three),
+  test_suite_end
+};
+
+/* Prints from its tests, to see where cspec's own lines end up around them */
+static char output_long_line[150000];
+
+describe(output_sample) {
+
+  it("passes before the test that prints") {
+    expect(TRUE);
+  }
+
+  it("prints from the test") {
+    printf("printed by the test\n");
+    expect(TRUE);
+  }
+
+  it("logs a line longer than the output buffer") {
+    csSize size = sizeof(output_long_line) - 1;
+    cspec_memset(output_long_line, 'x', size);
+    cspec_memcpy(output_long_line + size - 4, "end", 4);
+    test_log(output_long_line);
+  }
+
+}
+
+describe(crash_sample) {
+
+  it("logs, and then crashes") {
+    test_log("logged before the crash");
+    raise(SIGSEGV);
+  }
+
+}
+
+test_suite(tests_output_sample) {
+  test_group(output_sample),
+  test_suite_end
+};
+
+test_suite(tests_crash_sample) {
+  test_group(crash_sample),
+  test_suite_end
+};
+
+#ifdef open
+
+static void* thread_sample_log_fn(void* message) {
+  test_log(message);
+  return NULL;
+}
+
+static void* thread_sample_warn_fn(void* message) {
+  test_warn(message);
+  return NULL;
+}
+
+static void* thread_sample_many_fn(void* arg) {
+  int thread = *(int*)arg;
+  for (int i = 0; i < 8; ++i) {
+    test_logf("thread {} message {}", thread, i);
+  }
+  return NULL;
+}
+
+/* Never stops, so it's still warning while the run ends and exits */
+static void* thread_sample_endless_fn(void* arg) {
+  (void)arg;
+  for (;;) test_warn("from a thread that wasn't joined");
+  return NULL;
+}
+
+static void thread_sample_run(void* (*fn)(void*), void* arg) {
+  pthread_t thread;
+  pthread_create(&thread, NULL, fn, arg);
+  pthread_join(thread, NULL);
+}
+
+describe(thread_sample) {
+
+  it("logs and warns from threads") {
+    test_log("first, from the test");
+    thread_sample_run(thread_sample_log_fn, "second, from a thread");
+    thread_sample_run(thread_sample_warn_fn, "third, a warning from a thread");
+    thread_sample_run(thread_sample_log_fn, "fourth, from another thread");
+    test_log("fifth, from the test");
+  }
+
+  it("logs from threads running at once") {
+    int ids[4] = { 0, 1, 2, 3 };
+    pthread_t threads[4];
+    for (int i = 0; i < 4; ++i) {
+      pthread_create(&threads[i], NULL, thread_sample_many_fn, &ids[i]);
+    }
+    for (int i = 0; i < 4; ++i) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+
+  it("leaves a thread warning after the test ends") {
+    pthread_t thread;
+    pthread_create(&thread, NULL, thread_sample_endless_fn, NULL);
+    pthread_detach(thread);
+  }
+
+}
+
+test_suite(tests_thread_sample) {
+  test_group(thread_sample),
+  test_suite_end
+};
+
+#endif
+
+static int diff_sample_calls = 0;
+
+static int diff_sample_expected(const int* values, csUint n) {
+  ++diff_sample_calls;
+  return values[n];
+}
+
+/* Letters from a fixed sequence, so the strings differ the same way each run */
+static void diff_sample_letters(char* out, csSize size, csSize seed) {
+  for (csSize i = 0; i + 1 < size; ++i) {
+    seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+    out[i] = "acgt"[(seed >> 33) % 4];
+  }
+  out[size - 1] = '\0';
+}
+
+static char diff_sample_a[4001];
+static char diff_sample_b[4001];
+static char diff_sample_long_a[70001]; /* longer than the report text */
+static char diff_sample_long_b[70001];
+
+describe(diff_sample) {
+
+  it("changes a line and adds one at the end") {
+    const char* lines = "first\nsecond\nthird\nfourth\nfifth\nsixth\n";
+    expect(lines to match("first\nsecond\nthird\n4th\nfifth\nsixth\nseventh\n", cspec_strcmp));
+  }
+
+  it("changes two lines far apart") {
+    const char* lines =
+      "1\n2\n3\n4\n5\n6\n7\n8\n9\n10\n11\n12\n13\n14\n15\n16\n17\n18\n";
+    expect(lines to match(
+      "1\n2\nthree\n4\n5\n6\n7\n8\n9\n10\n11\n12\n13\n14\nfifteen\n16\n17\n18\n",
+      cspec_strcmp
+    ));
+  }
+
+  it("compares containers with all_be") {
+    int arr[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12 };
+    int exp[] = { 1, 2, 4, 5, 6, 7, 8, 9, 10, 10, 11, 12 };
+    expect(arr to all_be( == , diff_sample_expected(exp, n), int, c_array));
+  }
+
+  it("compares bytes with all_be") {
+    csByte arr[] = { 0x41, 0x42, 0x43 };
+    csByte exp[] = { 0x41, 0x41, 0x43 };
+    expect(arr to all_be( == , exp[n], csByte, c_array));
+  }
+
+  it("compares containers with all_be, differing far into them") {
+    int arr[200], exp[200];
+    for (int i = 0; i < 200; ++i) arr[i] = exp[i] = i;
+    exp[150] = 0;
+    expect(arr to all_be( == , exp[n], int, c_array));
+  }
+
+  it("changes a character in strings longer than the report") {
+    diff_sample_letters(diff_sample_long_a, sizeof(diff_sample_long_a), 3);
+    cspec_memcpy(diff_sample_long_b, diff_sample_long_a, sizeof(diff_sample_long_a));
+    diff_sample_long_b[40000] = 'x';
+    const char* a = diff_sample_long_a;
+    expect(a to match((const char*)diff_sample_long_b, cspec_strcmp));
+  }
+
+  it("compared each element once") {
+    expect(diff_sample_calls, == , 12);
+  }
+
+  it("changes too many lines for one hunk") {
+    char a_[400] = "", b_[400] = "";
+    const char* a = a_;
+    for (int i = 0; i < 50; ++i) {
+      sprintf(a_ + strlen(a_), "a%d\n", i);
+      sprintf(b_ + strlen(b_), "b%d\n", i);
+    }
+    expect(a to match((const char*)b_, cspec_strcmp));
+  }
+
+  it("has too many changes to compare") {
+    diff_sample_letters(diff_sample_a, sizeof(diff_sample_a), 1);
+    diff_sample_letters(diff_sample_b, sizeof(diff_sample_b), 2);
+    const char* a = diff_sample_a;
+    expect(a to match((const char*)diff_sample_b, cspec_strcmp));
+  }
+
+}
+
+test_suite(tests_diff_sample) {
+  test_group(diff_sample),
+  test_suite_end
+};
+
+/* Each test fails to print a pair of floats, to check the digits printed */
+static const double float_sample_sum = 0.1 + 0.2;
+static const double float_sample_third = 1.0 / 3;
+
+describe(float_sample) {
+  double zero = 0.0;
+
+  it("prints floats with their own shortest digits") {
+    expect(0.1f, == , 0.3f, float);
+  }
+
+  it("prints the digits a double needs to read back the same") {
+    expect(float_sample_sum, == , float_sample_third, double);
+  }
+
+  it("prints very large and very small doubles with exponents") {
+    expect(1e300, == , 1e-300, double);
+  }
+
+  it("prints the smallest and largest doubles") {
+    expect(5e-324, == , 1.7976931348623157e308, double);
+  }
+
+  it("prints the largest and smallest normal floats") {
+    expect(3.4028235e38f, == , 1.17549435e-38f, float);
+  }
+
+  it("prints whole numbers and small fractions without exponents") {
+    expect(123456.0, == , 0.000125, double);
+  }
+
+  it("prints non-finite values") {
+    expect(zero / zero, == , -1.0 / zero, double);
+  }
+
+  it("prints negative zero") {
+    expect(-zero, == , 1.0 / zero, double);
+  }
+
+}
+
+test_suite(tests_float_sample) {
+  test_group(float_sample),
+  test_suite_end
+};
+
+/* Reads back the first event value that starts with the given digits */
+static double float_read(const char* text, const char* digits) {
+  char value[64];
+  snprintf(value, sizeof(value), "\"value\":\"%s", digits);
+  const char* at = strstr(text, value);
+  return at ? strtod(at + strlen("\"value\":\""), NULL) : 0.0;
+}
+
+/* Longer than the buffer an event is put together in */
+static char events_long[20001];
+
+describe(events_sample) {
+
+  it("prints, and then fails with a long value") {
+    printf("printed by the test\n");
+    cspec_memset(events_long, 'x', sizeof(events_long) - 1);
+    const char* value = events_long;
+    expect(value to match("short", cspec_strcmp));
+  }
+
+}
+
+test_suite(tests_events_sample) {
+  test_group(events_sample),
+  test_suite_end
+};
+
+#ifdef malloc
+
+/* A cache the code under test builds lazily, and grows with every use */
+static char* ledger_cache = NULL;
+static csSize ledger_cache_size = 0;
+
+static void ledger_cache_grow(void) {
+  ledger_cache_size += 64;
+  ledger_cache = realloc(ledger_cache, ledger_cache_size);
+}
+
+/* Allocated when each suite begins, outside of any test, and never freed */
+static void* ledger_suite_data = NULL;
+
+static void ledger_suite_begin(void* data, const ReportEvent* event) {
+  (void)data; (void)event;
+  ledger_suite_data = malloc(24);
+}
+
+static const Reporter ledger_reporter = {
+  .suite_begin = ledger_suite_begin,
+};
+
+describe(ledger_sample) {
+
+  it("counts what it frees while only counting") {
+    expect(memory_level(count));
+    char* buffer = malloc(5);
+    free(buffer);
+    expect(malloc_count == 1);
+    expect(free_count == 1);
+  }
+
+  it("grows the cache") {
+    expect(memory_level(off));
+    ledger_cache_grow();
+  }
+
+  it("grows the cache again") {
+    expect(memory_level(off));
+    ledger_cache_grow();
+  }
+
+  it("grows the cache a third time") {
+    expect(memory_level(off));
+    ledger_cache_grow();
+  }
+
+  it("grows the cache a fourth time") {
+    expect(memory_level(off));
+    ledger_cache_grow();
+  }
+
+}
+
+test_suite(tests_ledger_sample) {
+  test_group(ledger_sample),
+  test_suite_end
+};
+
+/* Allocated before main, as static initialization in a program would be */
+static char* global_early = NULL;
+
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+static void global_early_alloc(void) {
+  if (!global_early) global_early = malloc(40);
+}
+
+/* A cache built on first use, at the default memory level */
+static char* global_cache = NULL;
+
+static char* global_cache_get(void) {
+  if (!global_cache) global_cache = malloc(48);
+  return global_cache;
+}
+
+describe(global_sample) {
+
+  it("builds the cache on first use") {
+    global_cache_get()[0] = '!';
+  }
+
+  it("uses the cache it built") {
+    expect(global_cache_get()[0], == , '!', char);
+  }
+
+  it("grows the block from before the run") {
+    global_early_alloc();
+    global_early = realloc(global_early, 80);
+    expect(global_early != NULL);
+  }
+
+  it("frees the block from before the run") {
+    free(global_early);
+    global_early = NULL;
+  }
+
+}
+
+test_suite(tests_global_sample) {
+  test_group(global_sample),
+  test_suite_end
+};
+
+/* Warnings make the run's result yellow, so these only run in nested runs */
+describe(realloc_sample) {
+
+  it("grows a buffer by a constant amount") {
+    char* buffer = NULL;
+    for (csSize size = 1; size <= 8; ++size) {
+      buffer = realloc(buffer, size);
+    }
+    free(buffer);
+  }
+
+  it("grows a buffer geometrically") {
+    char* buffer = NULL;
+    for (csSize size = 1; size <= 128; size *= 2) {
+      buffer = realloc(buffer, size);
+    }
+    free(buffer);
+  }
+
+}
+
+test_suite(tests_realloc_sample) {
+  test_group(realloc_sample),
+  test_suite_end
+};
+
+describe(memory_error_sample) {
+
+  it("frees a pointer from the stack") {
+    int x = 0;
+    free(&x);
+  }
+
+  it("overruns a block") {
+    char* buffer = malloc(5);
+    for (int i = 0; i <= 5; ++i) {
+      buffer[i] = '!';
+    }
+    free(buffer);
+  }
+
+}
+
+test_suite(tests_memory_error_sample) {
+  test_group(memory_error_sample),
+  test_suite_end
+};
+
+#endif
+
+#endif
+
+describe(runs) {
+
+#ifndef SPEC_NESTED_RUNS
+
+  it("does not run nested suites without fork") {
+    test_log("Nested runs need a POSIX system to run in a child process");
+  }
+
+#else
+
+  context("after running a suite") {
+    nested_run(&tests_sample, (char*[]){ "sample", NULL });
+
+    it("gets the results of every test") {
+      expect(nested.tests, == , 6);
+      expect(nested.passed, == , 5);
+      expect(nested.failed, == , 1);
+    }
+
+    it("keeps what it printed") {
+      expect(nested.output to match("Tests passed:", text_has));
+    }
+  }
+
+  context("with --shard split in two") {
+    int tests[2], passed[2];
+    for (int i = 0; i < 2; ++i) {
+      char shard[8];
+      snprintf(shard, sizeof(shard), "%d/2", i + 1);
+      nested_run(&tests_sample, (char*[]){ "shard", "--shard", shard, NULL });
+      tests[i] = nested.tests;
+      passed[i] = nested.passed;
+    }
+
+    it("runs every other group in each shard") {
+      expect(tests[0], == , 4);
+      expect(tests[1], == , 2);
+    }
+
+    it("runs every test once between them") {
+      expect(tests[0] + tests[1], == , 6);
+      expect(passed[0] + passed[1], == , 5);
+    }
+  }
+
+  context("with --shard split in three") {
+    int tests[3], passed[3];
+    for (int i = 0; i < 3; ++i) {
+      char shard[8];
+      snprintf(shard, sizeof(shard), "%d/3", i + 1);
+      nested_run(&tests_sample, (char*[]){ "shard", "--shard", shard, NULL });
+      tests[i] = nested.tests;
+      passed[i] = nested.passed;
+    }
+
+    it("runs one group in each shard") {
+      expect(tests[0], == , 1);
+      expect(tests[1], == , 2);
+      expect(tests[2], == , 3);
+    }
+
+    it("runs every test once between them") {
+      expect(tests[0] + tests[1] + tests[2], == , 6);
+      expect(passed[0] + passed[1] + passed[2], == , 5);
+    }
+  }
+
+  context("with --shard 0/2") {
+    nested_run(&tests_sample, (char*[]){ "shard", "--shard", "0/2", NULL });
+
+    it("doesn't run anything, and says why") {
+      expect(nested.tests, == , -1);
+      expect(nested.output to match("--shard requires i/n", text_has));
+    }
+  }
+
+  context("with --shard 3/2") {
+    nested_run(&tests_sample, (char*[]){ "shard", "--shard", "3/2", NULL });
+
+    it("doesn't run anything, and says why") {
+      expect(nested.tests, == , -1);
+      expect(nested.output to match("--shard requires i/n", text_has));
+    }
+  }
+
+  context("with --reporter junit") {
+    char path[] = "/tmp/cspec_junit_XXXXXX";
+    char arg[64];
+    nested_temp(path);
+    snprintf(arg, sizeof(arg), "junit:%s", path);
+    nested_run(&tests_sample, (char*[]){ "junit", "--reporter", arg, NULL });
+    const char* xml = nested_read(path);
+
+    it("writes a test suite with the counts of the run") {
+      expect(xml to match("<?xml version=\"1.0\"", text_has));
+      expect(xml to match(
+        "<testsuites name=\"cspec\" tests=\"6\" failures=\"1\"", text_has
+      ));
+      expect(text_count(xml, "<testsuite name=\"" __FILE__ "\""), == , 1);
+      expect(text_count(xml, "</testsuite>\n</testsuites>"), == , 1);
+    }
+
+    it("writes a test case for each test, named by its group and path") {
+      expect(text_count(xml, "<testcase classname="), == , 6);
+      expect(xml to match(
+        "classname=\"" __FILE__ ".sample_two\" name=\"it fails\"", text_has
+      ));
+      expect(xml to match(
+        "classname=\"" __FILE__ ".sample_three\" name=\"in a context", text_has
+      ));
+    }
+
+    it("writes a failure element for the test that failed") {
+      expect(text_count(xml, "<failure message="), == , 1);
+      expect(text_count(xml, "</failure>\n    </testcase>"), == , 1);
+      expect(xml to match("expected 2 == 3", text_has));
+    }
+
+    it("times the run, the suite and each test case") {
+      expect(text_count(xml, " time=\""), == , 8);
+    }
+  }
+
+  context("with --reporter tap") {
+    nested_run(&tests_sample, (char*[]){ "tap", "--reporter", "tap", NULL });
+
+    it("writes a line for each test in place of the console") {
+      expect(nested.output to match("TAP version 13\n", text_has));
+      expect(text_count(nested.output, "\nok "), == , 5);
+      expect(text_count(nested.output, "\nnot ok "), == , 1);
+      expect(nested.output to not match("Tests passed:", text_has));
+    }
+
+    it("ends with the plan") {
+      expect(nested.output to match("\n1..6\n", text_has));
+    }
+
+    it("describes the failure in a YAML block") {
+      expect(nested.output to match(
+        "not ok 3 - sample_two: it fails\n  ---\n  message: \"", text_has
+      ));
+      expect(nested.output to match("  duration_ms: ", text_has));
+      expect(text_count(nested.output, "  ...\n"), == , 1);
+    }
+  }
+
+  context("with --trace") {
+    char path[] = "/tmp/cspec_trace_XXXXXX";
+    nested_temp(path);
+    nested_run(&tests_sample, (char*[]){ "trace", "--trace", path, NULL });
+    const char* json = nested_read(path);
+
+    it("writes a JSON array of trace events") {
+      expect(json to match("[\n{\"ph\":\"M\"", text_has));
+      expect(cspec_strrstr(json, "}\n]\n"));
+    }
+
+    it("pairs every span that begins with one that ends") {
+      expect(text_count(json, "\"ph\":\"B\""), > , 0);
+      expect(text_count(json, "\"ph\":\"B\""), == ,
+        text_count(json, "\"ph\":\"E\"")
+      );
+      expect(spans_nest(json));
+    }
+
+    it("has a span for the suite, each group and each test") {
+      expect(text_count(json, "\"cat\":\"suite\""), == , 1);
+      expect(text_count(json, "\"cat\":\"group\""), == , 3);
+      expect(text_count(json, "\"cat\":\"test\""), == , 6);
+      expect(json to match("\"name\":\"it fails\",\"cat\":\"test\"", text_has));
+    }
+  }
+
+  context("with tests that print") {
+    nested_run(&tests_output_sample, (char*[]){ "output", "-v", NULL });
+
+    it("writes earlier lines before the next test prints anything") {
+      const char* passed = strstr(nested.output, "passes before the test");
+      const char* printed = strstr(nested.output, "printed by the test");
+      expect(passed != NULL);
+      expect(printed != NULL);
+      expect(passed < printed);
+    }
+
+    it("grows the buffer for lines that don't fit") {
+      expect(nested.output to match("xxxxxend", text_has));
+      expect(nested.failed, == , 0);
+    }
+  }
+
+#ifdef open
+
+  context("with tests that log from threads") {
+    nested_run(&tests_thread_sample, (char*[]){ "threads", "-vn", NULL });
+
+    it("prints what the threads logged and warned in the order it was made") {
+      const char* order[] = {
+        "first, from the test", "second, from a thread",
+        "third, a warning from a thread", "fourth, from another thread",
+        "fifth, from the test"
+      };
+      const char* at = nested.output;
+      for (int i = 0; i < 5; ++i) {
+        at = strstr(at, order[i]);
+        expect(at != NULL);
+      }
+      expect(nested.failed, == , 0);
+    }
+
+    it("keeps the order of each thread's logs when they run at once") {
+      expect(text_count(nested.output, " message "), == , 32);
+      for (int thread = 0; thread < 4; ++thread) {
+        const char* at = nested.output;
+        for (int i = 0; i < 8; ++i) {
+          char message[32];
+          snprintf(message, sizeof(message), "thread %d message %d", thread, i);
+          at = strstr(at, message);
+          expect(at != NULL);
+        }
+      }
+    }
+
+    it("finishes the run with a thread still warning") {
+      expect(nested.tests, == , 3);
+      expect(nested.failed, == , 0);
+    }
+  }
+
+#endif
+
+  context("with a test that crashes") {
+    nested_run(&tests_crash_sample, (char*[]){ "crash", "-n", NULL });
+
+    it("writes out what was waiting before the process ends") {
+      expect(nested.failed, == , -1);
+      expect(nested.output to match("logged before the crash", text_has));
+    }
+  }
+
+  context("with floats in failures, as events") {
+    nested_run(&tests_float_sample,
+      (char*[]){ "floats", "--events", "ndjson", NULL }
+    );
+
+    it("prints floats with the shortest digits for a float") {
+      expect(nested.output to match(
+        "{\"type\":\"float\",\"value\":\"0.1\"},"
+        "{\"type\":\"float\",\"value\":\"0.3\"}", text_has
+      ));
+      expect(nested.output to match(
+        "{\"type\":\"float\",\"value\":\"3.4028235e+38\"},"
+        "{\"type\":\"float\",\"value\":\"1.1754944e-38\"}", text_has
+      ));
+    }
+
+    it("prints doubles with the shortest digits that read back the same") {
+      expect(nested.output to match(
+        "\"value\":\"0.30000000000000004\"},"
+        "{\"type\":\"double\",\"value\":\"0.3333333333333333\"}", text_has
+      ));
+      expect(nested.output to match(
+        "\"value\":\"5e-324\"},"
+        "{\"type\":\"double\",\"value\":\"1.7976931348623157e+308\"}",
+        text_has
+      ));
+      expect(float_read(nested.output, "0.3000"), == ,
+        float_sample_sum, double
+      );
+      expect(float_read(nested.output, "0.3333"), == ,
+        float_sample_third, double
+      );
+    }
+
+    it("switches to exponents only for very large and small magnitudes") {
+      expect(nested.output to match(
+        "\"value\":\"1e+300\"},{\"type\":\"double\",\"value\":\"1e-300\"}",
+        text_has
+      ));
+      expect(nested.output to match(
+        "\"value\":\"123456\"},{\"type\":\"double\",\"value\":\"0.000125\"}",
+        text_has
+      ));
+    }
+
+    it("prints nan, inf and negative zero by name") {
+      expect(nested.output to match(
+        "\"value\":\"nan\"},{\"type\":\"double\",\"value\":\"-inf\"}",
+        text_has
+      ));
+      expect(nested.output to match(
+        "\"value\":\"-0\"},{\"type\":\"double\",\"value\":\"inf\"}",
+        text_has
+      ));
+    }
+  }
+
+  context("with --events ndjson and an event longer than its buffer") {
+    nested_run(&tests_events_sample,
+      (char*[]){ "events", "--events", "ndjson", NULL }
+    );
+
+    it("writes what the test printed before the event") {
+      const char* printed = strstr(nested.output, "printed by the test\n");
+      const char* failure = strstr(nested.output, "{\"event\":\"failure\"");
+      expect(printed != NULL);
+      expect(failure != NULL);
+      expect(printed < failure);
+    }
+
+    it("writes the whole event on one line") {
+      const char* failure = strstr(nested.output, "{\"event\":\"failure\"");
+      expect(failure != NULL);
+      const char* end = strchr(failure, '\n');
+      expect(end != NULL);
+      expect(end - failure, > , 20000);
+      expect(end[-1], == , '}', char);
+      const char* next = "\n{\"event\":\"test_end\"";
+      expect(strncmp(end, next, strlen(next)), == , 0);
+    }
+  }
+
+#ifdef malloc
+
+  context("with --global-memory") {
+    cspec_add_reporter(&ledger_reporter);
+    nested_run(&tests_ledger_sample,
+      (char*[]){ "ledger", "--global-memory", NULL }
+    );
+    cspec_remove_reporter(&ledger_reporter);
+
+    it("still counts frees in tests that only count") {
+      expect(nested.tests, == , 5);
+      expect(nested.failed, == , 0);
+    }
+
+    it("reports what's still live at exit") {
+      expect(nested.output to match("global memory warning:", text_has));
+      expect(nested.output to match("280 bytes in 2 allocations", text_has));
+    }
+
+    it("flags the cache that kept growing") {
+      expect(nested.output to match("from 4 tests (keeps growing)", text_has));
+    }
+
+    it("reports the suite's allocation as coming from one test") {
+      expect(nested.output to match("24 bytes in 1 allocations, from 1 tests", text_has));
+    }
+  }
+
+  context("with --global-memory and blocks from outside of tests") {
+    nested_run(&tests_global_sample,
+      (char*[]){ "global", "--global-memory", NULL }
+    );
+
+    it("lets tests keep a cache, and free blocks from before the run") {
+      expect(nested.tests, == , 4);
+      expect(nested.failed, == , 0);
+    }
+
+    it("reports the cache as coming from the test that built it") {
+      expect(nested.output to match(
+        "48 bytes in 1 allocations live at exit", text_has
+      ));
+      expect(nested.output to match(
+        "] it builds the cache on first use (test_global_sample", text_has
+      ));
+    }
+  }
+
+  context("with buffers that grow by reallocating") {
+    nested_run(&tests_realloc_sample, (char*[]){ "realloc", NULL });
+
+    it("passes both tests") {
+      expect(nested.tests, == , 2);
+      expect(nested.passed, == , 2);
+    }
+
+    it("warns once, for the buffer that grew by a constant amount") {
+      expect(nested.warnings, == , 1);
+      expect(text_count(nested.output, "realloc: additive growth"), == , 1);
+      expect(nested.output to match("(+1 bytes per call)", text_has));
+      expect(nested.output to match("sizes: 2, 3, 4, 5, 6, 7, 8", text_has));
+    }
+  }
+
+  context("with --events ndjson and memory errors") {
+    nested_run(&tests_memory_error_sample,
+      (char*[]){ "memory", "--events", "ndjson", NULL }
+    );
+
+    it("reports both tests as failing") {
+      expect(nested.tests, == , 2);
+      expect(nested.passed, == , 0);
+    }
+
+    it("has no block for a pointer that was never allocated") {
+      const char* line = strstr(nested.output, "free: invalid pointer");
+      expect(line != NULL);
+      const char* end = strchr(line, '\n');
+      expect(end != NULL);
+      const char* block = strstr(line, "\"block\"");
+      expect(block == NULL || block > end);
+      expect(nested.output to match("\"memory_error\":true", text_has));
+    }
+
+    it("includes the block that was overrun") {
+      const char* line = strstr(nested.output, "overruns a block");
+      expect(line != NULL);
+      expect(line to match("\"block\":{\"address\":", text_has));
+      expect(line to match("\"size\":5,\"freed\":false}", text_has));
+    }
+  }
+
+#endif
+
+#endif
+
+}
+
+describe(contexts) {
+
+}
+
+#ifndef PI
+#define PI 3.1415926535897932384626f
+#endif
+
+describe(expect_basic) {
+
+  const char* str = "Test string";
+
+  context("using the basic format without commas") {
+
+    context("tests succeed") {
+
+      test("most basic equality check") {
+        expect(2 == 2);
+      }
+
+      test("boolean (aka, macroed) values") {
+        expect(TRUE != FALSE);
+      }
+
+      test("float macro value") {
+        expect(PI > 1);
+      }
+
+      test("using other operator") {
+        expect(2 < 3);
+      }
+
+      test("string compare") {
+        expect(cspec_strcmp(str, "Test string"));
+      }
+
+      test("more string funcs") {
+        expect(cspec_strrstr(str, "string"));
+      }
+
+    }
+
+    context("tests fail") {
+
+      expect(to_fail);
+
+      test("most basic equality check") {
+        expect(2 == 3);
+      }
+
+      test("boolean (aka, macroed) values") {
+        expect(TRUE == FALSE);
+      }
+
+      test("float macro value") {
+        expect(PI < 1);
+      }
+
+      test("using other operator") {
+        expect(2 > 3);
+      }
+
+      test("string compare") {
+        expect(cspec_strcmp(str, "Something"));
+      }
+
+      test("more string funcs") {
+        expect(cspec_strrstr(str, "strin"));
+      }
+
+    }
+
+  }
+
+}
+
+describe(expect_deduced_triplet) {
+
+  float pi = PI;
+
+  context("using the basic format but with commas") {
+
+    context("tests succeed") {
+
+      test("most basic equality check") {
+        expect(2, == , 2);
+      }
+
+      test("boolean (aka, macroed) values") {
+        expect(TRUE, != , FALSE);
+      }
+
+      test("float macro value") {
+        expect(PI, > , 1);
+      }
+
+      test("float variable value") {
+        expect(pi, > , 1);
+      }
+
+      test("using other operator") {
+        expect(2, < , 3);
+      }
+
+      /* Might fail, might not, depends on how your compiler feels that day :P
+      test("comparing strings by address") {
+        const char* a = "indeterminate";
+        const char* b = "indeterminate";
+        expect(a, == , b);
+      } //*/
+
+    }
+
+    context("tests fail") {
+
+      expect(to_fail);
+
+      test("most basic equality check") {
+        expect(2, == , 3);
+      }
+
+      test("most basic equality check (with vars)") {
+        int A = 2, B = 3;
+        expect(A, == , B);
+      }
+
+      test("float macro value (compare with output in expect_basic)") {
+        expect(PI, < , 1);
+      }
+
+      test("float variable value (compare with output in expect_basic)") {
+        expect(pi, < , 1);
+      }
+
+      test("boolean (aka, macroed) values (compare with output in expect_basic)") {
+        expect(TRUE, == , FALSE);
+      }
+
+      test("using other operator") {
+        expect(2, > , 3);
+      }
+
+      test("using other operator (with var)") {
+        double first = 2.0, second = 3.0;
+        expect(first, > , second);
+      }
+
+      test("comparing strings by address") {
+        const char* a = "this is";
+        const char* b = "not this";
+        expect(a, == , b);
+      }
+
+    }
+
+  }
+
+}
+
+describe(expect_basic_var_output) {
+
+  int incrementor = 1;
+  float pi = PI;
+
+  context("basic comparison expectations with value output") {
+    float x = 0.5;
+
+    context("tests succeed") {
+      x = 10;
 
       test("incrementing context-scoped variable (starts at 1)") {
         expect(++incrementor, == , 2, int);
@@ -540,6 +2248,19 @@ describe(expect_basic_var_output) {
         expect(pi, < , x, float);
       }
 
+      test("prints the shortest digits that read back as the same value") {
+        expect(0.1f, == , 0.3f, float);
+      }
+
+      test("prints very large and very small doubles") {
+        expect(1e300, == , 1e-300, double);
+      }
+
+      test("prints non-finite doubles") {
+        double zero = 0.0;
+        expect(zero / zero, == , -1.0 / zero, double);
+      }
+
       test("using boolean values") {
         expect(TRUE, == , FALSE, csBool);
       }
@@ -558,6 +2279,140 @@ describe(expect_basic_var_output) {
 
 }
 
+describe(diffs) {
+
+  const char* text = "The quick brown fox jumps over the lazy dog, then keeps running";
+  const char* other = "The quick brown cat jumps over the lazy dog, then keeps on running";
+  const char bytes[] = "\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0A\x0B\x0C";
+  const char* buffer = bytes;
+
+  it("matches a buffer with the same bytes") {
+    char copy[] = "\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0A\x0B\x0C";
+    expect(buffer to match_bytes(copy, sizeof(copy)));
+  }
+
+  it("doesn't match a buffer with different bytes") {
+    char copy[] = "\x01\x02\x03\x04\x05\x06\x07\x08\x09\x0A\x0B\x0D";
+    expect(buffer to not match_bytes(copy, sizeof(copy)));
+  }
+
+  context("tests fail") {
+
+    expect(to_fail);
+
+    it("shows where long strings differ") {
+      expect(text, == , other);
+    }
+
+    it("shows a line by line diff of strings with newlines") {
+      const char* lines = "first\nsecond\nthird\nfourth\nfifth\nsixth\n";
+      expect(lines to match("first\nsecond\nthird\n4th\nfifth\nsixth\nseventh\n", cspec_strcmp));
+    }
+
+    it("shows where buffers differ") {
+      char copy[] = "\x01\x02\x03\x04\x05\x06\x0F\x07\x08\x09\x0A\x0B";
+      expect(buffer to match_bytes(copy, sizeof(bytes)));
+    }
+
+    it("shows where containers differ when compared piecewise") {
+      int arr[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12 };
+      int exp[] = { 1, 2, 4, 5, 6, 7, 8, 9, 10, 10, 11, 12 };
+      expect(arr to all_be( == , exp[n], int, c_array));
+    }
+
+  }
+
+#ifdef SPEC_NESTED_RUNS
+
+  context("when printed") {
+    nested_run(&tests_diff_sample, (char*[]){ "diffs", NULL });
+
+    it("shows each changed line with the lines around it") {
+      expect(nested.output to match(
+        "@@ -1,6 +1,7 @@\n first\n second\n third\n-fourth\n+4th\n"
+        " fifth\n sixth\n+seventh", text_has_lines
+      ));
+    }
+
+    it("splits changes far apart into hunks") {
+      expect(nested.output to match(
+        "@@ -1,6 +1,6 @@\n 1\n 2\n-3\n+three\n 4\n 5\n 6\n"
+        "@@ -12,7 +12,7 @@\n 12\n 13\n 14\n-15\n+fifteen\n 16\n 17\n 18",
+        text_has_lines
+      ));
+    }
+
+    it("shows the changes in a container in place") {
+      expect(nested.output to match(
+        "at [0]: 1, 2, [-3-], 4, 5, 6, 7, 8, 9, {+10+}, 10, 11, 12", text_has
+      ));
+    }
+
+    it("prints bytes in a container in hex, as the type named") {
+      expect(nested.output to match(
+        "but found 42 on iteration 1\nexpecting 41\nat [0]: 41, [-42-], {+41+}, 43",
+        text_has_lines
+      ));
+    }
+
+    it("shows changes far into a container from the elements before them") {
+      expect(nested.output to match(
+        "but found 150 on iteration 150\nexpecting 0\n"
+        "at [147]: ..., 147, 148, 149, [-150-], {+0+}, 151, 152, 153, ...",
+        text_has_lines
+      ));
+    }
+
+    it("only evaluates each expected value in all_be once") {
+      expect(nested.passed, == , 1);
+      expect(nested.output to not match("compared each element once", text_has));
+    }
+
+    it("cuts a hunk off after enough lines, and says so") {
+      expect(nested.output to match(
+        "-a30\n-a31\n...\n(diff truncated)", text_has_lines
+      ));
+      expect(nested.output to not match("-a32", text_has));
+    }
+
+    it("says when there are too many changes to compare") {
+      expect(nested.output to match(
+        "(too many changes to compare, the rest is shown replaced)", text_has
+      ));
+    }
+  }
+
+  context("when reported as events") {
+    nested_run(&tests_diff_sample,
+      (char*[]){ "diffs", "--events", "ndjson", NULL }
+    );
+
+    it("ends the message with the whole diff") {
+      expect(nested.output to match(
+        "\"message\":\"expected to pass cspec_strcmp(a, (const char*)b_)",
+        text_has
+      ));
+      expect(nested.output to match(
+        "\\n(diff truncated)\",\"expectation\":", text_has
+      ));
+    }
+
+    it("keeps room for the diff after values longer than the report") {
+      expect(nested.output to match(
+        "\"message\":\"expected to pass cspec_strcmp(a, "
+        "(const char*)diff_sample_long_b)\\nparam 1: \\\"", text_has
+      ));
+      expect(nested.output to match(
+        "...\\nat 39984: ...tacaagggtctaagcg[-c-]{+x+}gtcagtcggtcaaagg...\","
+        "\"expectation\":", text_has
+      ));
+    }
+  }
+
+#endif
+
+}
+
 describe(matchers) {
 
   context("compositions on singular values") {
@@ -1127,10 +2982,17 @@ test_suite(tests_cspec) {
   test_group(deduction),
   test_group(tests),
   test_group(memory),
+  test_group(stack),
+  test_group(resources),
+  test_group(threads),
+  test_group(fixtures),
+  test_group(reporters),
+  test_group(runs),
   test_group(contexts),
   test_group(expect_basic),
   test_group(expect_deduced_triplet),
   test_group(expect_basic_var_output),
+  test_group(diffs),
   test_group(matchers),
   test_group(function_matchers),
   test_group(container_matchers),
@@ -30,18 +30,56 @@ extern TestSuite tests_cspec;
 
 // Main
 
+static TestSuite* test_suites[] = {
+  &tests_cspec
+};
+
+static int run_specs(int argc, char* argv[]) {
+  return cspec_run_all(test_suites);
+}
+
 #ifdef __WASM__
 void __attribute((export_name("set_line"))) test_set_line(int line);
 
-static char* argv[] = { "WASM", "-v", "-f" };
+static char* wasm_argv[] = { "WASM", "-v", "-f" };
 int __attribute__((export_name("spec_main"))) spec_main(int argc, int line) {
   test_set_line(line);
+  return run_specs(argc, wasm_argv);
+}
+
+// For the headless runner (web/js/headless.js), which writes its arguments
+//    into this buffer, each ending in a null, then calls spec_main_args.
+static char args_buffer[1024];
+static char* args_argv[64] = { "WASM" };
+
+char* __attribute__((export_name("spec_args"))) spec_args(int size) {
+  return size <= (int)sizeof(args_buffer) ? args_buffer : 0;
+}
+
+int __attribute__((export_name("spec_main_args"))) spec_main_args(int argc) {
+  char* arg = args_buffer;
+  int i = 1;
+  for (; i < argc && i < (int)(sizeof(args_argv) / sizeof(*args_argv)); ++i) {
+    args_argv[i] = arg;
+    while (*arg) ++arg;
+    ++arg;
+  }
+  test_set_line(0);
+  return run_specs(i, args_argv);
+}
+
+// For splitting the groups into shards to run in parallel (web/js/worker.js)
+int __attribute__((export_name("spec_group_count"))) spec_group_count(void) {
+  int count = 0;
+  for (int i = 0; i < (int)ARRAY_COUNT(test_suites); ++i) {
+    for (const TestGroup* t = *test_suites[i]->test_groups; t->line; ++t) {
+      ++count;
+    }
+  }
+  return count;
+}
 #else
 int main(int argc, char* argv[]) {
-#endif
-  TestSuite* test_suites[] = {
-    &tests_cspec
-  };
-
-  return cspec_run_all(test_suites);
+  return run_specs(argc, argv);
 }
+#endif
@@ -0,0 +1,134 @@
+/*******************************************************************************
+* MIT License
+*
+* Copyright (c) 2024 Curtis McCoy
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+
+// Runs the specs built for Web-Assembly in Node, without a browser, for CI.
+//    Output goes to stdout with the same colors as a native build, and the
+//    process exits with the number of failed tests.
+//
+//    usage: node web/js/headless.js [path/to/test.wasm] [spec args...]
+//    ex:    node web/js/headless.js build/wasm/test.wasm -v :120
+
+"use strict";
+
+const fs = require("fs");
+const path = require("path");
+const { performance } = require("perf_hooks");
+
+let args = process.argv.slice(2);
+let wasm_path = path.join(__dirname, "..", "test.wasm");
+if (args.length && args[0].endsWith(".wasm")) {
+  wasm_path = args.shift();
+}
+
+const utf8_decoder = new TextDecoder("utf-8");
+const utf8_encoder = new TextEncoder();
+
+let wasm = null;
+
+let get_str = (index, size) => {
+  let array = new Uint8Array(wasm.exports.memory.buffer);
+  return utf8_decoder.decode(array.subarray(index, index + size));
+};
+
+// Colors come in as 0xRRGGBB, plus 0x1000000 for bold, and each channel is
+//    either all on or all off, so they map straight onto the 8 ANSI colors.
+let ansi = (color) => {
+  let code = 30
+    + (color & 0x00ff0000 ? 1 : 0)
+    + (color & 0x0000ff00 ? 2 : 0)
+    + (color & 0x000000ff ? 4 : 0);
+  return "\x1b[" + (color & 0x1000000 ? "1;" : "0;") + code + "m";
+};
+
+let colorize = (text, color) => {
+  let index = text.indexOf("%c");
+  if (index == -1) return text;
+  return text.slice(0, index)
+    + (color < 0 ? "" : ansi(color))
+    + text.slice(index + 2)
+    + (color < 0 ? "" : "\x1b[0m");
+};
+
+let imports = {
+
+  'js_log': (str, len, color) => {
+    process.stdout.write(colorize(get_str(str, len), color) + "\n");
+  },
+
+  // A batch of lines, each ending in a null, with a color for each one
+  'js_log_lines': (str, len, colors, count) => {
+    let lines = get_str(str, len).split("\0");
+    let color = new Int32Array(wasm.exports.memory.buffer, colors, count);
+    let text = "";
+    for (let i = 0; i < count; ++i) {
+      text += colorize(lines[i], color[i]) + "\n";
+    }
+    process.stdout.write(text);
+  }
+
+};
+
+let run = () => {
+  if (!fs.existsSync(wasm_path)) {
+    console.error(": " + wasm_path + " not found, build it with ./build.sh");
+    return 1;
+  }
+
+  let start = performance.now();
+  let module = new WebAssembly.Module(fs.readFileSync(wasm_path));
+
+  let missing = WebAssembly.Module.imports(module)
+    .filter((imp) => imp.module != "env" || !(imp.name in imports))
+    .map((imp) => imp.module + "." + imp.name);
+  if (missing.length) {
+    console.error(": " + wasm_path + " needs imports that aren't provided: "
+      + missing.join(", "));
+    return 1;
+  }
+
+  wasm = new WebAssembly.Instance(module, { env: imports });
+  let loaded = performance.now();
+
+  // Arguments are written into the module's buffer, each ending in a null
+  let bytes = utf8_encoder.encode(args.map((arg) => arg + "\0").join(""));
+  let buffer = wasm.exports.spec_args(bytes.length);
+  if (!buffer) {
+    console.error(": arguments too long for the spec runner");
+    return 1;
+  }
+  new Uint8Array(wasm.exports.memory.buffer).set(bytes, buffer);
+
+  let failed = wasm.exports.spec_main_args(args.length + 1);
+  let done = performance.now();
+
+  console.error(": loaded " + path.basename(wasm_path)
+    + " in " + (loaded - start).toFixed(1) + " ms"
+    + ", ran in " + (done - loaded).toFixed(1) + " ms");
+
+  // exit codes wrap at 256, so don't let a multiple of it look like a pass
+  return Math.min(failed, 255);
+};
+
+process.exitCode = run();
@@ -28,67 +28,178 @@
 
 window.onload = async () => {
 
-  const utf8_decoder = new TextDecoder("utf-8");
   const html_body = document.getElementById("console");
 
-  let wasm = null;
 
-  let get_str = (index, size) => {
-    let array = new Uint8Array(wasm.exports.memory.buffer);
-    array = array.subarray(index, index + size);
-    return utf8_decoder.decode(array);
+
+  // Each worker's rows go into their own block on the page, so the shards
+  //    read top to bottom in order no matter which one finishes first. Rows
+  //    are collected in a fragment per block and added to the page once per
+  //    frame, so a long run doesn't lay out and scroll the page for every line.
+  let blocks = [];
+  let pending_frame = false;
+
+  let render = () => {
+    for (const block of blocks) {
+      block.container.appendChild(block.pending);
+    }
+    window.scrollTo(0, document.body.scrollHeight);
+    pending_frame = false;
+  };
+
+  let add_block = () => {
+    let block = {
+      container: document.createElement("div"),
+      pending: document.createDocumentFragment()
+    };
+    html_body.appendChild(block.container);
+    blocks.push(block);
+    return block;
   };
 
-  let imports = {
-
-    'js_log': (str, len, color) => {
-      //* // Output to HTML-based "console"
-      let row = document.createElement("div");
-      let text = get_str(str, len);
-      let index = text.indexOf("%c");
-      let fmt = 'color:#' + (color & 0x00ffffff).toString(16).padStart(6, '0');
-      text = text.replace(/ /g, " ");
-      if (color & 0x1000000) fmt += ';font-weight:bold';
-      if (index == -1) {
-        row.innerText = text;
+  let add_row = (block, text, color) => {
+    //* // Output to HTML-based "console"
+    let row = document.createElement("div");
+    let index = text.indexOf("%c");
+    let fmt = 'color:#' + (color & 0x00ffffff).toString(16).padStart(6, '0');
+    text = text.replace(/ /g, " ");
+    if (color & 0x1000000) fmt += ';font-weight:bold';
+    if (index == -1) {
+      row.innerText = text;
+    } else {
+      let first = document.createElement("span");
+      let second = document.createElement("span");
+      first.innerText = text.slice(0, index);
+      second.innerText = text.slice(index + 2);
+      second.style = fmt;
+      row.appendChild(first);
+      row.appendChild(second);
+    }
+    block.pending.appendChild(row);
+    if (!pending_frame) {
+      pending_frame = true;
+      requestAnimationFrame(render);
+    }
+    /*/ // Output to js console
+    if (color < 0) {
+      console.log(text);
+      return;
+    }
+    let fmt = 'color:#' + (color & 0x00ffffff).toString(16).padStart(6, '0');
+    if (color & 0x1000000) {
+      fmt += ';font-weight:bold';
+    }
+    console.log(text, fmt);
+    //*/
+  };
+
+  // The compiled module is kept between runs, and each run gets a fresh
+  //    instance of it (so static state starts over). It's only fetched and
+  //    compiled again once the server says test.wasm has changed.
+  let wasm_module = null;
+  let wasm_version = null;
+  let wasm_groups = 0;
+
+  let wasm_compile = async () => {
+    const head = await fetch("test.wasm", {
+      method: "HEAD", cache: "no-cache"
+    });
+    const version = head.headers.get("etag")
+      || head.headers.get("last-modified");
+    if (wasm_module && version && version == wasm_version) {
+      return wasm_module;
+    }
+    const response = await fetch("test.wasm", { cache: "no-cache" });
+    wasm_module = await WebAssembly.compileStreaming(response);
+    wasm_version = version;
+
+    // Only needed to know how many groups there are to split between workers
+    const instance = await WebAssembly.instantiate(wasm_module, { env: {
+      'js_log': () => { },
+      'js_log_lines': () => { }
+    }});
+    wasm_groups = instance.exports.spec_group_count();
+    return wasm_module;
+  }
+
+  // The specs run in a pool of workers (js/worker.js), each one taking every
+  //    n-th test group with --shard, and streaming its output back here.
+  const pool_size = navigator.hardwareConcurrency || 4;
+  const level_args = [[], [], ["-v"], ["-v", "-f"]];
+  let pool = [];
+  let running = 0;
+
+  let run_shard = (worker, block, args) => new Promise((resolve) => {
+    worker.settle = resolve;
+    worker.onmessage = (e) => {
+      if (e.data.lines) {
+        for (const [text, color] of e.data.lines) {
+          add_row(block, text, color);
+        }
+      } else if (e.data.error) {
+        add_row(block, "Worker failed: " + e.data.error, 0x0ff0000);
+        resolve(1);
       } else {
-        let first = document.createElement("span");
-        let second = document.createElement("span");
-        first.innerText = text.slice(0, index);
-        second.innerText = text.slice(index + 2);
-        second.style = fmt;
-        row.appendChild(first);
-        row.appendChild(second);
-      }
-      html_body.appendChild(row);
-      window.scrollTo(0, document.body.scrollHeight);
-      /*/ // Output to js console
-      if (color < 0) {
-        console.log(get_str(str, len));
-        return;
+        resolve(e.data.failed);
       }
-      let fmt = 'color:#' + (color & 0x00ffffff).toString(16).padStart(6, '0');
-      if (color & 0x1000000) {
-        fmt += ';font-weight:bold';
-      }
-      console.log(get_str(str, len), fmt);
-      //*/
+    };
+    worker.onerror = (e) => {
+      add_row(block, "Worker failed: " + e.message, 0x0ff0000);
+      resolve(1);
+    };
+    worker.postMessage({ module: wasm_module, args: args });
+  });
+
+  let wasm_run = async (level, line) => {
+    try {
+      await wasm_compile();
+    } catch (error) {
+      console.log("Failed to load WASM: " + error);
+      return;
     }
 
-  };
+    // A rerun while shards are still going throws the old workers away, and
+    //    settles what they were running so the old run can return
+    if (running) {
+      pool.forEach((worker) => {
+        worker.terminate();
+        if (worker.settle) worker.settle(0);
+      });
+      pool = [];
+    }
 
-  let wasm_reload = async (op) => {
-    wasm = null;
-    const response = await fetch("test.wasm");
-    await WebAssembly.instantiateStreaming(response, { env: imports })
-    .then((obj) => {
-      wasm = obj.instance;
-      if (!wasm) {
-        console.log("Failed to load WASM");
-      } else {
-        op();
+    let jobs = [];
+    if (line) {
+      jobs.push([...level_args[level], ":" + line]);
+    } else {
+      const count = Math.max(1, Math.min(pool_size, wasm_groups));
+      for (let i = 0; i < count; ++i) {
+        jobs.push([...level_args[level], "--shard", `${i + 1}/${count}`]);
       }
-    });
+    }
+
+    while (pool.length < jobs.length) {
+      pool.push(new Worker(new URL("./worker.js", import.meta.url)));
+    }
+
+    if (pending_frame) render();
+    blocks = [];
+    const start = performance.now();
+    const run = ++running;
+
+    const results = await Promise.all(jobs.map((args, i) =>
+      run_shard(pool[i], add_block(), args)
+    ));
+
+    if (run != running) return;
+    running = 0;
+
+    const failed = results.reduce((total, n) => total + n, 0);
+    const time = ((performance.now() - start) / 1000).toFixed(3);
+    add_row(add_block(),
+      `Ran ${jobs.length} worker(s) in ${time}s: %c${failed} failed`,
+      failed ? 0x1ff0000 : 0x100ff00
+    );
   }
 
   let input_line = document.getElementById("input-line");
@@ -104,21 +215,15 @@ window.onload = async () => {
   }
 
   document.getElementById("btn-retry").onclick = (e) => {
-    wasm_reload(() => {
-      wasm.exports.spec_main(1, line_value());
-    });
+    wasm_run(1, line_value());
   }
 
   document.getElementById("btn-retry-v").onclick = (e) => {
-    wasm_reload(() => {
-      wasm.exports.spec_main(2, line_value());
-    });
+    wasm_run(2, line_value());
   }
 
   document.getElementById("btn-retry-vf").onclick = (e) => {
-    wasm_reload(() => {
-      wasm.exports.spec_main(3, line_value());
-    });
+    wasm_run(3, line_value());
   }
 
   input_line.onkeyup = (e) => {
@@ -130,15 +235,11 @@ window.onload = async () => {
   input_line.onkeydown = (e) => {
     if (e.key == "Enter") {
       input_line.select();
-      wasm_reload(() => {
-        wasm.exports.spec_main(2, line_value());
-      });
+      wasm_run(2, line_value());
     }
   }
 
-  await wasm_reload(() => {
-    wasm.exports.spec_main(2, 0);
-  });
+  await wasm_run(2, 0);
 
   console.log('done');
 }
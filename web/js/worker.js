@@ -0,0 +1,77 @@
+/*******************************************************************************
+* MIT License
+*
+* Copyright (c) 2024 Curtis McCoy
+*
+* Permission is hereby granted, free of charge, to any person obtaining a copy
+* of this software and associated documentation files (the "Software"), to deal
+* in the Software without restriction, including without limitation the rights
+* to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+* copies of the Software, and to permit persons to whom the Software is
+* furnished to do so, subject to the following conditions:
+*
+* The above copyright notice and this permission notice shall be included in all
+* copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+* IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+* FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+* AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+* LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+* OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+* SOFTWARE.
+*/
+
+// Runs one shard of the specs for main.js, off the page's thread. Each job
+//    gets a fresh instance of the compiled module, and printed lines are sent
+//    back in the batches they're flushed in.
+//
+//    job:      { module: WebAssembly.Module, args: [string] }
+//    messages: { lines: [[text, color]] } ... then { failed: number },
+//              or { error: string } if the job couldn't be run
+
+const utf8_decoder = new TextDecoder("utf-8");
+const utf8_encoder = new TextEncoder();
+
+let wasm = null;
+
+let get_str = (index, size) => {
+  let array = new Uint8Array(wasm.exports.memory.buffer);
+  return utf8_decoder.decode(array.subarray(index, index + size));
+};
+
+let imports = {
+
+  'js_log': (str, len, color) => {
+    postMessage({ lines: [[get_str(str, len), color]] });
+  },
+
+  // A batch of lines, each ending in a null, with a color for each one
+  'js_log_lines': (str, len, colors, count) => {
+    let text = get_str(str, len).split("\0");
+    let color = new Int32Array(wasm.exports.memory.buffer, colors, count);
+    let lines = [];
+    for (let i = 0; i < count; ++i) {
+      lines.push([text[i], color[i]]);
+    }
+    postMessage({ lines: lines });
+  }
+
+};
+
+onmessage = (e) => {
+  wasm = new WebAssembly.Instance(e.data.module, { env: imports });
+
+  let args = e.data.args;
+  let bytes = utf8_encoder.encode(args.map((arg) => arg + "\0").join(""));
+  let buffer = wasm.exports.spec_args(bytes.length);
+  if (!buffer) {
+    postMessage({ error: "arguments too long for the spec runner" });
+    wasm = null;
+    return;
+  }
+  new Uint8Array(wasm.exports.memory.buffer).set(bytes, buffer);
+
+  postMessage({ failed: wasm.exports.spec_main_args(args.length + 1) });
+  wasm = null;
+};